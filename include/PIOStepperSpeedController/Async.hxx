@@ -0,0 +1,333 @@
+#pragma once
+
+#include "Stepper.hxx"
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <utility>
+
+namespace PIOStepperSpeedController {
+
+class Executor;
+
+/**
+Something the Executor can resume: a Task about to start, or a coroutine
+suspended on one of the AsyncStepper awaitables. Queues are linked through
+these nodes, which live in the coroutine frames, so nothing is allocated to
+wait or to resume.
+*/
+class Resumable {
+public:
+  Resumable() = default;
+  Resumable(const Resumable &) = delete;
+  Resumable &operator=(const Resumable &) = delete;
+  inline ~Resumable();
+
+protected:
+  std::coroutine_handle<> myHandle;
+
+private:
+  friend class Executor;
+  template <typename S> friend class AsyncStepper;
+
+  Resumable *myNext = nullptr;
+  Executor *myExecutor = nullptr; // set while queued to run
+};
+
+/**
+Single threaded executor. It never blocks and never allocates: RunOnce()
+resumes whatever has become ready since the last call and returns, so it
+fits into a bare metal main loop next to Update(), or into a host event loop
+in tests.
+
+eg.
+  while (true) {
+    stepper.Update();
+    executor.RunOnce();
+  }
+*/
+class Executor {
+public:
+  Executor() = default;
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  void Schedule(Resumable &aResumable) {
+    if (aResumable.myExecutor != nullptr) {
+      return;
+    }
+    aResumable.myExecutor = this;
+    aResumable.myNext = nullptr;
+    if (myTail != nullptr) {
+      myTail->myNext = &aResumable;
+    } else {
+      myHead = &aResumable;
+    }
+    myTail = &aResumable;
+  }
+
+  /**
+  @brief Resumes everything that was ready when called, in the order it
+  became ready. Anything that becomes ready meanwhile waits for the next call.
+  @return The number of coroutines resumed
+  */
+  size_t RunOnce() {
+    Resumable *last = myTail;
+    size_t count = 0;
+    while (myHead != nullptr) {
+      Resumable *next = Pop();
+      count++;
+      // next may be gone once resumed, only its address is compared
+      next->myHandle.resume();
+      if (next == last) {
+        break;
+      }
+    }
+    return count;
+  }
+
+  bool IsIdle() const { return myHead == nullptr; }
+
+private:
+  friend class Resumable;
+
+  Resumable *Pop() {
+    Resumable *head = myHead;
+    myHead = head->myNext;
+    if (myHead == nullptr) {
+      myTail = nullptr;
+    }
+    head->myNext = nullptr;
+    head->myExecutor = nullptr;
+    return head;
+  }
+
+  void Remove(Resumable &aResumable) {
+    Resumable *previous = nullptr;
+    for (Resumable *node = myHead; node != nullptr; node = node->myNext) {
+      if (node == &aResumable) {
+        (previous != nullptr ? previous->myNext : myHead) = node->myNext;
+        if (myTail == node) {
+          myTail = previous;
+        }
+        break;
+      }
+      previous = node;
+    }
+    aResumable.myNext = nullptr;
+    aResumable.myExecutor = nullptr;
+  }
+
+  Resumable *myHead = nullptr;
+  Resumable *myTail = nullptr;
+};
+
+Resumable::~Resumable() {
+  if (myExecutor != nullptr) {
+    myExecutor->Remove(*this);
+  }
+}
+
+/**
+A coroutine run by an Executor, eg.
+
+  Task Jog(AsyncStepper<PIOStepper> &aStepper) {
+    co_await aStepper.ReachSpeed(2000);
+    co_await aStepper.StepsElapsed(400);
+    aStepper.GetStepper().Stop();
+    co_await aStepper.Stopped();
+  }
+
+  Task jog = Jog(asyncStepper);
+  jog.Start(executor);
+
+The frame is allocated once, when the Task is created. Starting, waiting and
+resuming do not allocate. The Task owns the frame, it must outlive the
+coroutine or be destroyed to cancel it.
+*/
+class Task {
+public:
+  class promise_type : public Resumable {
+  public:
+    Task get_return_object() {
+      myHandle = std::coroutine_handle<promise_type>::from_promise(*this);
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  Task(Task &&anOther) noexcept
+      : myHandle(std::exchange(anOther.myHandle, nullptr)) {}
+  Task &operator=(Task &&anOther) noexcept {
+    if (this != &anOther) {
+      Destroy();
+      myHandle = std::exchange(anOther.myHandle, nullptr);
+    }
+    return *this;
+  }
+  ~Task() { Destroy(); }
+
+  /// Queues the coroutine to run from its start on the next RunOnce()
+  void Start(Executor &anExecutor) {
+    if (myHandle && !myHandle.done()) {
+      anExecutor.Schedule(myHandle.promise());
+    }
+  }
+
+  bool IsDone() const { return !myHandle || myHandle.done(); }
+
+private:
+  explicit Task(std::coroutine_handle<promise_type> aHandle)
+      : myHandle(aHandle) {}
+
+  void Destroy() {
+    if (myHandle) {
+      myHandle.destroy();
+      myHandle = nullptr;
+    }
+  }
+
+  std::coroutine_handle<promise_type> myHandle;
+};
+
+/**
+Awaitable events of one stepper: it observes the stepper (see
+Stepper::SetObserver()) and hands coroutines waiting on it to the executor
+when the matching state transition or step happens. Waiting coroutines are
+kept in an intrusive list, so checking them on each step costs one pass over
+the coroutines currently waiting and nothing else.
+*/
+template <typename S> class AsyncStepper : private StepperObserver {
+public:
+  enum class Event { SPEED, STOPPED, STEPS };
+
+  class Awaiter : public Resumable {
+  public:
+    Awaiter(AsyncStepper &anOwner, Event anEvent, float aFrequency = 0,
+            uint32_t aStartCount = 0, uint32_t aSteps = 0)
+        : myOwner(anOwner), myEvent(anEvent), myFrequency(aFrequency),
+          myStartCount(aStartCount), mySteps(aSteps) {}
+
+    ~Awaiter() { myOwner.Remove(*this); }
+
+    bool await_ready() const { return IsMet(); }
+    void await_suspend(std::coroutine_handle<> aHandle) {
+      myHandle = aHandle;
+      myOwner.Add(*this);
+    }
+    void await_resume() const {}
+
+  private:
+    friend class AsyncStepper;
+
+    bool IsMet() const {
+      const S &stepper = myOwner.myStepper;
+      switch (myEvent) {
+      case Event::SPEED:
+        return stepper.GetState() == StepperState::COASTING &&
+               IsEq(stepper.GetCurrentFrequency(), myFrequency);
+      case Event::STOPPED:
+        return stepper.GetState() == StepperState::STOPPED;
+      case Event::STEPS: {
+        // Steps discarded by an emergency stop can take the count back
+        // below the start, that is not a wrap
+        int32_t elapsed =
+            static_cast<int32_t>(stepper.GetStepCount() - myStartCount);
+        return elapsed >= 0 && static_cast<uint32_t>(elapsed) >= mySteps;
+      }
+      }
+      return false;
+    }
+
+    AsyncStepper &myOwner;
+    Event myEvent;
+    float myFrequency;
+    uint32_t myStartCount;
+    uint32_t mySteps;
+    Awaiter *myNextWaiting = nullptr;
+    bool myIsWaiting = false;
+  };
+
+  AsyncStepper(S &aStepper, Executor &anExecutor)
+      : myStepper(aStepper), myExecutor(anExecutor) {
+    myStepper.SetObserver(this);
+  }
+
+  ~AsyncStepper() { myStepper.SetObserver(nullptr); }
+
+  AsyncStepper(const AsyncStepper &) = delete;
+  AsyncStepper &operator=(const AsyncStepper &) = delete;
+
+  S &GetStepper() { return myStepper; }
+
+  /**
+  @brief Sets the target speed, starting the stepper if it is stopped or
+  stopping, and resumes once it coasts at that speed (capped to the maximum
+  speed).
+  */
+  Awaiter ReachSpeed(uint32_t aSpeedHz) {
+    myStepper.SetTargetHz(aSpeedHz);
+    StepperState state = myStepper.GetState();
+    if (state == StepperState::STOPPED || state == StepperState::STOPPING) {
+      myStepper.Start();
+    }
+    return Awaiter(*this, Event::SPEED, myStepper.GetRequestedFrequency());
+  }
+
+  /// Resumes once the stepper is stopped, immediately if it already is
+  Awaiter Stopped() { return Awaiter(*this, Event::STOPPED); }
+
+  /// Resumes once aSteps more steps have been output
+  Awaiter StepsElapsed(uint32_t aSteps) {
+    return Awaiter(*this, Event::STEPS, 0, myStepper.GetStepCount(), aSteps);
+  }
+
+private:
+  void OnTransition(StepperState) override { Wake(); }
+  void OnStep(uint32_t) override { Wake(); }
+
+  void Add(Awaiter &anAwaiter) {
+    anAwaiter.myNextWaiting = myWaiting;
+    anAwaiter.myIsWaiting = true;
+    myWaiting = &anAwaiter;
+  }
+
+  void Remove(Awaiter &anAwaiter) {
+    if (!anAwaiter.myIsWaiting) {
+      return;
+    }
+    for (Awaiter **link = &myWaiting; *link != nullptr;
+         link = &(*link)->myNextWaiting) {
+      if (*link == &anAwaiter) {
+        *link = anAwaiter.myNextWaiting;
+        break;
+      }
+    }
+    anAwaiter.myIsWaiting = false;
+  }
+
+  // Moves every waiter whose event has happened to the executor
+  void Wake() {
+    Awaiter **link = &myWaiting;
+    while (*link != nullptr) {
+      Awaiter *awaiter = *link;
+      if (awaiter->IsMet()) {
+        *link = awaiter->myNextWaiting;
+        awaiter->myIsWaiting = false;
+        myExecutor.Schedule(*awaiter);
+      } else {
+        link = &awaiter->myNextWaiting;
+      }
+    }
+  }
+
+  S &myStepper;
+  Executor &myExecutor;
+  Awaiter *myWaiting = nullptr;
+};
+
+} // namespace PIOStepperSpeedController
@@ -1,19 +1,202 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <stdexcept>
+
 namespace PIOStepperSpeedController {
+
+/**
+Converts between frequencies and PIO clock ticks for a given system clock and
+prescaler. Everything is constexpr so that a Converter built from a constant
+StepperConfig (see StepperConfig.hxx) is folded away by the compiler. The
+exceptions only matter at runtime, in a constant expression they turn an
+invalid configuration into a compile error.
+*/
 class Converter {
 public:
-  Converter(uint32_t aSysClk = 125000000, uint32_t aPrescaler = 1);
+  constexpr Converter(uint32_t aSysClk = 125000000, uint32_t aPrescaler = 1)
+      : mySysClk(aSysClk), myPrescaler(aPrescaler) {
+    if (aPrescaler == 0) {
+      throw std::invalid_argument("Prescaler cannot be zero");
+    }
+  }
+
+  constexpr uint32_t ToPeriod(float aFrequencyHz) const {
+    if (aFrequencyHz <= 0) {
+      throw std::invalid_argument("Frequency must be positive");
+    }
+    return static_cast<uint32_t>((static_cast<float>(mySysClk) / myPrescaler) /
+                                 aFrequencyHz);
+  }
+
+  constexpr float ToFrequency(uint32_t aPeriodTicks) const {
+    if (aPeriodTicks == 0) {
+      throw std::invalid_argument("Period cannot be zero");
+    }
+    return static_cast<float>(mySysClk) / (myPrescaler * aPeriodTicks);
+  }
+
+  /**
+  PIO ticks per step spent outside the two delay loops of the
+  StepperSpeedController program: pull, out, out, set, set and mov, plus the
+  extra pass each jmp x-- loop makes. Checked against the program in
+  test_PioProgram.cxx.
+  */
+  static constexpr uint32_t STEP_OVERHEAD_TICKS = 8;
+
+  /// Largest count of each 16 bit delay loop
+  static constexpr uint32_t MAX_DELAY_COUNT = 0xFFFF;
+
+  /// Shortest and longest periods one step word can output, in PIO ticks
+  static constexpr uint32_t MIN_STEP_PERIOD = STEP_OVERHEAD_TICKS;
+  static constexpr uint32_t MAX_STEP_PERIOD =
+      2 * MAX_DELAY_COUNT + STEP_OVERHEAD_TICKS;
+
+  /**
+  @brief The word PIOStepper pushes to the StepperSpeedController program for
+  one step at aFrequencyHz: the high and low delay loop counts in the upper
+  and lower 16 bits. The program's fixed overhead is taken off the period
+  first, so the step comes out at the period ToPeriod() gives rather than
+  STEP_OVERHEAD_TICKS later. Periods outside MIN_STEP_PERIOD to
+  MAX_STEP_PERIOD are clamped to them. Also what a recorded step stream
+  holds, see StepStream.hxx, so playback is identical to live planning.
+  */
+  constexpr uint32_t ToStepWord(float aFrequencyHz) const {
+    uint32_t period =
+        std::clamp(ToPeriod(aFrequencyHz), MIN_STEP_PERIOD, MAX_STEP_PERIOD);
+    uint32_t delay = period - STEP_OVERHEAD_TICKS;
+    // An odd tick goes to the low half. A count of 0 is fine, the jmp x--
+    // falls straight through and the register is reloaded before next use.
+    uint32_t high = delay >> 1;
+    uint32_t low = delay - high;
+    return (high << 16) | low;
+  }
+
+  /**
+  @brief Whether a step program has raised the step pin for the last word it
+  pulled, from its program counter relative to the program's offset. The
+  word waits to be output from the pull (0) up to aRisenPc, the first
+  instruction after the rising edge: StepperSpeedController_offset_delay_high
+  or StepperFixedPulse_offset_pulse. With the TX FIFO empty too, the driver
+  has latched every step queued.
+  */
+  static constexpr bool IsLastStepRisen(uint32_t aPc, uint32_t aRisenPc) {
+    return aPc == 0 || aPc >= aRisenPc;
+  }
+
+  /// The period in PIO ticks that a step word really outputs
+  static constexpr uint32_t ToStepPeriod(uint32_t aStepWord) {
+    return (aStepWord >> 16) + (aStepWord & MAX_DELAY_COUNT) +
+           STEP_OVERHEAD_TICKS;
+  }
+
+  /// The fastest step rate the StepperSpeedController program can output
+  constexpr float GetMaxStepFrequency() const {
+    return ToFrequency(MIN_STEP_PERIOD);
+  }
+
+  /**
+  @brief The slowest step rate the StepperSpeedController program can output,
+  set by its 16 bit delay loops. About 953 Hz at prescaler 1, ToStepWord()
+  clamps anything slower to it.
+  */
+  constexpr float GetMinStepFrequency() const {
+    return ToFrequency(MAX_STEP_PERIOD);
+  }
+
+  /**
+  PIO ticks per step of the StepperFixedPulse program outside the pulse and
+  low delay loops: pull, mov and mov, plus the extra pass each loop makes.
+  Checked against the program in test_PioProgram.cxx.
+  */
+  static constexpr uint32_t FIXED_PULSE_OVERHEAD_TICKS = 5;
+
+  /**
+  @brief The pulse count StepperFixedPulse holds in y for a step pulse at
+  least aPulseWidthNs long. The pulse is the count plus 2 ticks.
+  */
+  constexpr uint32_t ToPulseCount(uint32_t aPulseWidthNs) const {
+    uint64_t perTick = 1000000000ull * myPrescaler;
+    uint64_t ticks =
+        (static_cast<uint64_t>(aPulseWidthNs) * mySysClk + perTick - 1) /
+        perTick;
+    return ticks > 2 ? static_cast<uint32_t>(ticks - 2) : 0;
+  }
+
+  /**
+  @brief The word PIOStepper pushes to the StepperFixedPulse program for one
+  step at aFrequencyHz with aPulseCount from ToPulseCount(): the whole word is
+  the low delay count, what is left of the period after the pulse and the
+  overhead. Periods shorter than the pulse allows are clamped to it.
+  */
+  constexpr uint32_t ToFixedPulseWord(float aFrequencyHz,
+                                      uint32_t aPulseCount) const {
+    uint64_t period = ToPeriod(aFrequencyHz);
+    uint64_t fixed = static_cast<uint64_t>(aPulseCount) +
+                     FIXED_PULSE_OVERHEAD_TICKS;
+    return period > fixed ? static_cast<uint32_t>(period - fixed) : 0;
+  }
+
+  /// The period in PIO ticks that a StepperFixedPulse word really outputs
+  static constexpr uint64_t ToFixedPulsePeriod(uint32_t aWord,
+                                               uint32_t aPulseCount) {
+    return static_cast<uint64_t>(aWord) + aPulseCount +
+           FIXED_PULSE_OVERHEAD_TICKS;
+  }
+
+  /// The fastest step rate StepperFixedPulse can output with aPulseCount
+  constexpr float GetMaxFixedPulseFrequency(uint32_t aPulseCount) const {
+    return ToFrequency(aPulseCount + FIXED_PULSE_OVERHEAD_TICKS);
+  }
+
+  /*
+  df = acceleration * ((sysclk/(prescaler * f)) * prescaler / sysclk)
+           = acceleration * (1/f)
+   */
+  constexpr float CalculateNextFrequency(float currentFrequency,
+                                         int32_t anAcceleration) const {
+    if (anAcceleration == 0) {
+      return currentFrequency;
+    }
+
+    // Convert frequency to period in ticks
+    uint32_t currentPeriodTicks = ToPeriod(currentFrequency);
+
+    // Calculate time for one period in seconds
+    float periodInSeconds =
+        static_cast<float>(currentPeriodTicks * myPrescaler) / mySysClk;
+
+    // Calculate frequency change for this period
+    float deltaFreq = static_cast<float>(anAcceleration) * periodInSeconds;
+
+    return currentFrequency + deltaFreq;
+  }
+
+  /**
+  @brief Worst case time in microseconds for a new frequency to reach the pin
+  when aQueuedSteps steps at aFrequencyHz are ahead of it, plus the one that
+  is currently being output.
+  */
+  constexpr float ToReactionLatencyUs(float aFrequencyHz,
+                                      uint32_t aQueuedSteps) const {
+    uint32_t periodTicks = ToPeriod(aFrequencyHz);
+    float periodUs =
+        static_cast<float>(periodTicks) * myPrescaler * 1000000.0f / mySysClk;
+    return periodUs * (aQueuedSteps + 1);
+  }
+
+  /// PIO clock ticks per second, sysclk / prescaler
+  constexpr float GetTickHz() const {
+    return static_cast<float>(mySysClk) / myPrescaler;
+  }
 
-  uint32_t ToPeriod(float aFrequencyHz) const;
-  float ToFrequency(uint32_t aPeriodTicks) const;
-  float CalculateNextFrequency(float currentFrequency,
-                               int32_t anAcceleration) const;
+  constexpr uint32_t GetSysClk() const { return mySysClk; }
+  constexpr uint32_t GetPrescaler() const { return myPrescaler; }
 
 private:
   uint32_t mySysClk;
   uint32_t myPrescaler;
 };
 
-} // namespace PIOStepperSpeedController
\ No newline at end of file
+} // namespace PIOStepperSpeedController
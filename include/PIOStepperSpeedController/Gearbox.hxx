@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace PIOStepperSpeedController {
+
+enum class GearboxState {
+  DISENGAGED,
+  ENGAGING, // ramping towards the input rate times the ratio
+  LOCKED    // at speed, following the input pulse for pulse
+};
+
+/**
+Electronic gearbox: makes a stepper follow an external pulse train, such as a
+spindle encoder or another axis' step output, at a ratio of
+aNumerator/aDenominator output steps per input pulse.
+
+The input is measured by the PulseTimer PIO program, which pushes the length
+of every input period. The gearbox turns that into an input frequency and,
+once locked, also counts input pulses against output steps. The phase error
+between them is fed back into the commanded frequency so the output does not
+drift, in position, from the input over time. Drive() hands the commanded
+frequency to the stepper as its target, so engaging and disengaging are still
+limited by the stepper's acceleration and deceleration.
+
+An input too slow for the stepper's minimum speed, eg. a stopped spindle,
+stops the stepper instead of leaving it at the minimum. The phase count is
+dropped, and the gearbox engages again from scratch once the input is back
+up to speed, so the steps taken while stopping are not made up for.
+
+It is plain logic with no hardware access, PIOStepper feeds it. See
+PIOStepper::EnableGearbox().
+*/
+class Gearbox {
+public:
+  /// Cycles per count of the PulseTimer loops
+  static constexpr uint32_t PULSE_TIMER_CYCLES_PER_COUNT = 2;
+
+  /// Cycles per period not counted by the PulseTimer loops
+  static constexpr uint32_t PULSE_TIMER_OVERHEAD_CYCLES = 5;
+
+  /**
+  Largest phase correction, as a fraction of the input rate times the ratio.
+  Keeps a large error (eg. after the input stalls) from commanding a jump in
+  speed.
+  */
+  static constexpr float MAX_CORRECTION = 0.25f;
+
+  /**
+  The phase error is corrected over this many output steps. Shorter tracks
+  tighter but reacts more to jitter on the input.
+  */
+  static constexpr float CORRECTION_STEPS = 16.0f;
+
+  /**
+  @param aTickHz Clock of the PulseTimer state machine in Hz, normally the
+  sysclk since it runs undivided.
+  @param aNumerator Output steps per aDenominator input pulses
+  @param aDenominator Input pulses per aNumerator output steps
+  */
+  Gearbox(float aTickHz, uint32_t aNumerator = 1, uint32_t aDenominator = 1)
+      : myTickHz(aTickHz), myNumerator(aNumerator),
+        myDenominator(aDenominator) {}
+
+  /// Converts a word pushed by the PulseTimer program to PIO cycles
+  static constexpr uint32_t PulseTimerToTicks(uint32_t aCount) {
+    return aCount * PULSE_TIMER_CYCLES_PER_COUNT + PULSE_TIMER_OVERHEAD_CYCLES;
+  }
+
+  void SetRatio(uint32_t aNumerator, uint32_t aDenominator) {
+    myNumerator = aNumerator;
+    myDenominator = aDenominator;
+    ResetPhase();
+  }
+
+  uint32_t GetNumerator() const { return myNumerator; }
+  uint32_t GetDenominator() const { return myDenominator; }
+
+  void Engage() {
+    if (myState == GearboxState::DISENGAGED) {
+      myState = GearboxState::ENGAGING;
+    }
+  }
+
+  void Disengage() {
+    myState = GearboxState::DISENGAGED;
+    myIsStalled = false;
+    ResetPhase();
+  }
+
+  GearboxState GetState() const { return myState; }
+
+  /**
+  @brief Call for every input period measured by the PulseTimer.
+  @param aPeriodTicks Length of the period in ticks of aTickHz
+  */
+  void OnInputPulse(uint32_t aPeriodTicks) {
+    if (aPeriodTicks == 0) {
+      return;
+    }
+    myInputFrequency = myTickHz / aPeriodTicks;
+    mySecondsSinceInput = 0;
+    if (myState == GearboxState::LOCKED) {
+      myPhaseError += myNumerator;
+    }
+  }
+
+  /**
+  @brief Call for every step output, with the frequency it was output at.
+  Also how the gearbox keeps time, to notice the input slowing down or
+  stopping between pulses.
+  */
+  void OnOutputStep(float aFrequency) {
+    if (aFrequency <= 0) {
+      return;
+    }
+    mySecondsSinceInput += 1.0f / aFrequency;
+
+    switch (myState) {
+    case GearboxState::DISENGAGED:
+      break;
+    case GearboxState::ENGAGING:
+      // Lock once the ramp has caught up, counting starts from here so the
+      // steps spent accelerating are not made up for afterwards
+      if (myInputFrequency > 0 &&
+          std::abs(aFrequency - GetRatioFrequency()) <=
+              LOCK_TOLERANCE * GetRatioFrequency()) {
+        myState = GearboxState::LOCKED;
+        ResetPhase();
+      }
+      break;
+    case GearboxState::LOCKED:
+      myPhaseError -= myDenominator;
+      break;
+    }
+  }
+
+  /**
+  @brief Input frequency in Hz. If the input has gone quiet for longer than
+  its last period, this decays as if the next pulse were arriving now, so a
+  stopped spindle brings the output down instead of leaving it running at the
+  last measured rate.
+  */
+  float GetInputFrequency() const {
+    if (mySecondsSinceInput > 0 &&
+        mySecondsSinceInput * myInputFrequency > 1.0f) {
+      return 1.0f / mySecondsSinceInput;
+    }
+    return myInputFrequency;
+  }
+
+  /// The input frequency times the ratio, without phase correction
+  float GetRatioFrequency() const {
+    return GetInputFrequency() * myNumerator / myDenominator;
+  }
+
+  /**
+  @brief Phase error in 1/aDenominator output steps, positive when the output
+  is behind the input. Only counted while LOCKED.
+  */
+  int64_t GetPhaseError() const { return myPhaseError; }
+
+  /// GetPhaseError() in output steps
+  float GetPhaseErrorSteps() const {
+    return static_cast<float>(myPhaseError) / myDenominator;
+  }
+
+  /**
+  @brief The frequency the output should run at: the ratio frequency plus,
+  once locked, a correction that closes the phase error over
+  CORRECTION_STEPS steps. 0 when disengaged.
+  */
+  float GetCommandedFrequency() const {
+    if (myState == GearboxState::DISENGAGED) {
+      return 0;
+    }
+    float ratioFrequency = GetRatioFrequency();
+    if (myState != GearboxState::LOCKED) {
+      return ratioFrequency;
+    }
+    float correction =
+        ratioFrequency * GetPhaseErrorSteps() / CORRECTION_STEPS;
+    float limit = ratioFrequency * MAX_CORRECTION;
+    return ratioFrequency + std::clamp(correction, -limit, limit);
+  }
+
+  /**
+  @brief Hands the commanded frequency to the stepper as its target, call
+  once per output step while engaged, and while the stepper is stopped for a
+  stalled input. Below the stepper's minimum speed it stops the stepper,
+  and starts it again once the input is back. Acceleration and deceleration
+  are left to the stepper.
+  */
+  template <typename S> void Drive(S &aStepper) {
+    if (myState == GearboxState::DISENGAGED) {
+      return;
+    }
+    float commanded = GetCommandedFrequency();
+    if (commanded < aStepper.GetMinFrequency()) {
+      if (!myIsStalled) {
+        myIsStalled = true;
+        myState = GearboxState::ENGAGING;
+        ResetPhase();
+        aStepper.Stop();
+      }
+      return;
+    }
+    aStepper.SetTargetFrequency(commanded);
+    if (myIsStalled) {
+      myIsStalled = false;
+      aStepper.Start();
+    }
+  }
+
+  /// True while the input is too slow to follow and the stepper is stopped
+  bool IsStalled() const { return myIsStalled; }
+
+private:
+  /// Relative speed error at which ENGAGING becomes LOCKED
+  static constexpr float LOCK_TOLERANCE = 0.01f;
+
+  void ResetPhase() { myPhaseError = 0; }
+
+  float myTickHz;
+  uint32_t myNumerator;
+  uint32_t myDenominator;
+  float myInputFrequency = 0;
+  float mySecondsSinceInput = 0;
+  int64_t myPhaseError = 0;
+  GearboxState myState = GearboxState::DISENGAGED;
+  bool myIsStalled = false;
+};
+
+} // namespace PIOStepperSpeedController
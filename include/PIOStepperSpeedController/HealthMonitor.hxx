@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace PIOStepperSpeedController {
+
+/// A copy of the health counters at one point in time, see HealthMonitor
+struct HealthSnapshot {
+  /// Update() calls measured
+  uint32_t updates;
+  /// CPU cycles spent in Update(), not counting waits for room in the FIFO
+  uint32_t minUpdateCycles;
+  uint32_t avgUpdateCycles;
+  uint32_t maxUpdateCycles;
+  /**
+  Pushes after which the state machine was found to have stalled on an empty
+  FIFO while running, ie. a step went out late. Stalls between two pushes
+  count once.
+  */
+  uint32_t txStalls;
+  /// Longest time between two pushes while running, in microseconds
+  uint32_t longestPushGapUs;
+  /**
+  Fewest steps still queued when the next one was pushed, once the queue has
+  started filling after a start. 0 means the state machine was about to run
+  dry, UINT32_MAX that it has not been measured yet (with a queue depth of
+  1, until a stall).
+  */
+  uint32_t minFifoHeadroom;
+};
+
+/**
+Counters that show whether the main loop keeps up with the state machine.
+They cost a few compares per step, so they can be left on in production and
+polled with GetSnapshot() to prove a build can feed its stepper at full speed:
+no stalls and some headroom left.
+
+It is plain logic with no hardware access, PIOStepper feeds it the cycle
+counts, times, FIFO levels and stall flags. See PIOStepper::GetHealth().
+*/
+class HealthMonitor {
+public:
+  HealthMonitor() { Reset(); }
+
+  /**
+  @brief Call when the state machine is started. The first push after it is
+  not judged, the FIFO was empty and the state machine idle by design, and
+  the headroom is not judged until the queue has started to fill.
+  */
+  void OnStart() {
+    myHasPushed = false;
+    myIsFilled = false;
+  }
+
+  /// Call once per Update() with the cycles it took
+  void OnUpdate(uint32_t aCycles) {
+    myUpdates++;
+    myTotalUpdateCycles += aCycles;
+    myMinUpdateCycles = std::min(myMinUpdateCycles, aCycles);
+    myMaxUpdateCycles = std::max(myMaxUpdateCycles, aCycles);
+  }
+
+  /**
+  @brief Call for every word pushed to the FIFO.
+  @param aTimeUs Time of the push, a free running microsecond counter
+  @param aQueuedSteps FIFO level just before the push
+  @param aStalled Whether the state machine stalled on an empty FIFO since
+  the previous push
+  */
+  void OnPush(uint32_t aTimeUs, uint32_t aQueuedSteps, bool aStalled) {
+    if (myHasPushed) {
+      myLongestPushGapUs =
+          std::max(myLongestPushGapUs, aTimeUs - myLastPushUs);
+      // A stall means it did run dry, whether or not the queue ever filled
+      myIsFilled = myIsFilled || aQueuedSteps > 0 || aStalled;
+      if (myIsFilled) {
+        myMinFifoHeadroom = std::min(myMinFifoHeadroom, aQueuedSteps);
+      }
+      if (aStalled) {
+        myTxStalls++;
+      }
+    }
+    myHasPushed = true;
+    myLastPushUs = aTimeUs;
+  }
+
+  HealthSnapshot GetSnapshot() const {
+    return {myUpdates,
+            myUpdates > 0 ? myMinUpdateCycles : 0,
+            myUpdates > 0
+                ? static_cast<uint32_t>(myTotalUpdateCycles / myUpdates)
+                : 0,
+            myMaxUpdateCycles,
+            myTxStalls,
+            myLongestPushGapUs,
+            myMinFifoHeadroom};
+  }
+
+  /// Clears the counters, eg. after a snapshot has been reported
+  void Reset() {
+    myUpdates = 0;
+    myTotalUpdateCycles = 0;
+    myMinUpdateCycles = UINT32_MAX;
+    myMaxUpdateCycles = 0;
+    myTxStalls = 0;
+    myLongestPushGapUs = 0;
+    myMinFifoHeadroom = UINT32_MAX;
+  }
+
+private:
+  uint32_t myUpdates;
+  uint64_t myTotalUpdateCycles;
+  uint32_t myMinUpdateCycles;
+  uint32_t myMaxUpdateCycles;
+  uint32_t myTxStalls;
+  uint32_t myLongestPushGapUs;
+  uint32_t myMinFifoHeadroom;
+  uint32_t myLastPushUs = 0;
+  bool myHasPushed = false;
+  bool myIsFilled = false;
+};
+
+} // namespace PIOStepperSpeedController
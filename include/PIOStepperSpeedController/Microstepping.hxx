@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+
+namespace PIOStepperSpeedController {
+
+/// One microstep resolution of the driver
+struct MicrostepLevel {
+  /**
+  User steps per step output at this resolution. User steps are the finest
+  resolution's microsteps, the unit of every frequency and count of the
+  stepper. A power of two.
+  */
+  uint32_t scale;
+  /// Levels of the microstep select pins, bit 0 is the first pin
+  uint32_t pins;
+  /**
+  Fastest speed in user steps/s to run at this resolution, above it the next
+  coarser level is selected. Ignored for the coarsest level.
+  */
+  float maxHz;
+};
+
+/**
+Automatic microstep switching: picks the driver's microstep resolution from
+the speed, so that at high speed each step output moves the motor further
+and the step rate the PIO and the driver can take goes further.
+
+The stepper keeps planning in user steps (the finest microsteps), its
+frequencies and step count do not change unit. A step output at a level of
+scale k stands for k user steps and is output at 1/k of the user frequency,
+so position and velocity are continuous across a switch. The resolution only
+changes at full step boundaries (the user step count a multiple of
+aStepsPerFullStep), where the driver's phase currents are the same at every
+resolution, so it never lands between the coarser resolution's positions.
+
+Going down a level waits until the speed is HYSTERESIS below the threshold,
+so a speed that sits on a threshold does not switch back and forth.
+
+It is plain logic with no hardware access, PIOStepper feeds it. See
+PIOStepper::EnableMicrostepping().
+*/
+class MicrostepSelector {
+public:
+  static constexpr size_t MAX_LEVELS = 8;
+
+  /// Coarsest scale a level may have, full steps of a 1/256 driver
+  static constexpr uint32_t MAX_SCALE = 256;
+
+  /// Fraction below a threshold the speed drops to before going finer again
+  static constexpr float HYSTERESIS = 0.1f;
+
+  /// A single level of scale 1, which never switches
+  MicrostepSelector() : myLevelCount(1), myStepsPerFullStep(1) {
+    myLevels[0] = MicrostepLevel{1, 0, 0};
+  }
+
+  /**
+  @param aStepsPerFullStep User steps per full step, eg. 16 when the finest
+  resolution is 1/16 stepping
+  @param aLevels From the finest resolution, scale 1, to the coarsest, with
+  increasing scales and thresholds. Each scale divides aStepsPerFullStep
+  and is at most MAX_SCALE.
+  */
+  MicrostepSelector(uint32_t aStepsPerFullStep,
+                    std::initializer_list<MicrostepLevel> aLevels)
+      : myLevelCount(0), myStepsPerFullStep(aStepsPerFullStep) {
+    if (aLevels.size() == 0 || aLevels.size() > MAX_LEVELS) {
+      throw std::invalid_argument("Between 1 and MAX_LEVELS levels");
+    }
+    if (aLevels.begin()->scale != 1) {
+      throw std::invalid_argument("The finest level must have a scale of 1");
+    }
+    for (const MicrostepLevel &level : aLevels) {
+      if (level.scale == 0 || (level.scale & (level.scale - 1)) != 0 ||
+          aStepsPerFullStep % level.scale != 0) {
+        throw std::invalid_argument(
+            "Scales must be powers of two dividing the steps per full step");
+      }
+      if (level.scale > MAX_SCALE) {
+        throw std::invalid_argument("Scales must be at most MAX_SCALE");
+      }
+      if (myLevelCount > 0) {
+        const MicrostepLevel &previous = myLevels[myLevelCount - 1];
+        if (level.scale <= previous.scale) {
+          throw std::invalid_argument("Scales must increase");
+        }
+        if (myLevelCount > 1 &&
+            previous.maxHz <= myLevels[myLevelCount - 2].maxHz) {
+          throw std::invalid_argument("Thresholds must increase");
+        }
+      }
+      myLevels[myLevelCount++] = level;
+    }
+  }
+
+  /**
+  @brief Picks the level for the step about to be output, call once per step
+  before converting it.
+  @param aFrequency The step's frequency in user steps/s
+  @param aPosition User steps output before this one
+  @return true if the level changed, the new level applies to this step
+  */
+  bool Select(float aFrequency, uint32_t aPosition) {
+    if (aPosition % myStepsPerFullStep != 0) {
+      return false;
+    }
+    size_t level = myLevel;
+    while (level + 1 < myLevelCount && aFrequency > myLevels[level].maxHz) {
+      level++;
+    }
+    while (level > 0 &&
+           aFrequency < myLevels[level - 1].maxHz * (1.0f - HYSTERESIS)) {
+      level--;
+    }
+    bool changed = level != myLevel;
+    myLevel = level;
+    return changed;
+  }
+
+  /// Back to the finest level, eg. when stopped
+  void Reset() { myLevel = 0; }
+
+  const MicrostepLevel &GetLevel() const { return myLevels[myLevel]; }
+  size_t GetLevelIndex() const { return myLevel; }
+  size_t GetLevelCount() const { return myLevelCount; }
+  uint32_t GetScale() const { return myLevels[myLevel].scale; }
+  uint32_t GetMaxScale() const { return myLevels[myLevelCount - 1].scale; }
+  uint32_t GetStepsPerFullStep() const { return myStepsPerFullStep; }
+
+private:
+  std::array<MicrostepLevel, MAX_LEVELS> myLevels{};
+  size_t myLevelCount;
+  size_t myLevel = 0;
+  uint32_t myStepsPerFullStep;
+};
+
+} // namespace PIOStepperSpeedController
@@ -0,0 +1,265 @@
+#pragma once
+
+#include "Converter.hxx"
+#include "Stepper.hxx"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace PIOStepperSpeedController {
+
+/**
+The planner of N steppers in one object, with each field of the profile
+(current frequency, target, ramp rates, state) kept in its own array, so
+that one Update() advances every axis in a few tight loops over contiguous
+memory. The ramp arithmetic, the state transitions and the step words are
+computed for all axes in loops without branches, which the compiler can
+vectorize; the transitions are masks of the state and the comparisons.
+
+Each axis steps exactly as a Stepper with the same parameters and calls
+would: the same frequencies, in the same order, and the same step words as
+PIOStepper pushes with the SYMMETRIC program. What it leaves out is what
+differs per instance: callbacks, observers, segmented ramps and microstep
+switching. All axes share one sysclk and prescaler.
+
+eg. feeding the state machines of 4 axes
+  MultiAxisPlanner<4> planner;
+  planner.Configure(0, 10, 20000, 5000, 5000);
+  ...
+  std::array<uint32_t, 4> words;
+  uint32_t stepped = planner.Update(words);
+  for (size_t i = 0; i < 4; i++) {
+    if (stepped & (1u << i)) {
+      pio_sm_put_blocking(pio, sm[i], words[i]);
+    }
+  }
+*/
+template <size_t N> class MultiAxisPlanner {
+  static_assert(N > 0 && N <= 32, "One bit per axis in Update()'s result");
+
+public:
+  MultiAxisPlanner(uint32_t aSysClk = 125000000, uint32_t aPrescaler = 1)
+      : myConverter(aSysClk, aPrescaler), myTickHz(myConverter.GetTickHz()),
+        mySysClk(static_cast<float>(aSysClk)), myPrescaler(aPrescaler) {
+    for (size_t i = 0; i < N; i++) {
+      Configure(i, 1, 1, 1, 1);
+    }
+  }
+
+  static constexpr size_t GetAxisCount() { return N; }
+
+  /**
+  @brief Sets the profile of an axis and stops it, the parameters are those
+  of the Stepper constructor. Speeds are capped to what the clock allows, as
+  Stepper does, and the minimum is raised to the slowest step word, see
+  Converter::GetMinStepFrequency(). A maximum below the minimum is raised to
+  it.
+  */
+  void Configure(size_t anAxis, float aMinSpeed, float aMaxSpeed,
+                 uint32_t anAcceleration, uint32_t aDeceleration) {
+    CheckAxis(anAxis);
+    myMin[anAxis] = std::max(myConverter.GetMinStepFrequency(), aMinSpeed);
+    myMax[anAxis] = std::max(
+        std::min(myConverter.ToFrequency(1), aMaxSpeed), myMin[anAxis]);
+    // As Converter::CalculateNextFrequency() converts them
+    myAcceleration[anAxis] =
+        static_cast<float>(static_cast<int32_t>(anAcceleration));
+    myDeceleration[anAxis] =
+        static_cast<float>(-static_cast<int32_t>(aDeceleration));
+    myFastDeceleration[anAxis] = myDeceleration[anAxis];
+    myActiveDeceleration[anAxis] = myDeceleration[anAxis];
+    myCurrent[anAxis] = myMin[anAxis];
+    myRequested[anAxis] = myMin[anAxis];
+    myState[anAxis] = STOPPED;
+  }
+
+  void SetFastStopDeceleration(size_t anAxis, uint32_t aDeceleration) {
+    CheckAxis(anAxis);
+    myFastDeceleration[anAxis] =
+        static_cast<float>(-static_cast<int32_t>(aDeceleration));
+    if (myIsFastStopping[anAxis]) {
+      myActiveDeceleration[anAxis] = myFastDeceleration[anAxis];
+    }
+  }
+
+  /// As Stepper::SetTargetFrequency()
+  void SetTargetFrequency(size_t anAxis, float aFrequencyHz) {
+    CheckAxis(anAxis);
+    myRequested[anAxis] =
+        std::clamp(aFrequencyHz, myMin[anAxis], myMax[anAxis]);
+  }
+
+  /// As Stepper::Start()
+  void Start(size_t anAxis) {
+    CheckAxis(anAxis);
+    if (myState[anAxis] == STOPPED) {
+      myCurrent[anAxis] = myMin[anAxis];
+    }
+    SetFastStopping(anAxis, false);
+    myState[anAxis] = STARTING;
+  }
+
+  /// As Stepper::Stop()
+  void Stop(size_t anAxis) {
+    CheckAxis(anAxis);
+    if (myState[anAxis] <= STOPPING) {
+      return;
+    }
+    myState[anAxis] = STOPPING;
+  }
+
+  /// As Stepper::FastStop()
+  void FastStop(size_t anAxis) {
+    CheckAxis(anAxis);
+    if (myState[anAxis] == STOPPED) {
+      return;
+    }
+    SetFastStopping(anAxis, true);
+    myState[anAxis] = STOPPING;
+  }
+
+  /// As Stepper::EmergencyStop(), the caller aborts the state machine
+  void EmergencyStop(size_t anAxis) {
+    CheckAxis(anAxis);
+    SetFastStopping(anAxis, false);
+    myCurrent[anAxis] = myMin[anAxis];
+    myState[anAxis] = STOPPED;
+  }
+
+  StepperState GetState(size_t anAxis) const {
+    return static_cast<StepperState>(myState[anAxis]);
+  }
+
+  /// As Stepper::GetCurrentFrequency(), 0 when stopped
+  float GetCurrentFrequency(size_t anAxis) const {
+    return GetState(anAxis) == StepperState::STOPPED ? 0 : myCurrent[anAxis];
+  }
+
+  /**
+  @brief Advances every running axis by one step, as one Stepper::Update()
+  per axis would. An axis that finishes stopping outputs no step and becomes
+  STOPPED, its state machine can then be disabled.
+  @param aWords The step word for each axis. Only those of the axes that
+  stepped are meaningful.
+  @return Bit i set if axis i stepped
+  */
+  uint32_t Update(std::array<uint32_t, N> &aWords) {
+    for (size_t i = 0; i < N; i++) {
+      uint32_t state = myState[i];
+      float current = myCurrent[i];
+      float min = myMin[i];
+      float max = myMax[i];
+      float requested = myRequested[i];
+
+      // Both ramps, as Converter::CalculateNextFrequency() computes them.
+      // The period is at most MAX_STEP_PERIOD (see Configure()), so it and
+      // the prescaler are exact as floats and their product is rounded once,
+      // as the integer product is when it is converted.
+      int32_t period = static_cast<int32_t>(myTickHz / current);
+      float seconds = static_cast<float>(period) * myPrescaler / mySysClk;
+      float up = current + myAcceleration[i] * seconds;
+      float down = current + myActiveDeceleration[i] * seconds;
+
+      // The state machine of Stepper::Update() and Stepper::Step() as masks
+      // of the state and the comparisons, one per transition
+      bool isStopped = state == STOPPED;
+      bool isStopping = state == STOPPING;
+      bool isStarting = state == STARTING;
+      float target = isStopping ? min : requested;
+      bool lt = IsLT(current, target);
+      bool gt = IsGT(current, target);
+      bool eq = IsEq(current, target);
+      bool isFinished = isStopping & ((current <= min) | IsEq(current, min));
+      bool accelerates = ((isStarting | (state == ACCELERATING)) & lt) |
+                         ((state == COASTING) & !eq & !gt);
+      bool decelerates = isStopping | (isStarting & !lt & !eq) |
+                         ((state == COASTING) & !eq & gt) |
+                         ((state == DECELERATING) & gt);
+      bool steps = !isStopped & !isFinished;
+
+      float accelerated = up >= max ? max : std::min(up, target);
+      float decelerated = std::max(std::max(down, target), min);
+      float next = accelerates ? accelerated : current;
+      next = decelerates & steps ? decelerated : next;
+      myCurrent[i] = next;
+
+      // The transitions are exclusive, so the next state is their sum; a
+      // chain of selects would be left as branches.
+      uint32_t nextState = COASTING +
+                           accelerates * (ACCELERATING - COASTING) +
+                           decelerates * (DECELERATING - COASTING) +
+                           isStopping * (STOPPING - DECELERATING);
+      myState[i] = steps * nextState;
+      mySteps[i] = steps;
+    }
+
+    // The words, as Converter::ToStepWord()
+    for (size_t i = 0; i < N; i++) {
+      int32_t period = std::clamp(static_cast<int32_t>(myTickHz / myCurrent[i]),
+                                  MIN_PERIOD, MAX_PERIOD);
+      uint32_t delay = period - Converter::STEP_OVERHEAD_TICKS;
+      uint32_t high = delay >> 1;
+      aWords[i] = (high << 16) | (delay - high);
+    }
+
+    uint32_t stepped = 0;
+    for (size_t i = 0; i < N; i++) {
+      stepped |= mySteps[i] << i;
+    }
+    return stepped;
+  }
+
+private:
+  // Converter's step period limits, as the vector lanes hold them
+  static constexpr int32_t MIN_PERIOD = Converter::MIN_STEP_PERIOD;
+  static constexpr int32_t MAX_PERIOD = Converter::MAX_STEP_PERIOD;
+
+  // StepperState as the state array holds it
+  static constexpr uint32_t STOPPED =
+      static_cast<uint32_t>(StepperState::STOPPED);
+  static constexpr uint32_t STOPPING =
+      static_cast<uint32_t>(StepperState::STOPPING);
+  static constexpr uint32_t STARTING =
+      static_cast<uint32_t>(StepperState::STARTING);
+  static constexpr uint32_t ACCELERATING =
+      static_cast<uint32_t>(StepperState::ACCELERATING);
+  static constexpr uint32_t COASTING =
+      static_cast<uint32_t>(StepperState::COASTING);
+  static constexpr uint32_t DECELERATING =
+      static_cast<uint32_t>(StepperState::DECELERATING);
+
+  void SetFastStopping(size_t anAxis, bool isFastStopping) {
+    myIsFastStopping[anAxis] = isFastStopping;
+    myActiveDeceleration[anAxis] = isFastStopping ? myFastDeceleration[anAxis]
+                                                  : myDeceleration[anAxis];
+  }
+
+  static void CheckAxis(size_t anAxis) {
+    if (anAxis >= N) {
+      throw std::invalid_argument("No such axis");
+    }
+  }
+
+  Converter myConverter;
+  float myTickHz;
+  float mySysClk;
+  float myPrescaler;
+
+  // One array per field, indexed by axis. The state is as wide as the
+  // frequencies so the state machine runs in the same vector lanes.
+  std::array<float, N> myCurrent;
+  std::array<float, N> myRequested;
+  std::array<float, N> myMin;
+  std::array<float, N> myMax;
+  std::array<float, N> myAcceleration;       // Hz/s
+  std::array<float, N> myDeceleration;       // negative Hz/s
+  std::array<float, N> myFastDeceleration;   // negative Hz/s
+  std::array<float, N> myActiveDeceleration; // one of the two above
+  std::array<uint32_t, N> myState;           // StepperState
+  std::array<uint32_t, N> mySteps;           // 1 if the axis stepped
+  std::array<bool, N> myIsFastStopping;
+};
+
+} // namespace PIOStepperSpeedController
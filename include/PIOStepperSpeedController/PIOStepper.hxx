@@ -1,33 +1,844 @@
 #pragma once
 
+#include <PIOStepperSpeedController/Gearbox.hxx>
+#include <PIOStepperSpeedController/HealthMonitor.hxx>
+#include <PIOStepperSpeedController/Microstepping.hxx>
+#include <PIOStepperSpeedController/PIOStepperSpeedController.pio.h>
+#include <PIOStepperSpeedController/StepStream.hxx>
 #include <PIOStepperSpeedController/Stepper.hxx>
+#include <cassert>
+#include <concepts>
 #include <cstdint>
+#include <hardware/clocks.h>
+#include <hardware/dma.h>
 #include <hardware/pio.h>
+#include <hardware/structs/systick.h>
+#include <pico/time.h>
 
 namespace PIOStepperSpeedController {
 
-class PIOStepper : public Stepper<PIOStepper> {
+/// The PIO program that turns queued steps into pulses
+enum class StepProgram {
+  /**
+  StepperSpeedController: the period is split into equal high and low halves,
+  16 bits each. The default.
+  */
+  SYMMETRIC,
+  /**
+  StepperFixedPulse: a fixed width pulse, then the rest of the period low,
+  counted in a full 32 bit word. Costs 5 cycles per step instead of 8 and
+  has no 16 bit limit, for drivers that only need a minimum pulse width.
+  */
+  FIXED_PULSE
+};
+
+/**
+The stepper on a PIO state machine. Params is the Stepper's, see
+StepperConfig.hxx: PIOStepper keeps the configuration in the instance, a
+BasicPIOStepper<FixedParams<Config>> makes it a compile time constant.
+
+eg.
+  static constexpr StepperConfig FEED_CONFIG{...};
+  BasicPIOStepper<FixedParams<FEED_CONFIG>> feed(stepPin);
+*/
+template <typename Params = RuntimeParams>
+class BasicPIOStepper : public Stepper<BasicPIOStepper<Params>, Params> {
+  using Base = Stepper<BasicPIOStepper<Params>, Params>;
 
 public:
-  PIOStepper(
+  BasicPIOStepper(
       uint32_t stepPin, float aMinSpeed, float aMaxSpeed,
       uint32_t aAcceleration, uint32_t aDeceleration, uint32_t aSysClk,
       uint32_t aPrescaler = 1,
       ::PIOStepperSpeedController::Callback aStoppedCallback = nullptr,
       ::PIOStepperSpeedController::Callback aCoastingCallback = nullptr,
       ::PIOStepperSpeedController::Callback aAcceleratingCallback = nullptr,
-      ::PIOStepperSpeedController::Callback aDeceleratingCallback = nullptr);
+      ::PIOStepperSpeedController::Callback aDeceleratingCallback = nullptr)
+    requires std::same_as<Params, RuntimeParams>;
+
+  /// Constructor with compile time parameters, see FixedParams
+  explicit BasicPIOStepper(
+      uint32_t stepPin,
+      ::PIOStepperSpeedController::Callback aStoppedCallback = nullptr,
+      ::PIOStepperSpeedController::Callback aCoastingCallback = nullptr,
+      ::PIOStepperSpeedController::Callback aAcceleratingCallback = nullptr,
+      ::PIOStepperSpeedController::Callback aDeceleratingCallback = nullptr)
+    requires(!std::same_as<Params, RuntimeParams>);
+
+  /**
+  Worst case number of state machine cycles between AbortImpl() returning and
+  the step pin being low with nothing left to play. The SM is disabled and
+  the pin is forced low by an exec'd instruction before AbortImpl() returns,
+  so no further SM cycle can produce an edge, regardless of how many steps
+  were queued or how long the step being played was. The CPU time spent in
+  AbortImpl() itself has not been measured on the target and is not given:
+  besides the register writes it reads the FIFO level and the PC to take the
+  dropped steps off the count, and during playback it waits for the DMA
+  abort first.
+  */
+  static constexpr uint32_t EMERGENCY_STOP_LATENCY_CYCLES = 0;
+
+  /// Depth of the TX FIFO in words, each word is one step
+  static constexpr uint32_t FIFO_DEPTH = 4;
+
+  /// Depth of the TX FIFO when it is joined with the unused RX FIFO
+  static constexpr uint32_t JOINED_FIFO_DEPTH = 8;
+
+  /**
+  @brief Sets how many steps may be queued between the planner and the pin.
+  A deep queue rides out a busy main loop for longer, a shallow one lets
+  SetTargetHz() take effect sooner, see GetReactionLatencyUs(). Depths above
+  FIFO_DEPTH join the RX FIFO into the TX FIFO (up to JOINED_FIFO_DEPTH),
+  depths below it are enforced in software by PutStep(). The default is
+  FIFO_DEPTH. Only allowed while stopped, since it reinitializes the state
+  machine.
+  @param aDepth Number of queued steps, 1 to JOINED_FIFO_DEPTH
+  */
+  void SetQueueDepth(uint32_t aDepth);
+
+  uint32_t GetQueueDepth() const { return myQueueDepth; }
+
+  /**
+  @brief Steps waiting in the FIFO, not counting the one being output. While
+  it is below GetQueueDepth(), Update() queues a step without waiting, see
+  StepperScheduler.hxx. A step held back for a microstep switch (see
+  EnableMicrostepping()) fills the queue until the steps before it are out.
+  */
+  uint32_t GetQueuedSteps() const {
+    if (myHasPendingStep && !IsPendingStepReady()) {
+      return myQueueDepth;
+    }
+    return pio_sm_get_tx_fifo_level(myPio, mySm);
+  }
+
+  /// Step pulse width used by SetStepProgram() when none is given
+  static constexpr uint32_t DEFAULT_PULSE_WIDTH_NS = 2500;
+
+  /**
+  @brief Selects the PIO program, see StepProgram. Both are driven by the
+  same planner, only the words pushed per step differ. Only allowed while
+  stopped, and not during playback since recorded streams hold SYMMETRIC
+  words.
+  @param aPulseWidthNs Minimum step pulse width for FIXED_PULSE, from the
+  driver's datasheet. Rounded up to whole PIO cycles. It bounds the top
+  speed, see GetMaxStepFrequency().
+  */
+  void SetStepProgram(StepProgram aProgram,
+                      uint32_t aPulseWidthNs = DEFAULT_PULSE_WIDTH_NS);
+
+  StepProgram GetStepProgram() const { return myStepProgram; }
+
+  /// The fastest step rate the selected program can output, in Hz
+  float GetMaxStepFrequency() const;
+
+  /**
+  @brief The slowest step rate the selected program can output, in Hz. The
+  minimum speed must not be below it: for SYMMETRIC that is about 953 Hz at
+  prescaler 1, raise the prescaler or use FIXED_PULSE for slower steps.
+  */
+  float GetMinStepFrequency() const;
+
+  /**
+  @brief Worst case time in microseconds between SetTargetHz() and the first
+  step at a new frequency leaving the pin, at the current speed: every queued
+  step plus the one being output have to play out first. 0 when stopped.
+  */
+  float GetReactionLatencyUs() const;
+
+  /**
+  @brief Sets up gearbox mode, where the stepper follows the pulses on
+  anInputPin at aNumerator/aDenominator output steps per input pulse. Claims
+  a second state machine running the PulseTimer program to measure the
+  input. Call once, while stopped, then EngageGearbox().
+  @param anInputPin GPIO with the input pulse train, eg. a spindle encoder
+  channel or another driver's step signal
+  */
+  void EnableGearbox(uint32_t anInputPin, uint32_t aNumerator,
+                     uint32_t aDenominator);
+
+  /**
+  @brief Starts following the input. The stepper accelerates to the input
+  rate times the ratio at its normal acceleration, then locks on and tracks
+  the input in phase. If the input becomes too slow for the minimum speed
+  the stepper stops, keep calling Update() and it engages again once the
+  input is back.
+  */
+  void EngageGearbox();
+
+  /// Stops following the input and decelerates to a stop as Stop() does
+  void DisengageGearbox();
+
+  const Gearbox &GetGearbox() const { return myGearbox; }
+
+  /**
+  @brief Drives the driver's microstep select pins from the speed, switching
+  to coarser microstepping above the thresholds of aSelector so the top speed
+  is no longer bound by the step rate, see Microstepping.hxx. Frequencies,
+  the step count and the maximum speed stay in the finest microsteps, the
+  maximum speed only has to be reachable at the coarsest level. Call once,
+  while stopped. Not available for playback, which has one resolution.
+  The driver takes the select pins on a step's rising edge, so the first step
+  at a new resolution is held until the state machine has raised the pin for
+  the last one at the old resolution, and Update() pushes it then without
+  waiting for the steps in between, see GetQueuedSteps().
+  @param aFirstPin First of aPinCount consecutive GPIOs wired to the driver's
+  microstep select inputs (MS1, MS2...)
+  */
+  void EnableMicrostepping(uint32_t aFirstPin, uint32_t aPinCount,
+                           const MicrostepSelector &aSelector);
+
+  const MicrostepSelector &GetMicrostepping() const { return myMicrosteps; }
+
+  /**
+  @brief Plays a recorded step stream (see StepStream.hxx) instead of
+  planning live. Each record is one DMA transfer into the TX FIFO, paced by
+  the FIFO's DREQ, so the CPU only steps in between records. The stream must
+  have been recorded with this stepper's sysclk and prescaler, and must stay
+  in memory until playback ends. Claims a DMA channel on first use. Only
+  allowed while stopped, the planner is not involved and stays STOPPED.
+  Each record's words count in GetStepCount() as it starts.
+  @return false if the stream was recorded for a different clock, the
+  FIXED_PULSE program is selected or microstepping is enabled
+  */
+  bool StartPlayback(const StepStreamReader &aStream);
+
+  /**
+  @brief Starts the next record once the previous one has been handed to the
+  FIFO, call it from the main loop as Update() would be. Once the last
+  record has been handed over it waits for the FIFO to play out, then stops
+  the state machine.
+  @return false once playback has ended, on the first call after the last
+  step has been output
+  */
+  bool UpdatePlayback();
+
+  bool IsPlaying() const { return myIsPlaying; }
+
+  /**
+  @brief Queues one precomputed step word, as the selected program takes it
+  (see Converter::ToStepWord()), eg. a block streamed from a host with
+  ProtocolDevice. The planner is not involved and stays STOPPED, steps are
+  at the finest microstep resolution and each word counts as one step in
+  GetStepCount(). Only allowed while stopped and not playing. Starts the
+  state machine on the first word. Does not wait.
+  @return false if the queue is full
+  */
+  bool PutStepWord(uint32_t aWord);
+
+  /**
+  @brief Stepper::Update(), timed for the health counters. The time spent
+  waiting for room in the FIFO is not counted, only the planning and the
+  push. Timing uses SysTick, which is started on the processor clock if
+  nothing else (eg. an RTOS) has started it.
+  */
+  bool Update();
+
+  /**
+  @brief The health counters since the last ResetHealth(): Update() cost,
+  state machine stalls, push gaps and FIFO headroom, see HealthMonitor.hxx.
+  Cheap enough to poll from another task, eg. to report over serial.
+  */
+  HealthSnapshot GetHealth() const { return myHealth.GetSnapshot(); }
+
+  void ResetHealth() { myHealth.Reset(); }
 
   void EnableImpl();
   void DisableImpl();
+  void AbortImpl();
   bool PutStep(float aFrequency);
 
 private:
+  void Init();
   bool IsSmEnabled();
+  void InitStateMachine();
+  uint32_t ToWord(float aFrequency) const;
+  bool IsLastStepRisen() const;
+  bool IsPendingStepReady() const;
+  void PushPendingStep();
+  void PushWord(uint32_t aWord);
+  void ApplyMicrostepLevel();
+  void ApplyMicrostepScale();
+  void ApplyMicrostepPins();
+  void ReadGearboxInput();
+  void StartPlaybackRecord(const StepRecord &aRecord);
+  static uint32_t ElapsedCycles(uint32_t aStart);
+  bool ReadTxStall();
   PIO myPio;
   uint mySm;
   uint myOffset;
   uint myStepPin;
+  uint32_t myQueueDepth;
+  pio_sm_config myConfig;
+  StepProgram myStepProgram;
+  uint32_t myPulseCount;
+  float myLastFrequency;
+  uint32_t myLastWord;
+
+  Gearbox myGearbox;
+  PIO myTimerPio;
+  uint myTimerSm;
+  uint myTimerOffset;
+
+  StepStreamReader myPlayback;
+  int myDmaChannel;
+  bool myIsPlaying;
+
+  MicrostepSelector myMicrosteps;
+  uint32_t myMicrostepPin;
+  uint32_t myMicrostepMask; // 0 while microstepping is not enabled
+  uint32_t myPendingWord;   // the first step at a new resolution
+  uint32_t myQueuedScale;   // of the steps queued before it
+  bool myHasPendingStep;
+
+  HealthMonitor myHealth;
+  uint32_t myUpdateStart;
+  uint32_t myUpdateCycles;
 };
 
+template <typename Params>
+BasicPIOStepper<Params>::BasicPIOStepper(
+    uint32_t stepPin, float aMinSpeed, float aMaxSpeed, uint32_t aAcceleration,
+    uint32_t aDeceleration, uint32_t aSysClk, uint32_t aPrescaler,
+    ::PIOStepperSpeedController::Callback aStoppedCallback,
+    ::PIOStepperSpeedController::Callback aCoastingCallback,
+    ::PIOStepperSpeedController::Callback aAcceleratingCallback,
+    ::PIOStepperSpeedController::Callback aDeceleratingCallback)
+  requires std::same_as<Params, RuntimeParams>
+    : Base(aMinSpeed, aMaxSpeed, aAcceleration, aDeceleration, aSysClk,
+           aPrescaler, aStoppedCallback, aCoastingCallback,
+           aAcceleratingCallback, aDeceleratingCallback),
+      myStepPin(stepPin), myQueueDepth(FIFO_DEPTH),
+      myStepProgram(StepProgram::SYMMETRIC), myPulseCount(0),
+      myLastFrequency(0), myLastWord(0),
+      myGearbox(aSysClk),
+      myTimerPio(nullptr), myDmaChannel(-1), myIsPlaying(false),
+      myMicrostepPin(0), myMicrostepMask(0), myPendingWord(0),
+      myQueuedScale(1), myHasPendingStep(false),
+      myUpdateStart(0), myUpdateCycles(0) {
+
+  assert(aMinSpeed > 0);
+  assert(aMaxSpeed > 0);
+  assert(aAcceleration > 0);
+  assert(aDeceleration > 0);
+
+  Init();
+}
+
+template <typename Params>
+BasicPIOStepper<Params>::BasicPIOStepper(
+    uint32_t stepPin, ::PIOStepperSpeedController::Callback aStoppedCallback,
+    ::PIOStepperSpeedController::Callback aCoastingCallback,
+    ::PIOStepperSpeedController::Callback aAcceleratingCallback,
+    ::PIOStepperSpeedController::Callback aDeceleratingCallback)
+  requires(!std::same_as<Params, RuntimeParams>)
+    : Base(aStoppedCallback, aCoastingCallback, aAcceleratingCallback,
+           aDeceleratingCallback),
+      myStepPin(stepPin), myQueueDepth(FIFO_DEPTH),
+      myStepProgram(StepProgram::SYMMETRIC), myPulseCount(0),
+      myLastFrequency(0), myLastWord(0),
+      myGearbox(Params::GetConverter().GetSysClk()),
+      myTimerPio(nullptr), myDmaChannel(-1), myIsPlaying(false),
+      myMicrostepPin(0), myMicrostepMask(0), myPendingWord(0),
+      myQueuedScale(1), myHasPendingStep(false),
+      myUpdateStart(0), myUpdateCycles(0) {
+  // FixedParams checks the speeds and ramps at compile time
+  Init();
+}
+
+template <typename Params> void BasicPIOStepper<Params>::Init() {
+  bool success = pio_claim_free_sm_and_add_program_for_gpio_range(
+      &StepperSpeedController_program, &myPio, &mySm, &myOffset, myStepPin, 1,
+      true);
+  assert(success);
+
+  // GPIO setup
+  pio_gpio_init(myPio, myStepPin);
+  pio_gpio_init(myPio, myStepPin + 1);
+  pio_sm_set_consecutive_pindirs(myPio, mySm, myStepPin, 2, true);
+
+  InitStateMachine();
+
+  // Update() is timed with SysTick. Leave it alone if it is already running
+  // (an RTOS tick uses it), ElapsedCycles() copes with any reload value.
+  if (!(systick_hw->csr & M0PLUS_SYST_CSR_ENABLE_BITS)) {
+    systick_hw->rvr = M0PLUS_SYST_RVR_BITS;
+    systick_hw->cvr = 0;
+    systick_hw->csr =
+        M0PLUS_SYST_CSR_ENABLE_BITS | M0PLUS_SYST_CSR_CLKSOURCE_BITS;
+  }
+}
+
+template <typename Params>
+bool BasicPIOStepper<Params>::Update() {
+  // A step held for a microstep switch was planned already, it is this
+  // call's step
+  if (myHasPendingStep) {
+    PushPendingStep();
+    return true;
+  }
+
+  bool wasRunning = this->GetState() != StepperState::STOPPED;
+  // Stopped for a stalled input, only the gearbox can start it again
+  if (!wasRunning && myGearbox.IsStalled()) {
+    ReadGearboxInput();
+    myGearbox.Drive(*this);
+  }
+  myUpdateCycles = 0;
+  myUpdateStart = systick_hw->cvr;
+  bool result = Base::Update();
+  if (wasRunning) {
+    myUpdateCycles += ElapsedCycles(myUpdateStart);
+    myHealth.OnUpdate(myUpdateCycles);
+  }
+  return result;
+}
+
+template <typename Params>
+uint32_t BasicPIOStepper<Params>::ElapsedCycles(uint32_t aStart) {
+  // SysTick counts down and wraps to its reload value
+  uint32_t now = systick_hw->cvr;
+  if (aStart >= now) {
+    return aStart - now;
+  }
+  return aStart + (systick_hw->rvr + 1) - now;
+}
+
+template <typename Params>
+bool BasicPIOStepper<Params>::ReadTxStall() {
+  // Sticky, and cleared by writing a 1
+  uint32_t mask = 1u << (PIO_FDEBUG_TXSTALL_LSB + mySm);
+  if (myPio->fdebug & mask) {
+    myPio->fdebug = mask;
+    return true;
+  }
+  return false;
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::InitStateMachine() {
+  myLastFrequency = 0; // the word for it may have changed
+  if (myStepProgram == StepProgram::FIXED_PULSE) {
+    myConfig = StepperFixedPulse_program_get_default_config(myOffset);
+    sm_config_set_sideset_pins(&myConfig, myStepPin);
+  } else {
+    myConfig = StepperSpeedController_program_get_default_config(myOffset);
+    sm_config_set_sideset_pins(&myConfig, myStepPin + 1);
+  }
+  // AbortImpl() drives the pin low with an exec'd set, for either program
+  sm_config_set_set_pins(&myConfig, myStepPin, 1);
+  sm_config_set_clkdiv(&myConfig, this->GetConverter().GetPrescaler());
+  sm_config_set_fifo_join(&myConfig, myQueueDepth > FIFO_DEPTH
+                                         ? PIO_FIFO_JOIN_TX
+                                         : PIO_FIFO_JOIN_NONE);
+
+  // Initialize and clear
+  pio_sm_init(myPio, mySm, myOffset, &myConfig);
+  pio_sm_clear_fifos(myPio, mySm);
+
+  if (myStepProgram == StepProgram::FIXED_PULSE) {
+    // The pulse count lives in y, which a restart leaves alone
+    pio_sm_put(myPio, mySm, myPulseCount);
+    pio_sm_exec(myPio, mySm, pio_encode_pull(false, true));
+    pio_sm_exec(myPio, mySm, pio_encode_mov(pio_y, pio_osr));
+  }
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::SetQueueDepth(uint32_t aDepth) {
+  assert(aDepth > 0 && aDepth <= JOINED_FIFO_DEPTH);
+  assert(this->GetState() == StepperState::STOPPED);
+
+  myQueueDepth = aDepth;
+  InitStateMachine();
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::SetStepProgram(StepProgram aProgram,
+                                             uint32_t aPulseWidthNs) {
+  assert(this->GetState() == StepperState::STOPPED);
+  assert(!myIsPlaying);
+
+  if (aProgram != myStepProgram) {
+    const pio_program *current = myStepProgram == StepProgram::FIXED_PULSE
+                                     ? &StepperFixedPulse_program
+                                     : &StepperSpeedController_program;
+    const pio_program *next = aProgram == StepProgram::FIXED_PULSE
+                                  ? &StepperFixedPulse_program
+                                  : &StepperSpeedController_program;
+    pio_sm_set_enabled(myPio, mySm, false);
+    pio_remove_program(myPio, current, myOffset);
+    bool success = pio_can_add_program(myPio, next);
+    assert(success);
+    myOffset = pio_add_program(myPio, next);
+    myStepProgram = aProgram;
+  }
+
+  myPulseCount = this->GetConverter().ToPulseCount(aPulseWidthNs);
+  InitStateMachine();
+}
+
+template <typename Params>
+float BasicPIOStepper<Params>::GetMaxStepFrequency() const {
+  if (myStepProgram == StepProgram::FIXED_PULSE) {
+    return this->GetConverter().GetMaxFixedPulseFrequency(myPulseCount);
+  }
+  return this->GetConverter().GetMaxStepFrequency();
+}
+
+template <typename Params>
+float BasicPIOStepper<Params>::GetMinStepFrequency() const {
+  if (myStepProgram == StepProgram::FIXED_PULSE) {
+    // A whole 32 bit word of low delay
+    return this->GetConverter().ToFrequency(UINT32_MAX);
+  }
+  return this->GetConverter().GetMinStepFrequency();
+}
+
+template <typename Params>
+uint32_t BasicPIOStepper<Params>::ToWord(float aFrequency) const {
+  if (myStepProgram == StepProgram::FIXED_PULSE) {
+    return this->GetConverter().ToFixedPulseWord(aFrequency, myPulseCount);
+  }
+  return this->GetConverter().ToStepWord(aFrequency);
+}
+
+template <typename Params>
+float BasicPIOStepper<Params>::GetReactionLatencyUs() const {
+  if (this->GetState() == StepperState::STOPPED) {
+    return 0;
+  }
+  return this->GetConverter().ToReactionLatencyUs(
+      this->GetCurrentFrequency() / this->GetStepScale(), myQueueDepth);
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::EnableGearbox(uint32_t anInputPin,
+                                            uint32_t aNumerator,
+                                            uint32_t aDenominator) {
+  assert(myTimerPio == nullptr);
+  assert(aNumerator > 0 && aDenominator > 0);
+
+  bool success = pio_claim_free_sm_and_add_program(
+      &PulseTimer_program, &myTimerPio, &myTimerSm, &myTimerOffset);
+  assert(success);
+
+  gpio_init(anInputPin);
+  gpio_set_dir(anInputPin, GPIO_IN);
+
+  // Undivided, so the input is measured in sysclk ticks. The RX FIFO is
+  // joined since only the CPU reads from it, more room between reads
+  pio_sm_config c = PulseTimer_program_get_default_config(myTimerOffset);
+  sm_config_set_in_pins(&c, anInputPin);
+  sm_config_set_jmp_pin(&c, anInputPin);
+  sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
+  sm_config_set_clkdiv(&c, 1);
+
+  pio_sm_init(myTimerPio, myTimerSm, myTimerOffset, &c);
+  pio_sm_set_enabled(myTimerPio, myTimerSm, true);
+
+  myGearbox.SetRatio(aNumerator, aDenominator);
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::EngageGearbox() {
+  assert(myTimerPio != nullptr);
+  myGearbox.Engage();
+  this->Start();
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::DisengageGearbox() {
+  myGearbox.Disengage();
+  this->Stop();
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::ReadGearboxInput() {
+  while (!pio_sm_is_rx_fifo_empty(myTimerPio, myTimerSm)) {
+    myGearbox.OnInputPulse(
+        Gearbox::PulseTimerToTicks(pio_sm_get(myTimerPio, myTimerSm)));
+  }
+}
+
+template <typename Params>
+bool BasicPIOStepper<Params>::StartPlayback(const StepStreamReader &aStream) {
+  assert(this->GetState() == StepperState::STOPPED);
+  assert(!myIsPlaying);
+
+  StepStreamHeader header = aStream.GetHeader();
+  if (myStepProgram != StepProgram::SYMMETRIC || myMicrostepMask != 0 ||
+      header.sysClk != this->GetConverter().GetSysClk() ||
+      header.prescaler != this->GetConverter().GetPrescaler()) {
+    return false;
+  }
+
+  if (myDmaChannel < 0) {
+    myDmaChannel = dma_claim_unused_channel(true);
+  }
+
+  myPlayback = aStream;
+  myPlayback.Rewind();
+  myIsPlaying = true;
+  EnableImpl();
+  return UpdatePlayback();
+}
+
+template <typename Params>
+bool BasicPIOStepper<Params>::UpdatePlayback() {
+  if (!myIsPlaying) {
+    return false;
+  }
+  if (dma_channel_is_busy(myDmaChannel)) {
+    return true;
+  }
+
+  StepRecord record;
+  if (myPlayback.Next(record)) {
+    StartPlaybackRecord(record);
+    return true;
+  }
+  // The state machine stalls on the pull once the last word has played
+  if (!pio_sm_is_tx_fifo_empty(myPio, mySm) ||
+      pio_sm_get_pc(myPio, mySm) != myOffset) {
+    return true;
+  }
+  myIsPlaying = false;
+  DisableImpl();
+  return false;
+}
+
+template <typename Params>
+bool BasicPIOStepper<Params>::PutStepWord(uint32_t aWord) {
+  assert(this->GetState() == StepperState::STOPPED);
+  assert(!myIsPlaying);
+
+  if (!IsSmEnabled()) {
+    EnableImpl();
+  }
+  if (pio_sm_get_tx_fifo_level(myPio, mySm) >= myQueueDepth ||
+      pio_sm_is_tx_fifo_full(myPio, mySm)) {
+    return false;
+  }
+  pio_sm_put(myPio, mySm, aWord);
+  this->CountSteps(1);
+  return true;
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::StartPlaybackRecord(const StepRecord &aRecord) {
+  // A run rereads its one word, a literal walks through its words. Either way
+  // the words go to the FIFO untouched, exactly as PutStep() would push them.
+  dma_channel_config c = dma_channel_get_default_config(myDmaChannel);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+  channel_config_set_read_increment(&c, !aRecord.isRun);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_dreq(&c, pio_get_dreq(myPio, mySm, true));
+  dma_channel_configure(myDmaChannel, &c, &myPio->txf[mySm], aRecord.words,
+                        aRecord.count, true);
+  this->CountSteps(aRecord.count);
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::EnableMicrostepping(
+    uint32_t aFirstPin, uint32_t aPinCount, const MicrostepSelector &aSelector) {
+  assert(this->GetState() == StepperState::STOPPED);
+  assert(aPinCount > 0 && aPinCount < 32);
+
+  myMicrosteps = aSelector;
+  myMicrostepPin = aFirstPin;
+  myMicrostepMask = ((1u << aPinCount) - 1) << aFirstPin;
+  gpio_init_mask(myMicrostepMask);
+  gpio_set_dir_out_masked(myMicrostepMask);
+  ApplyMicrostepLevel();
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::ApplyMicrostepLevel() {
+  ApplyMicrostepScale();
+  ApplyMicrostepPins();
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::ApplyMicrostepScale() {
+  this->SetStepScale(myMicrosteps.GetScale());
+  myLastFrequency = 0; // the same frequency is now a different word
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::ApplyMicrostepPins() {
+  gpio_put_masked(myMicrostepMask, myMicrosteps.GetLevel().pins
+                                       << myMicrostepPin);
+}
+
+template <typename Params>
+bool BasicPIOStepper<Params>::IsLastStepRisen() const {
+  uint32_t risenPc = myStepProgram == StepProgram::FIXED_PULSE
+                         ? StepperFixedPulse_offset_pulse
+                         : StepperSpeedController_offset_delay_high;
+  return Converter::IsLastStepRisen(pio_sm_get_pc(myPio, mySm) - myOffset,
+                                    risenPc);
+}
+
+template <typename Params>
+bool BasicPIOStepper<Params>::IsPendingStepReady() const {
+  // The FIFO first: once it is empty nothing more is pulled, so the PC read
+  // after it belongs to the last queued step
+  return pio_sm_is_tx_fifo_empty(myPio, mySm) && IsLastStepRisen();
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::PushPendingStep() {
+  // Only waits if the caller ignored GetQueuedSteps(), as for a full FIFO
+  bool isGeared = myGearbox.GetState() != GearboxState::DISENGAGED;
+  while (!IsPendingStepReady()) {
+    if (isGeared) {
+      ReadGearboxInput();
+    }
+    tight_loop_contents();
+  }
+  ApplyMicrostepPins();
+  PushWord(myPendingWord);
+  myHasPendingStep = false;
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::PushWord(uint32_t aWord) {
+  uint32_t queued = pio_sm_get_tx_fifo_level(myPio, mySm);
+  bool stalled = ReadTxStall();
+  pio_sm_put(myPio, mySm, aWord);
+  myHealth.OnPush(time_us_32(), queued, stalled);
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::EnableImpl() {
+  // The top speed has to be reachable at the coarsest resolution, and the
+  // ramps start at the minimum speed at the finest one
+  assert(!myHasPendingStep);
+  assert(this->GetMaxFrequency() <=
+         GetMaxStepFrequency() * myMicrosteps.GetMaxScale());
+  assert(this->GetMinFrequency() >= GetMinStepFrequency());
+
+  // Starting from stopped, going back to the finest resolution is always
+  // aligned: its positions include every coarser one
+  if (myMicrostepMask != 0) {
+    myMicrosteps.Reset();
+    ApplyMicrostepLevel();
+  }
+  myHealth.OnStart();
+  pio_sm_set_enabled(myPio, mySm, true);
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::DisableImpl() {
+  pio_sm_set_enabled(myPio, mySm, false);
+  gpio_put(myStepPin, 0);
+}
+
+template <typename Params>
+void BasicPIOStepper<Params>::AbortImpl() {
+  // Stop the SM first so nothing else is clocked out, then throw away the
+  // queued steps. The pin belongs to the PIO so gpio_put can't drive it, set
+  // it low from the SM itself and park the PC on the pull so the next
+  // EnableImpl() starts cleanly on a fresh FIFO word. A playback DMA would
+  // refill the FIFO, so it goes first. Queued steps were counted when they
+  // were put, take them back off, with the pulled one whose rising edge is
+  // not out yet and a step held for a microstep switch. Played back words
+  // were counted as their record started, those the DMA had not yet moved
+  // go too.
+  uint32_t unsent = 0;
+  if (myIsPlaying) {
+    dma_channel_abort(myDmaChannel);
+    unsent = dma_channel_hw_addr(myDmaChannel)->transfer_count;
+    myIsPlaying = false;
+  }
+  pio_sm_set_enabled(myPio, mySm, false);
+  unsent +=
+      pio_sm_get_tx_fifo_level(myPio, mySm) + (IsLastStepRisen() ? 0 : 1);
+  uint32_t scale = this->GetStepScale();
+  if (myHasPendingStep) {
+    this->DiscardSteps(unsent * myQueuedScale + scale);
+  } else {
+    this->DiscardSteps(unsent * scale);
+  }
+  myHasPendingStep = false;
+  pio_sm_clear_fifos(myPio, mySm);
+  pio_sm_restart(myPio, mySm);
+  pio_sm_exec(myPio, mySm, pio_encode_set(pio_pins, 0));
+  pio_sm_exec(myPio, mySm, pio_encode_jmp(myOffset));
+}
+
+template <typename Params>
+bool BasicPIOStepper<Params>::IsSmEnabled() {
+  // Check if state machine is enabled using CTRL register
+  return (myPio->ctrl & (1u << (PIO_CTRL_SM_ENABLE_LSB + mySm))) != 0;
+}
+
+template <typename Params>
+bool BasicPIOStepper<Params>::PutStep(float aFrequency) {
+
+  bool is_enabled = IsSmEnabled();
+  assert(is_enabled);
+  assert(!myHasPendingStep); // Update() pushes it before planning
+
+  // A new resolution counts and converts from this step on, its pins follow
+  // once the steps queued before it are out, see PushPendingStep()
+  uint32_t queuedScale = this->GetStepScale();
+  bool isSwitch = myMicrostepMask != 0 &&
+                  myMicrosteps.Select(aFrequency, this->GetStepCount());
+  if (isSwitch) {
+    ApplyMicrostepScale();
+  }
+
+  // Coasting and segmented ramps repeat the frequency, reuse its word
+  if (aFrequency != myLastFrequency) {
+    myLastWord = ToWord(aFrequency / this->GetStepScale());
+    myLastFrequency = aFrequency;
+  }
+  uint32_t packed = myLastWord;
+
+  bool isGeared = myGearbox.GetState() != GearboxState::DISENGAGED;
+
+  // Waiting for room is the state machine's time, not the planner's
+  myUpdateCycles += ElapsedCycles(myUpdateStart);
+
+  if (isSwitch) {
+    // Held rather than waited for, Update() pushes it once it can go
+    myPendingWord = packed;
+    myQueuedScale = queuedScale;
+    myHasPendingStep = true;
+    if (IsPendingStepReady()) {
+      PushPendingStep();
+    }
+  } else {
+    // A queue shallower than the FIFO is kept short here rather than by the
+    // hardware. Keep reading the gearbox input while waiting so that no
+    // input period is dropped when the input is faster than the output.
+    while (pio_sm_get_tx_fifo_level(myPio, mySm) >= myQueueDepth ||
+           pio_sm_is_tx_fifo_full(myPio, mySm)) {
+      if (isGeared) {
+        ReadGearboxInput();
+      }
+      tight_loop_contents();
+    }
+    PushWord(packed);
+  }
+  myUpdateStart = systick_hw->cvr;
+
+  if (isGeared) {
+    ReadGearboxInput();
+    // The gearbox counts in the planner's steps
+    for (uint32_t i = 0; i < this->GetStepScale(); i++) {
+      myGearbox.OnOutputStep(aFrequency);
+    }
+    myGearbox.Drive(*this);
+  }
+
+  return true;
+}
+
+extern template class BasicPIOStepper<RuntimeParams>;
+
+/// The PIO stepper with its configuration set by the constructor
+using PIOStepper = BasicPIOStepper<RuntimeParams>;
+
 } // namespace PIOStepperSpeedController
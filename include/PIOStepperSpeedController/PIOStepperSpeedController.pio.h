@@ -16,6 +16,8 @@
 #define StepperSpeedController_wrap 7
 #define StepperSpeedController_pio_version 0
 
+#define StepperSpeedController_offset_delay_high 4u
+
 static const uint16_t StepperSpeedController_program_instructions[] = {
             //     .wrap_target
     0x80a0, //  0: pull   block
@@ -47,3 +49,81 @@ static inline pio_sm_config StepperSpeedController_program_get_default_config(ui
 }
 #endif
 
+// ----------------- //
+// StepperFixedPulse //
+// ----------------- //
+
+#define StepperFixedPulse_wrap_target 0
+#define StepperFixedPulse_wrap 4
+#define StepperFixedPulse_pio_version 0
+
+#define StepperFixedPulse_offset_pulse 2u
+
+static const uint16_t StepperFixedPulse_program_instructions[] = {
+            //     .wrap_target
+    0x80a0, //  0: pull   block           side 0     
+    0xb022, //  1: mov    x, y            side 1     
+    0x1042, //  2: jmp    x--, 2          side 1     
+    0xa027, //  3: mov    x, osr          side 0     
+    0x0044, //  4: jmp    x--, 4          side 0     
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program StepperFixedPulse_program = {
+    .instructions = StepperFixedPulse_program_instructions,
+    .length = 5,
+    .origin = -1,
+    .pio_version = StepperFixedPulse_pio_version,
+#if PICO_PIO_VERSION > 0
+    .used_gpio_ranges = 0x0
+#endif
+};
+
+static inline pio_sm_config StepperFixedPulse_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + StepperFixedPulse_wrap_target, offset + StepperFixedPulse_wrap);
+    sm_config_set_sideset(&c, 1, false, false);
+    return c;
+}
+#endif
+
+// ---------- //
+// PulseTimer //
+// ---------- //
+
+#define PulseTimer_wrap_target 2
+#define PulseTimer_wrap 8
+#define PulseTimer_pio_version 0
+
+static const uint16_t PulseTimer_program_instructions[] = {
+    0x2020, //  0: wait   0 pin, 0
+    0x20a0, //  1: wait   1 pin, 0
+            //     .wrap_target
+    0xa02b, //  2: mov    x, ~null
+    0x00c6, //  3: jmp    pin, 6
+    0x00c7, //  4: jmp    pin, 7
+    0x0044, //  5: jmp    x--, 4
+    0x0043, //  6: jmp    x--, 3
+    0xa0c9, //  7: mov    isr, ~x
+    0x8000, //  8: push   noblock
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program PulseTimer_program = {
+    .instructions = PulseTimer_program_instructions,
+    .length = 9,
+    .origin = -1,
+    .pio_version = PulseTimer_pio_version,
+#if PICO_PIO_VERSION > 0
+    .used_gpio_ranges = 0x0
+#endif
+};
+
+static inline pio_sm_config PulseTimer_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + PulseTimer_wrap_target, offset + PulseTimer_wrap);
+    return c;
+}
+#endif
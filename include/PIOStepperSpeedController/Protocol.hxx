@@ -0,0 +1,806 @@
+#pragma once
+
+#include "Stepper.hxx"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace PIOStepperSpeedController {
+
+/**
+Binary command protocol for steering steppers from a host over a byte stream
+(USB CDC, a UART, or a pipe in the tests). The host streams motion into a
+queue per axis on the device, and the device answers every frame with how
+much room its queues have left, so the host never sends more than fits.
+
+Every frame, both ways:
+  PROTOCOL_SYNC, type, sequence, payload length (16 bit), payload,
+  CRC-16/CCITT-FALSE of everything from the type to the end of the payload
+Multi byte fields are little endian. A frame with a bad CRC is dropped
+without a reply and the receiver resyncs on the next PROTOCOL_SYNC, the host
+resends what was not acknowledged.
+
+Host to device, payloads of whole records:
+  SEGMENTS  axis (8 bit), 3 reserved bytes, target (mHz), steps
+            Run towards the target for that many steps, then go on with the
+            next command. 0 steps only sets the target, a target of 0 stops
+            and waits until the axis has stopped.
+  TARGETS   axis (8 bit), 3 reserved bytes, target (mHz)
+            SetTargetFrequency() for several axes at once, queued as segments
+            of 0 steps.
+  PERIODS   axis (8 bit), 3 reserved bytes, then step words
+            Precomputed steps, pushed to the state machine as they are. The
+            axis is stopped first. See PIOStepper::PutStepWord().
+  CONTROL   operation (ControlOp), axis or PROTOCOL_ALL_AXES
+            Acts at once, not queued. Stops empty the queue first.
+
+Device to host:
+  ACK, NAK  reason (NakReason, 0 for ACK), axis count, then the free queue
+            slots of each axis (16 bit). The sequence is the frame's.
+  TELEMETRY axis count, 3 reserved bytes, bad frames, then per axis: state,
+            reserved byte, free slots (16 bit), current frequency (mHz),
+            step count, queued steps, underruns
+A frame is taken whole or not at all: one that does not fit in its queues is
+NAKed with FULL and nothing of it is queued.
+*/
+static constexpr uint8_t PROTOCOL_SYNC = 0xA5;
+static constexpr size_t PROTOCOL_HEADER_BYTES = 5;
+static constexpr size_t PROTOCOL_CRC_BYTES = 2;
+static constexpr size_t PROTOCOL_MAX_PAYLOAD = 512;
+static constexpr size_t PROTOCOL_MAX_FRAME =
+    PROTOCOL_HEADER_BYTES + PROTOCOL_MAX_PAYLOAD + PROTOCOL_CRC_BYTES;
+static constexpr size_t PROTOCOL_MAX_AXES = 8;
+static constexpr uint8_t PROTOCOL_ALL_AXES = 0xFF;
+
+static constexpr size_t SEGMENT_RECORD_BYTES = 12;
+static constexpr size_t TARGET_RECORD_BYTES = 8;
+static constexpr size_t PERIODS_HEADER_BYTES = 4;
+static constexpr size_t CONTROL_PAYLOAD_BYTES = 2;
+static constexpr size_t TELEMETRY_HEADER_BYTES = 8;
+static constexpr size_t TELEMETRY_AXIS_BYTES = 20;
+
+enum class FrameType : uint8_t {
+  SEGMENTS = 0x01,
+  TARGETS = 0x02,
+  PERIODS = 0x03,
+  CONTROL = 0x04,
+  ACK = 0x81,
+  NAK = 0x82,
+  TELEMETRY = 0x83
+};
+
+enum class ControlOp : uint8_t {
+  START = 1,
+  STOP = 2,
+  FAST_STOP = 3,
+  EMERGENCY_STOP = 4,
+  /// Replied to with a TELEMETRY frame instead of an ACK
+  TELEMETRY = 5
+};
+
+enum class NakReason : uint8_t {
+  NONE = 0,
+  /// Not a frame type the device takes
+  TYPE = 1,
+  /// A payload that is not whole records, or an axis that does not exist
+  INVALID = 2,
+  /// Not enough free slots, resend once the queue has drained
+  FULL = 3
+};
+
+inline uint16_t ReadU16(const uint8_t *aBytes) {
+  return static_cast<uint16_t>(aBytes[0] | (aBytes[1] << 8));
+}
+
+inline uint32_t ReadU32(const uint8_t *aBytes) {
+  return static_cast<uint32_t>(aBytes[0]) |
+         (static_cast<uint32_t>(aBytes[1]) << 8) |
+         (static_cast<uint32_t>(aBytes[2]) << 16) |
+         (static_cast<uint32_t>(aBytes[3]) << 24);
+}
+
+/// CRC-16/CCITT-FALSE, a nibble at a time from a 16 entry table
+inline uint16_t Crc16(const uint8_t *aData, size_t aSize,
+                      uint16_t aCrc = 0xFFFF) {
+  static constexpr uint16_t TABLE[16] = {
+      0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+      0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
+  for (size_t i = 0; i < aSize; i++) {
+    aCrc = static_cast<uint16_t>((aCrc << 4) ^
+                                 TABLE[(aCrc >> 12) ^ (aData[i] >> 4)]);
+    aCrc = static_cast<uint16_t>((aCrc << 4) ^
+                                 TABLE[(aCrc >> 12) ^ (aData[i] & 0x0F)]);
+  }
+  return aCrc;
+}
+
+/// Frequencies travel as whole mHz
+inline uint32_t ToMilliHz(float aFrequencyHz) {
+  return aFrequencyHz <= 0 ? 0
+                           : static_cast<uint32_t>(aFrequencyHz * 1000 + 0.5f);
+}
+
+/**
+A received frame. The payload points into the receiver's buffer, it is valid
+until the receiver is next written to.
+*/
+struct FrameView {
+  FrameType type;
+  uint8_t sequence;
+  const uint8_t *payload;
+  uint16_t length;
+};
+
+/**
+Writes one frame in place into a caller's buffer, eg. straight into the
+space left in a transmit buffer. Put past the capacity or
+PROTOCOL_MAX_PAYLOAD is remembered and makes Finish() fail.
+*/
+class FrameWriter {
+public:
+  FrameWriter(uint8_t *aBuffer, size_t aCapacity, FrameType aType,
+              uint8_t aSequence)
+      : myBuffer(aBuffer),
+        myCapacity(std::min(aCapacity, PROTOCOL_MAX_FRAME)),
+        mySize(PROTOCOL_HEADER_BYTES), myIsOverflowed(false) {
+    if (myCapacity < PROTOCOL_HEADER_BYTES + PROTOCOL_CRC_BYTES) {
+      myIsOverflowed = true;
+      return;
+    }
+    myBuffer[0] = PROTOCOL_SYNC;
+    myBuffer[1] = static_cast<uint8_t>(aType);
+    myBuffer[2] = aSequence;
+  }
+
+  bool Put8(uint8_t aValue) {
+    if (mySize + PROTOCOL_CRC_BYTES + 1 > myCapacity) {
+      myIsOverflowed = true;
+    }
+    if (myIsOverflowed) {
+      return false;
+    }
+    myBuffer[mySize++] = aValue;
+    return true;
+  }
+
+  bool Put16(uint16_t aValue) {
+    return Put8(aValue & 0xFF) && Put8(aValue >> 8);
+  }
+
+  bool Put32(uint32_t aValue) {
+    return Put16(aValue & 0xFFFF) && Put16(aValue >> 16);
+  }
+
+  size_t GetPayloadSize() const { return mySize - PROTOCOL_HEADER_BYTES; }
+
+  /**
+  @brief Fills in the length and the CRC.
+  @return The size of the frame, 0 if it did not fit
+  */
+  size_t Finish() {
+    if (myIsOverflowed) {
+      return 0;
+    }
+    size_t length = GetPayloadSize();
+    myBuffer[3] = length & 0xFF;
+    myBuffer[4] = static_cast<uint8_t>(length >> 8);
+    uint16_t crc = Crc16(&myBuffer[1], mySize - 1);
+    myBuffer[mySize] = crc & 0xFF;
+    myBuffer[mySize + 1] = static_cast<uint8_t>(crc >> 8);
+    return mySize + PROTOCOL_CRC_BYTES;
+  }
+
+private:
+  uint8_t *myBuffer;
+  size_t myCapacity;
+  size_t mySize;
+  bool myIsOverflowed;
+};
+
+/// Appends a SEGMENTS record
+inline bool PutSegment(FrameWriter &aWriter, uint8_t anAxis,
+                       float aTargetHz, uint32_t aSteps) {
+  return aWriter.Put8(anAxis) && aWriter.Put8(0) && aWriter.Put16(0) &&
+         aWriter.Put32(ToMilliHz(aTargetHz)) && aWriter.Put32(aSteps);
+}
+
+/// Appends a TARGETS record
+inline bool PutTarget(FrameWriter &aWriter, uint8_t anAxis, float aTargetHz) {
+  return aWriter.Put8(anAxis) && aWriter.Put8(0) && aWriter.Put16(0) &&
+         aWriter.Put32(ToMilliHz(aTargetHz));
+}
+
+/// Starts a PERIODS payload, Put32() the step words after it
+inline bool PutPeriodsHeader(FrameWriter &aWriter, uint8_t anAxis) {
+  return aWriter.Put8(anAxis) && aWriter.Put8(0) && aWriter.Put16(0);
+}
+
+/// The CONTROL payload
+inline bool PutControl(FrameWriter &aWriter, ControlOp anOp, uint8_t anAxis) {
+  return aWriter.Put8(static_cast<uint8_t>(anOp)) && aWriter.Put8(anAxis);
+}
+
+/**
+Receive buffer that frames are parsed in place from. The transport reads
+straight into GetWriteSpace() (eg. tud_cdc_read() or read()), Next() then
+hands out the frames found there without copying them. Only the start of a
+frame cut off by the end of a read is moved, to the front of the buffer, on
+the next GetWriteSpace().
+*/
+template <size_t SIZE = 2 * PROTOCOL_MAX_FRAME> class FrameReceiver {
+  static_assert(SIZE >= PROTOCOL_MAX_FRAME, "Room for a whole frame");
+
+public:
+  /**
+  @brief Where the next bytes go. Invalidates the frames handed out so far.
+  @param aSize How many bytes fit
+  */
+  uint8_t *GetWriteSpace(size_t &aSize) {
+    if (myStart > 0) {
+      std::memmove(myBuffer.data(), &myBuffer[myStart], myEnd - myStart);
+      myEnd -= myStart;
+      myStart = 0;
+    }
+    aSize = SIZE - myEnd;
+    return &myBuffer[myEnd];
+  }
+
+  /// Call with how many bytes were written to GetWriteSpace()
+  void Commit(size_t aBytes) { myEnd = std::min(SIZE, myEnd + aBytes); }
+
+  /**
+  @brief Finds the next whole frame. Bytes that cannot start one and frames
+  with a bad length or CRC are skipped and counted.
+  @return false until more bytes are committed
+  */
+  bool Next(FrameView &aFrame) {
+    while (myStart < myEnd) {
+      const uint8_t *frame = &myBuffer[myStart];
+      if (frame[0] != PROTOCOL_SYNC) {
+        myStart++;
+        myDroppedBytes++;
+        continue;
+      }
+      if (myEnd - myStart < PROTOCOL_HEADER_BYTES) {
+        return false;
+      }
+      uint16_t length = ReadU16(&frame[3]);
+      if (length > PROTOCOL_MAX_PAYLOAD) {
+        myStart++;
+        myBadFrames++;
+        continue;
+      }
+      size_t size = PROTOCOL_HEADER_BYTES + length + PROTOCOL_CRC_BYTES;
+      if (myEnd - myStart < size) {
+        return false;
+      }
+      uint16_t crc = Crc16(&frame[1], PROTOCOL_HEADER_BYTES - 1 + length);
+      if (crc != ReadU16(&frame[PROTOCOL_HEADER_BYTES + length])) {
+        // The sync byte may have been payload, look for the next one
+        myStart++;
+        myBadFrames++;
+        continue;
+      }
+      aFrame.type = static_cast<FrameType>(frame[1]);
+      aFrame.sequence = frame[2];
+      aFrame.payload = &frame[PROTOCOL_HEADER_BYTES];
+      aFrame.length = length;
+      myStart += size;
+      return true;
+    }
+    return false;
+  }
+
+  /// Bytes waiting to be parsed, a partial frame
+  size_t GetPending() const { return myEnd - myStart; }
+
+  /// Frames dropped for a bad length or CRC
+  uint32_t GetBadFrames() const { return myBadFrames; }
+
+  /// Bytes skipped looking for the start of a frame
+  uint32_t GetDroppedBytes() const { return myDroppedBytes; }
+
+private:
+  std::array<uint8_t, SIZE> myBuffer{};
+  size_t myStart = 0;
+  size_t myEnd = 0;
+  uint32_t myBadFrames = 0;
+  uint32_t myDroppedBytes = 0;
+};
+
+/// An ACK or NAK as the host reads it, see ReadReply()
+struct ProtocolReply {
+  bool isAck;
+  uint8_t sequence;
+  NakReason reason;
+  uint8_t axisCount;
+  std::array<uint16_t, PROTOCOL_MAX_AXES> freeSlots;
+};
+
+/// One axis of a TELEMETRY frame as the host reads it, see ReadTelemetry()
+struct AxisTelemetry {
+  StepperState state;
+  uint16_t freeSlots;
+  float currentHz;
+  uint32_t stepCount;
+  /// Steps left in the queued segments and step words
+  uint32_t queuedSteps;
+  /// Times the queue ran dry while streaming, see ProtocolDevice
+  uint32_t underruns;
+};
+
+/// @return false if aFrame is not a well formed ACK or NAK
+inline bool ReadReply(const FrameView &aFrame, ProtocolReply &aReply) {
+  if ((aFrame.type != FrameType::ACK && aFrame.type != FrameType::NAK) ||
+      aFrame.length < 2 || aFrame.payload[1] > PROTOCOL_MAX_AXES ||
+      aFrame.length != 2 + 2 * aFrame.payload[1]) {
+    return false;
+  }
+  aReply.isAck = aFrame.type == FrameType::ACK;
+  aReply.sequence = aFrame.sequence;
+  aReply.reason = static_cast<NakReason>(aFrame.payload[0]);
+  aReply.axisCount = aFrame.payload[1];
+  aReply.freeSlots.fill(0);
+  for (size_t i = 0; i < aReply.axisCount; i++) {
+    aReply.freeSlots[i] = ReadU16(&aFrame.payload[2 + 2 * i]);
+  }
+  return true;
+}
+
+/// @return false if aFrame is not a well formed TELEMETRY frame with anAxis
+inline bool ReadTelemetry(const FrameView &aFrame, size_t anAxis,
+                          AxisTelemetry &aTelemetry) {
+  if (aFrame.type != FrameType::TELEMETRY ||
+      aFrame.length < TELEMETRY_HEADER_BYTES ||
+      aFrame.length != TELEMETRY_HEADER_BYTES +
+                           TELEMETRY_AXIS_BYTES * aFrame.payload[0] ||
+      anAxis >= aFrame.payload[0]) {
+    return false;
+  }
+  const uint8_t *axis = &aFrame.payload[TELEMETRY_HEADER_BYTES +
+                                        TELEMETRY_AXIS_BYTES * anAxis];
+  aTelemetry.state = static_cast<StepperState>(axis[0]);
+  aTelemetry.freeSlots = ReadU16(&axis[2]);
+  aTelemetry.currentHz = ReadU32(&axis[4]) / 1000.0f;
+  aTelemetry.stepCount = ReadU32(&axis[8]);
+  aTelemetry.queuedSteps = ReadU32(&axis[12]);
+  aTelemetry.underruns = ReadU32(&axis[16]);
+  return true;
+}
+
+/// Bad frames counted by the device, from a TELEMETRY frame
+inline uint32_t ReadTelemetryBadFrames(const FrameView &aFrame) {
+  return aFrame.length >= TELEMETRY_HEADER_BYTES ? ReadU32(&aFrame.payload[4])
+                                                 : 0;
+}
+
+/**
+The device end of the protocol: parses frames in place from its receive
+buffer, decodes their records straight into a command queue per axis, and
+feeds the steppers from the queues.
+
+eg. over USB CDC with TinyUSB
+  ProtocolDevice<PIOStepper, 2> device;
+  device.Add(x);
+  device.Add(y);
+  while (true) {
+    tud_task();
+    size_t room;
+    uint8_t *space = device.GetReceiveSpace(room);
+    device.OnReceived(tud_cdc_read(space, room));
+    size_t pending;
+    const uint8_t *data = device.GetTransmitData(pending);
+    device.OnTransmitted(tud_cdc_write(data, pending));
+    tud_cdc_write_flush();
+    device.RunOnce();
+  }
+
+Flow control is by credit: every reply carries the free slots of each
+queue, a segment or target takes one slot and a step word one. A host that
+keeps what it has in flight within the last credits it was given never gets
+a FULL NAK. Replies wait in a transmit buffer, and frames are not taken
+while it has no room for the reply, so a host that stops reading is slowed
+down rather than losing replies.
+
+While a queue is empty the axis keeps going at its last target, or finishes
+stopping. Running dry after a segment with steps or a step word counts as an
+underrun in the telemetry: the host fell behind.
+
+S is a Stepper whose implementation can also push precomputed step words
+and reports its queue, as PIOStepper does: PutStepWord(), GetQueuedSteps()
+and GetQueueDepth().
+*/
+template <typename S, size_t AXES = 1, size_t DEPTH = 64>
+class ProtocolDevice {
+  static_assert(AXES > 0 && AXES <= PROTOCOL_MAX_AXES, "Axes in a reply");
+  static_assert(DEPTH > 0 && DEPTH <= UINT16_MAX, "Free slots in 16 bits");
+
+public:
+  static constexpr size_t REPLY_BYTES =
+      PROTOCOL_HEADER_BYTES + 2 + 2 * AXES + PROTOCOL_CRC_BYTES;
+  static constexpr size_t TELEMETRY_BYTES =
+      PROTOCOL_HEADER_BYTES + TELEMETRY_HEADER_BYTES +
+      TELEMETRY_AXIS_BYTES * AXES + PROTOCOL_CRC_BYTES;
+  static constexpr size_t TRANSMIT_BYTES = 4 * TELEMETRY_BYTES;
+
+  /**
+  @brief Adds a stepper, it must outlive the device.
+  @return The axis index used in the frames
+  */
+  size_t Add(S &aStepper) {
+    if (myAxisCount == AXES) {
+      throw std::invalid_argument("Too many axes");
+    }
+    myAxes[myAxisCount].stepper = &aStepper;
+    return myAxisCount++;
+  }
+
+  size_t GetAxisCount() const { return myAxisCount; }
+
+  /// Where the transport writes received bytes, see FrameReceiver
+  uint8_t *GetReceiveSpace(size_t &aSize) {
+    return myReceiver.GetWriteSpace(aSize);
+  }
+
+  /// Takes in aBytes written to GetReceiveSpace() and handles their frames
+  void OnReceived(size_t aBytes) {
+    myReceiver.Commit(aBytes);
+    ProcessFrames();
+  }
+
+  /// Replies waiting to be sent
+  const uint8_t *GetTransmitData(size_t &aSize) const {
+    aSize = myTransmitEnd - myTransmitStart;
+    return &myTransmit[myTransmitStart];
+  }
+
+  /// Call with how many bytes of GetTransmitData() the transport took
+  void OnTransmitted(size_t aBytes) {
+    myTransmitStart = std::min(myTransmitEnd, myTransmitStart + aBytes);
+    // Frames held back for want of room for their reply
+    ProcessFrames();
+  }
+
+  /**
+  @brief Queues a TELEMETRY frame for sending, eg. every few milliseconds.
+  @return false if the transmit buffer has no room for it
+  */
+  bool SendTelemetry(uint8_t aSequence = 0) {
+    uint8_t *space = GetTransmitSpace();
+    FrameWriter writer(space, TRANSMIT_BYTES - myTransmitEnd,
+                       FrameType::TELEMETRY, aSequence);
+    writer.Put8(static_cast<uint8_t>(myAxisCount));
+    writer.Put8(0);
+    writer.Put16(0);
+    writer.Put32(myReceiver.GetBadFrames());
+    for (size_t i = 0; i < myAxisCount; i++) {
+      const Axis &axis = myAxes[i];
+      writer.Put8(static_cast<uint8_t>(axis.stepper->GetState()));
+      writer.Put8(0);
+      writer.Put16(static_cast<uint16_t>(DEPTH - axis.count));
+      writer.Put32(ToMilliHz(axis.stepper->GetCurrentFrequency()));
+      writer.Put32(axis.stepper->GetStepCount());
+      writer.Put32(axis.queuedSteps);
+      writer.Put32(axis.underruns);
+    }
+    return CommitTransmit(writer.Finish());
+  }
+
+  /**
+  @brief Feeds every axis from its queue once: one Update() of its stepper,
+  or one step word. Does not wait, an axis whose state machine has no room
+  is skipped.
+  @return Bit i set if axis i stepped
+  */
+  uint32_t RunOnce() {
+    uint32_t stepped = 0;
+    for (size_t i = 0; i < myAxisCount; i++) {
+      if (Service(myAxes[i])) {
+        stepped |= 1u << i;
+      }
+    }
+    return stepped;
+  }
+
+  size_t GetFreeSlots(size_t anAxis) const {
+    return DEPTH - myAxes[anAxis].count;
+  }
+
+  /// Steps left in the queued segments and step words of an axis
+  uint32_t GetQueuedSteps(size_t anAxis) const {
+    return myAxes[anAxis].queuedSteps;
+  }
+
+  uint32_t GetUnderruns(size_t anAxis) const {
+    return myAxes[anAxis].underruns;
+  }
+
+  /// Frames answered with a NAK
+  uint32_t GetRejectedFrames() const { return myRejectedFrames; }
+
+  const FrameReceiver<> &GetReceiver() const { return myReceiver; }
+
+private:
+  enum class CommandType : uint8_t { SEGMENT, WORD };
+
+  struct Command {
+    CommandType type;
+    uint32_t value; // the target in mHz, or the step word
+    uint32_t steps; // left in the segment
+  };
+
+  struct Axis {
+    S *stepper = nullptr;
+    std::array<Command, DEPTH> commands{};
+    size_t head = 0;
+    size_t count = 0;
+    uint32_t queuedSteps = 0;
+    uint32_t underruns = 0;
+    bool isActive = false;    // the command at the head has been applied
+    bool isStreaming = false; // running dry now would be an underrun
+  };
+
+  // Moves what is left to send to the front, GetTransmitData() has been
+  // taken by the transport already
+  uint8_t *GetTransmitSpace() {
+    if (myTransmitStart > 0) {
+      std::memmove(myTransmit.data(), &myTransmit[myTransmitStart],
+                   myTransmitEnd - myTransmitStart);
+      myTransmitEnd -= myTransmitStart;
+      myTransmitStart = 0;
+    }
+    return &myTransmit[myTransmitEnd];
+  }
+
+  bool CommitTransmit(size_t aBytes) {
+    myTransmitEnd += aBytes;
+    return aBytes > 0;
+  }
+
+  void ProcessFrames() {
+    FrameView frame;
+    GetTransmitSpace(); // counts the room freed by what has been sent
+    while (TRANSMIT_BYTES - myTransmitEnd >=
+               std::max(REPLY_BYTES, TELEMETRY_BYTES) &&
+           myReceiver.Next(frame)) {
+      NakReason reason = Handle(frame);
+      if (reason == NakReason::NONE &&
+          !(frame.type == FrameType::CONTROL &&
+            static_cast<ControlOp>(frame.payload[0]) ==
+                ControlOp::TELEMETRY)) {
+        SendReply(FrameType::ACK, frame.sequence, reason);
+      } else if (reason != NakReason::NONE) {
+        myRejectedFrames++;
+        SendReply(FrameType::NAK, frame.sequence, reason);
+      }
+    }
+  }
+
+  void SendReply(FrameType aType, uint8_t aSequence, NakReason aReason) {
+    uint8_t *space = GetTransmitSpace();
+    FrameWriter writer(space, TRANSMIT_BYTES - myTransmitEnd, aType,
+                       aSequence);
+    writer.Put8(static_cast<uint8_t>(aReason));
+    writer.Put8(static_cast<uint8_t>(myAxisCount));
+    for (size_t i = 0; i < myAxisCount; i++) {
+      writer.Put16(static_cast<uint16_t>(GetFreeSlots(i)));
+    }
+    CommitTransmit(writer.Finish());
+  }
+
+  NakReason Handle(const FrameView &aFrame) {
+    switch (aFrame.type) {
+    case FrameType::SEGMENTS:
+      return HandleRecords(aFrame, SEGMENT_RECORD_BYTES);
+    case FrameType::TARGETS:
+      return HandleRecords(aFrame, TARGET_RECORD_BYTES);
+    case FrameType::PERIODS:
+      return HandlePeriods(aFrame);
+    case FrameType::CONTROL:
+      return HandleControl(aFrame);
+    default:
+      return NakReason::TYPE;
+    }
+  }
+
+  // Checks every record and the room they need before queuing any, both
+  // passes read the receive buffer in place
+  NakReason HandleRecords(const FrameView &aFrame, size_t aRecordBytes) {
+    if (aFrame.length == 0 || aFrame.length % aRecordBytes != 0) {
+      return NakReason::INVALID;
+    }
+    std::array<size_t, AXES> needed{};
+    for (size_t i = 0; i < aFrame.length; i += aRecordBytes) {
+      uint8_t axis = aFrame.payload[i];
+      if (axis >= myAxisCount) {
+        return NakReason::INVALID;
+      }
+      needed[axis]++;
+    }
+    for (size_t i = 0; i < myAxisCount; i++) {
+      if (needed[i] > GetFreeSlots(i)) {
+        return NakReason::FULL;
+      }
+    }
+    for (size_t i = 0; i < aFrame.length; i += aRecordBytes) {
+      const uint8_t *record = &aFrame.payload[i];
+      uint32_t steps =
+          aRecordBytes == SEGMENT_RECORD_BYTES ? ReadU32(&record[8]) : 0;
+      Push(myAxes[record[0]],
+           Command{CommandType::SEGMENT, ReadU32(&record[4]), steps});
+    }
+    return NakReason::NONE;
+  }
+
+  NakReason HandlePeriods(const FrameView &aFrame) {
+    if (aFrame.length <= PERIODS_HEADER_BYTES ||
+        (aFrame.length - PERIODS_HEADER_BYTES) % 4 != 0 ||
+        aFrame.payload[0] >= myAxisCount) {
+      return NakReason::INVALID;
+    }
+    Axis &axis = myAxes[aFrame.payload[0]];
+    size_t words = (aFrame.length - PERIODS_HEADER_BYTES) / 4;
+    if (words > DEPTH - axis.count) {
+      return NakReason::FULL;
+    }
+    for (size_t i = PERIODS_HEADER_BYTES; i < aFrame.length; i += 4) {
+      Push(axis, Command{CommandType::WORD, ReadU32(&aFrame.payload[i]), 1});
+    }
+    return NakReason::NONE;
+  }
+
+  NakReason HandleControl(const FrameView &aFrame) {
+    if (aFrame.length != CONTROL_PAYLOAD_BYTES) {
+      return NakReason::INVALID;
+    }
+    ControlOp op = static_cast<ControlOp>(aFrame.payload[0]);
+    uint8_t target = aFrame.payload[1];
+    if (target != PROTOCOL_ALL_AXES && target >= myAxisCount) {
+      return NakReason::INVALID;
+    }
+    if (op == ControlOp::TELEMETRY) {
+      SendTelemetry(aFrame.sequence);
+      return NakReason::NONE;
+    }
+    if (op < ControlOp::START || op > ControlOp::EMERGENCY_STOP) {
+      return NakReason::INVALID;
+    }
+    for (size_t i = 0; i < myAxisCount; i++) {
+      if (target != PROTOCOL_ALL_AXES && target != i) {
+        continue;
+      }
+      Axis &axis = myAxes[i];
+      if (op == ControlOp::START) {
+        axis.stepper->Start();
+        continue;
+      }
+      Clear(axis);
+      if (op == ControlOp::STOP) {
+        axis.stepper->Stop();
+      } else if (op == ControlOp::FAST_STOP) {
+        axis.stepper->FastStop();
+      } else {
+        axis.stepper->EmergencyStop();
+      }
+    }
+    return NakReason::NONE;
+  }
+
+  void Push(Axis &anAxis, const Command &aCommand) {
+    anAxis.commands[(anAxis.head + anAxis.count) % DEPTH] = aCommand;
+    anAxis.count++;
+    if (aCommand.type == CommandType::WORD || aCommand.value > 0) {
+      anAxis.queuedSteps += aCommand.steps;
+    }
+  }
+
+  void Pop(Axis &anAxis) {
+    Command &command = anAxis.commands[anAxis.head];
+    if (command.type == CommandType::WORD || command.value > 0) {
+      anAxis.queuedSteps -= command.steps;
+    }
+    anAxis.head = (anAxis.head + 1) % DEPTH;
+    anAxis.count--;
+    anAxis.isActive = false;
+  }
+
+  void Clear(Axis &anAxis) {
+    anAxis.head = 0;
+    anAxis.count = 0;
+    anAxis.queuedSteps = 0;
+    anAxis.isActive = false;
+    anAxis.isStreaming = false;
+  }
+
+  static void ApplyTarget(S &aStepper, uint32_t aMilliHz) {
+    if (aMilliHz == 0) {
+      aStepper.Stop();
+      return;
+    }
+    aStepper.SetTargetFrequency(aMilliHz / 1000.0f);
+    StepperState state = aStepper.GetState();
+    if (state == StepperState::STOPPED || state == StepperState::STOPPING) {
+      aStepper.Start();
+    }
+  }
+
+  // One Update() of the stepper, counted in user steps: Update() reports
+  // false for some steps, and a step may stand for several microsteps
+  static uint32_t UpdateSteps(S &aStepper) {
+    uint32_t before = aStepper.GetStepCount();
+    aStepper.Update();
+    return aStepper.GetStepCount() - before;
+  }
+
+  bool Service(Axis &anAxis) {
+    S &stepper = *anAxis.stepper;
+    // Never waits on the state machine, a full queue is left for a later
+    // pass as StepperScheduler does
+    if (stepper.GetQueuedSteps() >= stepper.GetQueueDepth()) {
+      return false;
+    }
+    while (anAxis.count > 0) {
+      Command &command = anAxis.commands[anAxis.head];
+
+      if (command.type == CommandType::WORD) {
+        // Step words bypass the planner, which has to be stopped first
+        if (stepper.GetState() != StepperState::STOPPED) {
+          stepper.Stop();
+          return UpdateSteps(stepper) > 0;
+        }
+        if (!stepper.PutStepWord(command.value)) {
+          return false;
+        }
+        anAxis.isStreaming = true;
+        Pop(anAxis);
+        return true;
+      }
+
+      if (!anAxis.isActive) {
+        ApplyTarget(stepper, command.value);
+        anAxis.isActive = true;
+        anAxis.isStreaming = command.value > 0 && command.steps > 0;
+      }
+      bool isDone = command.value == 0
+                        ? stepper.GetState() == StepperState::STOPPED
+                        : command.steps == 0;
+      if (isDone) {
+        Pop(anAxis);
+        continue;
+      }
+      uint32_t steps = UpdateSteps(stepper);
+      if (command.value == 0) {
+        if (stepper.GetState() == StepperState::STOPPED) {
+          Pop(anAxis);
+        }
+        return steps > 0;
+      }
+      steps = std::min(steps, command.steps);
+      command.steps -= steps;
+      anAxis.queuedSteps -= steps;
+      if (command.steps == 0) {
+        Pop(anAxis);
+      }
+      return steps > 0;
+    }
+
+    if (anAxis.isStreaming) {
+      anAxis.underruns++;
+      anAxis.isStreaming = false;
+    }
+    return UpdateSteps(stepper) > 0;
+  }
+
+  FrameReceiver<> myReceiver;
+  std::array<uint8_t, TRANSMIT_BYTES> myTransmit{};
+  size_t myTransmitStart = 0;
+  size_t myTransmitEnd = 0;
+  std::array<Axis, AXES> myAxes{};
+  size_t myAxisCount = 0;
+  uint32_t myRejectedFrames = 0;
+};
+
+} // namespace PIOStepperSpeedController
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Converter.hxx"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace PIOStepperSpeedController {
+
+/**
+Closed form predictions of the ramps Stepper plans, without stepping.
+
+Each planned step changes the frequency by rate * period, so with g = f^2
+  g' = g +- 2 * rate + rate^2 / g
+which sums to
+  steps = ((g1 - g0) -+ (rate / 2) * ln((g1 +- rate / 2) / (g0 +- rate / 2)))
+          / (2 * rate)
+The time follows from the same step: the frequency changes by rate times the
+length of each step, so the steps before the last sum to |f1 - f0| / rate.
+
+Below sqrt(RAMP_EXPLICIT_LIMIT * rate) a single step changes the frequency
+by a large fraction of itself and the sum is not smooth, those few steps
+(at most about RAMP_EXPLICIT_LIMIT) are stepped through as the planner does.
+The predictions ignore the truncation of periods to whole ticks, so they are
+within a step or two of the planner while a period is many ticks long.
+*/
+static constexpr float RAMP_EXPLICIT_LIMIT = 16.0f;
+
+struct RampPrediction {
+  uint32_t steps;
+  // From the end of the step at the start frequency to the end of the last
+  // step, which is at the target
+  float seconds;
+};
+
+/**
+@brief Predicts the steps the planner outputs going from aFrom to aTo Hz at
+aRate Hz/s, the last one at aTo. The time is within one step at aTo of the
+planner.
+*/
+inline RampPrediction PredictRamp(const Converter &aConverter, float aFrom,
+                                  float aTo, uint32_t aRate) {
+  RampPrediction prediction{0, 0};
+  if (aRate == 0 || aFrom == aTo) {
+    return prediction;
+  }
+  const double rate = aRate;
+  const double half = rate / 2;
+  const double limit = RAMP_EXPLICIT_LIMIT * rate;
+  const float tickHz = static_cast<float>(aConverter.GetTickHz());
+  auto seconds = [&](float aFrequency) {
+    return aConverter.ToPeriod(aFrequency) / tickHz;
+  };
+  // The steps before the last move the frequency by rate times their length,
+  // the first of those is the step at the start, the last one is at the end
+  auto smoothSeconds = [&](float aStart, float anEnd) {
+    return std::abs(anEnd - aStart) / static_cast<float>(aRate) -
+           seconds(aStart) + seconds(anEnd);
+  };
+  float f = aFrom;
+
+  if (aTo > aFrom) {
+    while (f < aTo && static_cast<double>(f) * f < limit) {
+      f = std::min(aConverter.CalculateNextFrequency(
+                       f, static_cast<int32_t>(aRate)),
+                   aTo);
+      prediction.steps++;
+      prediction.seconds += seconds(f);
+    }
+    if (f >= aTo) {
+      return prediction;
+    }
+    double g0 = static_cast<double>(f) * f;
+    double g1 = static_cast<double>(aTo) * aTo;
+    double n = ((g1 - g0) - half * std::log((g1 + half) / (g0 + half))) /
+               (2 * rate);
+    prediction.steps += static_cast<uint32_t>(std::ceil(n));
+    prediction.seconds += smoothSeconds(f, aTo);
+    return prediction;
+  }
+
+  double g0 = static_cast<double>(f) * f;
+  double g1 = std::max(static_cast<double>(aTo) * aTo, limit);
+  if (g0 > g1) {
+    double n =
+        ((g0 - g1) + half * std::log((g0 - half) / (g1 - half))) / (2 * rate);
+    float end = static_cast<float>(std::sqrt(g1));
+    prediction.steps += static_cast<uint32_t>(std::ceil(n));
+    prediction.seconds += smoothSeconds(f, end);
+    f = end;
+  }
+  while (f > aTo) {
+    f = std::max(
+        aConverter.CalculateNextFrequency(f, -static_cast<int32_t>(aRate)),
+        aTo);
+    prediction.steps++;
+    prediction.seconds += seconds(f);
+  }
+  return prediction;
+}
+
+} // namespace PIOStepperSpeedController
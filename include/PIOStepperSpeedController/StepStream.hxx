@@ -0,0 +1,216 @@
+#pragma once
+
+#include "Converter.hxx"
+#include "Stepper.hxx"
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+/**
+Step stream: a precomputed motion profile, stored as the exact words
+PIOStepper would push to the state machine, so it can be played back with no
+math on the device (see PIOStepper::StartPlayback()).
+
+Everything is a 32 bit little endian word, so a stream can be memory mapped
+on the host and DMA'd straight from flash or RAM on the device.
+
+  Header:  STEP_STREAM_MAGIC, STEP_STREAM_VERSION, sysClk, prescaler,
+           total number of steps
+  Records: a record header word, then either
+           RUN_FLAG | n  one step word, output n times
+           n             n step words, output once each
+
+Runs map onto one DMA transfer with the read address fixed, literals onto one
+with it incrementing.
+*/
+static constexpr uint32_t STEP_STREAM_MAGIC = 0x31535350; // "PSS1"
+static constexpr uint32_t STEP_STREAM_VERSION = 1;
+static constexpr uint32_t STEP_STREAM_HEADER_WORDS = 5;
+static constexpr uint32_t STEP_STREAM_RUN_FLAG = 0x80000000u;
+static constexpr uint32_t STEP_STREAM_MAX_RECORD = STEP_STREAM_RUN_FLAG - 1;
+
+struct StepStreamHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sysClk;
+  uint32_t prescaler;
+  uint32_t stepCount;
+};
+
+struct StepRecord {
+  const uint32_t *words; // the step words, a single one for a run
+  uint32_t count;        // how many steps the record outputs
+  bool isRun;
+};
+
+/**
+Appends steps to a stream in memory, collapsing repeated words into run
+records. Call Finish() once the last step has been appended.
+*/
+class StepStreamWriter {
+public:
+  /// Shortest repeat stored as a run, shorter ones are cheaper as literals
+  static constexpr uint32_t MIN_RUN = 3;
+
+  StepStreamWriter(std::vector<uint32_t> &anOutput, const Converter &aConverter)
+      : myOutput(anOutput) {
+    myOutput.clear();
+    myOutput.push_back(STEP_STREAM_MAGIC);
+    myOutput.push_back(STEP_STREAM_VERSION);
+    myOutput.push_back(aConverter.GetSysClk());
+    myOutput.push_back(aConverter.GetPrescaler());
+    myOutput.push_back(0);
+  }
+
+  void Append(uint32_t aWord) {
+    myStepCount++;
+    if (myRunCount > 0 && aWord == myRunWord &&
+        myRunCount < STEP_STREAM_MAX_RECORD) {
+      myRunCount++;
+      return;
+    }
+    FlushRun();
+    myRunWord = aWord;
+    myRunCount = 1;
+  }
+
+  /// Writes out anything pending and the total step count
+  void Finish() {
+    FlushRun();
+    myLiteralHeader = NO_LITERAL;
+    myOutput[4] = myStepCount;
+  }
+
+  uint32_t GetStepCount() const { return myStepCount; }
+
+private:
+  static constexpr size_t NO_LITERAL = SIZE_MAX;
+
+  void FlushRun() {
+    if (myRunCount >= MIN_RUN) {
+      myLiteralHeader = NO_LITERAL;
+      myOutput.push_back(STEP_STREAM_RUN_FLAG | myRunCount);
+      myOutput.push_back(myRunWord);
+    } else {
+      for (uint32_t i = 0; i < myRunCount; i++) {
+        if (myLiteralHeader == NO_LITERAL ||
+            myOutput[myLiteralHeader] == STEP_STREAM_MAX_RECORD) {
+          myLiteralHeader = myOutput.size();
+          myOutput.push_back(0);
+        }
+        myOutput[myLiteralHeader]++;
+        myOutput.push_back(myRunWord);
+      }
+    }
+    myRunCount = 0;
+  }
+
+  std::vector<uint32_t> &myOutput;
+  size_t myLiteralHeader = NO_LITERAL;
+  uint32_t myRunWord = 0;
+  uint32_t myRunCount = 0;
+  uint32_t myStepCount = 0;
+};
+
+/**
+Walks the records of a stream held in memory (RAM, flash, or a file mapped
+with MappedStepStream), without copying it. Throws std::invalid_argument if
+the header is not a step stream this version understands.
+*/
+class StepStreamReader {
+public:
+  StepStreamReader() = default;
+
+  StepStreamReader(const uint32_t *aWords, size_t aWordCount)
+      : myWords(aWords), myWordCount(aWordCount) {
+    if (aWordCount < STEP_STREAM_HEADER_WORDS ||
+        aWords[0] != STEP_STREAM_MAGIC) {
+      throw std::invalid_argument("Not a step stream");
+    }
+    if (aWords[1] != STEP_STREAM_VERSION) {
+      throw std::invalid_argument("Unsupported step stream version");
+    }
+    Rewind();
+  }
+
+  StepStreamHeader GetHeader() const {
+    return {myWords[0], myWords[1], myWords[2], myWords[3], myWords[4]};
+  }
+
+  void Rewind() { myPosition = STEP_STREAM_HEADER_WORDS; }
+
+  /// Reads the next record, false at the end of the stream
+  bool Next(StepRecord &aRecord) {
+    if (myPosition >= myWordCount) {
+      return false;
+    }
+    uint32_t header = myWords[myPosition++];
+    aRecord.isRun = (header & STEP_STREAM_RUN_FLAG) != 0;
+    aRecord.count = header & ~STEP_STREAM_RUN_FLAG;
+    size_t length = aRecord.isRun ? 1 : aRecord.count;
+    if (aRecord.count == 0 || length > myWordCount - myPosition) {
+      throw std::invalid_argument("Truncated step stream");
+    }
+    aRecord.words = &myWords[myPosition];
+    myPosition += length;
+    return true;
+  }
+
+  /// Calls aFunction with every step word in order, runs expanded
+  template <typename F> void ForEachStep(F aFunction) {
+    Rewind();
+    StepRecord record;
+    while (Next(record)) {
+      for (uint32_t i = 0; i < record.count; i++) {
+        aFunction(record.isRun ? record.words[0] : record.words[i]);
+      }
+    }
+    Rewind();
+  }
+
+private:
+  const uint32_t *myWords = nullptr;
+  size_t myWordCount = 0;
+  size_t myPosition = 0;
+};
+
+/**
+Host side generator: plans a profile with the same Stepper logic that runs on
+the device, and records the words PIOStepper would push into a stream instead
+of sending them to a state machine. Drive it with Start(), SetTargetHz(),
+Stop() and Update() exactly as the live stepper, then call Finish(). Throws
+std::invalid_argument if the minimum speed is below what one step word can
+hold, see Converter::GetMinStepFrequency().
+*/
+class StepStreamRecorder : public Stepper<StepStreamRecorder> {
+public:
+  StepStreamRecorder(std::vector<uint32_t> &anOutput, float aMinSpeed,
+                     float aMaxSpeed, uint32_t aAcceleration,
+                     uint32_t aDeceleration, uint32_t aSysClk = 125000000,
+                     uint32_t aPrescaler = 1)
+      : Stepper(aMinSpeed, aMaxSpeed, aAcceleration, aDeceleration, aSysClk,
+                aPrescaler),
+        myWriter(anOutput, GetConverter()) {
+    if (GetMinFrequency() < GetConverter().GetMinStepFrequency()) {
+      throw std::invalid_argument("Minimum speed too low for a step word");
+    }
+  }
+
+  void Finish() { myWriter.Finish(); }
+
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() {}
+  bool PutStep(float aFrequency) {
+    myWriter.Append(GetConverter().ToStepWord(aFrequency));
+    return true;
+  }
+
+private:
+  StepStreamWriter myWriter;
+};
+
+} // namespace PIOStepperSpeedController
@@ -0,0 +1,87 @@
+#pragma once
+
+// Host side only: reading and writing step streams as files. The device plays
+// streams from memory, see PIOStepper::StartPlayback().
+
+#include "StepStream.hxx"
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+/// Writes a stream built by StepStreamWriter or StepStreamRecorder to aPath
+inline void WriteStepStreamFile(const std::string &aPath,
+                                const std::vector<uint32_t> &aWords) {
+  FILE *file = std::fopen(aPath.c_str(), "wb");
+  if (file == nullptr) {
+    throw std::runtime_error("Cannot create " + aPath);
+  }
+  size_t written =
+      std::fwrite(aWords.data(), sizeof(uint32_t), aWords.size(), file);
+  bool closed = std::fclose(file) == 0;
+  if (written != aWords.size() || !closed) {
+    throw std::runtime_error("Cannot write " + aPath);
+  }
+}
+
+/**
+A step stream file mapped read only into memory, so a long profile is read
+straight from the page cache with no copy and no parse beyond the header.
+The mapping lives as long as this object, as must any reader from GetReader().
+*/
+class MappedStepStream {
+public:
+  explicit MappedStepStream(const std::string &aPath) {
+    int fd = ::open(aPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open " + aPath);
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || info.st_size == 0 ||
+        info.st_size % sizeof(uint32_t) != 0) {
+      ::close(fd);
+      throw std::invalid_argument("Not a step stream: " + aPath);
+    }
+    mySize = static_cast<size_t>(info.st_size);
+    void *mapping = ::mmap(nullptr, mySize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error("Cannot map " + aPath);
+    }
+    // Played front to back, let the kernel read ahead
+    ::madvise(mapping, mySize, MADV_SEQUENTIAL);
+    myWords = static_cast<const uint32_t *>(mapping);
+
+    try {
+      myReader = StepStreamReader(myWords, mySize / sizeof(uint32_t));
+    } catch (...) {
+      ::munmap(mapping, mySize);
+      throw;
+    }
+  }
+
+  ~MappedStepStream() {
+    ::munmap(const_cast<uint32_t *>(myWords), mySize);
+  }
+
+  MappedStepStream(const MappedStepStream &) = delete;
+  MappedStepStream &operator=(const MappedStepStream &) = delete;
+
+  const StepStreamReader &GetReader() const { return myReader; }
+  const uint32_t *GetWords() const { return myWords; }
+  size_t GetWordCount() const { return mySize / sizeof(uint32_t); }
+
+private:
+  const uint32_t *myWords = nullptr;
+  size_t mySize = 0;
+  StepStreamReader myReader;
+};
+
+} // namespace PIOStepperSpeedController
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "Converter.hxx"
+#include "Ramp.hxx"
+#include "StepperConfig.hxx"
 #include <algorithm>
 #include <concepts>
 #include <cstdint>
@@ -27,7 +29,7 @@ namespace PIOStepperSpeedController {
     return a >= b || IsEq(a, b, epsilon);
   }
 
-enum class StepperState {
+enum class StepperState : uint8_t {
   STOPPED,
   STOPPING,
   STARTING,
@@ -40,26 +42,58 @@ enum class CallbackEvent { STOPPED, ACCELERATING, DECELERATING, COASTING };
 
 using Callback = void (*)(CallbackEvent event);
 
-template <typename Derived> class Stepper;
+/**
+Told about every state transition and every step of a Stepper, with the
+context the plain Callback functions lack. One per stepper, see
+Stepper::SetObserver(). The coroutine awaitables in Async.hxx use it. Called
+from inside Update() and the commands that change the state, eg. Stop(), so
+it must be quick.
+*/
+class StepperObserver {
+public:
+  virtual void OnTransition(StepperState aState) = 0;
+  virtual void OnStep(uint32_t aStepCount) = 0;
+
+protected:
+  ~StepperObserver() = default;
+};
+
+template <typename Derived, typename Params = RuntimeParams> class Stepper;
 
 template <typename Derived>
 concept StepperImpl = requires(Derived stepper, uint32_t aFrequency) {
   {stepper.EnableImpl()};
   {stepper.DisableImpl()};
+  {stepper.AbortImpl()};
   { stepper.PutStep(aFrequency) } -> std::convertible_to<bool>;
 }
-&&std::derived_from<Derived, Stepper<Derived>>;
-
-template <typename Derived> class Stepper {
+&&std::derived_from<Derived,
+                    Stepper<Derived, typename Derived::ParamsType>>;
+
+/**
+Params is where the configuration lives: RuntimeParams (the default) keeps it
+in the instance and takes it from the constructor, FixedParams<Config> makes
+it a compile time constant, see StepperConfig.hxx.
+*/
+template <typename Derived, typename Params> class Stepper {
 public:
+  using ParamsType = Params;
+
+  /// Longest segment SetRampSegment() accepts
+  static constexpr uint32_t MAX_RAMP_SEGMENT = 64;
+
+  /// Largest scale SetStepScale() accepts, full steps of a 1/256 driver
+  static constexpr uint32_t MAX_STEP_SCALE = 256;
+
   /**
   @brief Constructor for the Stepper class
   @param aMinSpeed Minimum speed in Hz
-  Note: aMinSpeed impacts how long the first
-  step takes. eg. 0.33hz will mean the first step takes 3.03 seconds regardless
-  of acceleration! 4hz will take 0.25 seconds for the first step so is a
-  reasonable starting speed for a human controlled power feed. It MUST be
-  greater than 0.
+  Note: aMinSpeed impacts how long the first step takes, eg. 1000hz means
+  the first step takes 1ms regardless of acceleration. For PIOStepper it
+  MUST be at least the slowest step the PIO program can output,
+  sysclk / (prescaler * 131078), see Converter::GetMinStepFrequency(). That
+  is about 953hz at prescaler 1 and 7.6hz at prescaler 125, raise the
+  prescaler for slower speeds such as a human controlled power feed.
   @param aMaxSpeed Maximum speed in Hz
   aMaxSpeed will be capped by the maximum possible speed provided by the clock
   speed and prescaler values if aMaxSpeed is greater than the maximum possible
@@ -97,34 +131,47 @@ public:
           Callback aCoastingCallback = nullptr,
           Callback aAcceleratingCallback = nullptr,
           Callback aDeceleratingCallback = nullptr)
-      : myAcceleration(aAcceleration), myDeceleration(aDeceleration),
-        mySysClk(aSysClk), myPrescaler(aPrescaler),
-        myStoppedCallback(aStoppedCallback),
+    requires std::same_as<Params, RuntimeParams>
+      : myStoppedCallback(aStoppedCallback),
         myCoastingCallback(aCoastingCallback),
         myAcceleratingCallback(aAcceleratingCallback),
         myDeceleratingCallback(aDeceleratingCallback),
-        myState(StepperState::STOPPED) {
-    myConverter = Converter(mySysClk, myPrescaler);
-    myMinFrequency =
-        std::max(myConverter.ToFrequency(UINT32_MAX - 1), aMinSpeed);
-    myMaxFrequency = std::min(myConverter.ToFrequency(1), aMaxSpeed);
-    myCurrentFrequency = myMinFrequency;
-    myTargetFrequency = myMinFrequency;
-    myRequestedFrequency = myMinFrequency;
-    myIsRunning = false;
+        myParams(aMinSpeed, aMaxSpeed, aAcceleration, aDeceleration, aSysClk,
+                 aPrescaler) {
+    Reset();
+  }
+
+  /**
+  @brief Constructor for a Stepper with compile time parameters, see
+  FixedParams in StepperConfig.hxx. The callbacks are the same as above.
+  */
+  explicit Stepper(Callback aStoppedCallback = nullptr,
+                   Callback aCoastingCallback = nullptr,
+                   Callback aAcceleratingCallback = nullptr,
+                   Callback aDeceleratingCallback = nullptr)
+    requires(!std::same_as<Params, RuntimeParams>)
+      : myStoppedCallback(aStoppedCallback),
+        myCoastingCallback(aCoastingCallback),
+        myAcceleratingCallback(aAcceleratingCallback),
+        myDeceleratingCallback(aDeceleratingCallback) {
+    Reset();
   }
 
   void Start() {
     if (!myIsRunning) {
-      myCurrentFrequency = myMinFrequency;
+      myCurrentFrequency = myParams.GetMinFrequency();
+      myMaxRampErrorTicks = 0;
+      ResetSegment();
       static_cast<Derived *>(this)->EnableImpl();
       
       myIsRunning = true;
     }
+    myIsFastStopping = false;
     
     //shoiuld be handled by the Starting case in Update()
     // // Set target frequency to the user's requested frequency (or min speed)
-    // myTargetFrequency = std::max(myRequestedFrequency, myMinFrequency);
+    // myTargetFrequency = std::max(myRequestedFrequency,
+    //                              myParams.GetMinFrequency());
     
     TransitionTo(StepperState::STARTING);
   }
@@ -134,11 +181,84 @@ public:
       return;
     }
 
-    myTargetFrequency = myMinFrequency;
+    myTargetFrequency = myParams.GetMinFrequency();
+
+    TransitionTo(StepperState::STOPPING);
+  }
+
+  /**
+  @brief Controlled stop using the fast stop deceleration instead of the
+  normal deceleration. Like Stop(), the steps already queued in the
+  implementation still play out before the ramp down takes effect. Calling it
+  during a normal Stop() switches that stop to the fast deceleration.
+  */
+  void FastStop() {
+    if (myState == StepperState::STOPPED) {
+      return;
+    }
+
+    myIsFastStopping = true;
+    myTargetFrequency = myParams.GetMinFrequency();
+    myRemainingSegmentSteps = 0; // the deceleration changes
 
-    myState = StepperState::STOPPING;
+    TransitionTo(StepperState::STOPPING);
   }
 
+  /**
+  @brief Hard stop. The implementation discards every queued step and drives
+  the step pin low before this returns (see AbortImpl()), there is no
+  deceleration. The stepper is left STOPPED and the stopped callback is fired
+  if it was moving. The requested frequency is kept for the next Start().
+  Expect the motor to lose position if it was moving faster than it can stop
+  from without ramping.
+  */
+  void EmergencyStop() {
+    static_cast<Derived *>(this)->AbortImpl();
+
+    myIsRunning = false;
+    myIsFastStopping = false;
+    myCurrentFrequency = myParams.GetMinFrequency();
+    myTargetFrequency = myParams.GetMinFrequency();
+    ResetSegment();
+    TransitionTo(StepperState::STOPPED);
+  }
+
+  /**
+  @brief Sets the deceleration used by FastStop() in Hz/s. Defaults to the
+  normal deceleration given to the constructor. Must be greater than zero.
+  */
+  void SetFastStopDeceleration(uint32_t aDeceleration) {
+    myFastDeceleration = aDeceleration;
+  }
+
+  uint32_t GetFastStopDeceleration() const { return myFastDeceleration; }
+
+  /**
+  @brief Segmented ramps. While accelerating or decelerating, the next
+  frequency is computed once per segment and held for every step of it, so
+  the implementation can reuse the step it converted last. A segment is at
+  most aSteps steps long, and shorter while the period would change by a
+  whole tick or more within it, so each held step is within about a tick of
+  the step the per step planner outputs. That makes segments long only at
+  high speeds, where the planner's time per step is shortest. 1, the default,
+  computes every step. Clamped to [1, MAX_RAMP_SEGMENT].
+  */
+  void SetRampSegment(uint32_t aSteps) {
+    myRampSegment =
+        static_cast<uint8_t>(std::clamp(aSteps, 1u, MAX_RAMP_SEGMENT));
+    myRemainingSegmentSteps = 0;
+  }
+
+  uint32_t GetRampSegment() const { return myRampSegment; }
+
+  /**
+  @brief Largest difference, in ticks, between a held step of a segmented
+  ramp and the step the per step planner would output in its place, since
+  the last Start() from stopped. Estimated from the rate the period changes
+  at when each segment starts. 0 when segments are off.
+  */
+  float GetMaxRampErrorTicks() const { return myMaxRampErrorTicks; }
+
   bool Update() {
     if (!myIsRunning) {
       return false;
@@ -149,10 +269,10 @@ public:
       case StepperState::STOPPING:
 
         //if the speed changed since last update and we are not stopping
-        if(!IsEq(myTargetFrequency, myMinFrequency)) {
-          myTargetFrequency = myMinFrequency;
+        if(!IsEq(myTargetFrequency, myParams.GetMinFrequency())) {
+          myTargetFrequency = myParams.GetMinFrequency();
         }
-        myTargetFrequency = myMinFrequency;
+        myTargetFrequency = myParams.GetMinFrequency();
         break;
       default:
 
@@ -168,7 +288,7 @@ public:
       return false;
       break;
     case StepperState::STOPPING:
-      if (IsLTEQ(myCurrentFrequency, myMinFrequency)) {
+      if (IsLTEQ(myCurrentFrequency, myParams.GetMinFrequency())) {
         myIsRunning = false;
         static_cast<Derived *>(this)->DisableImpl();
         TransitionTo(StepperState::STOPPED);
@@ -229,7 +349,8 @@ public:
       // Store the requested frequency even during stopping, but don't change target
       // This ensures the speed is remembered for next Start()
       if (aSpeedHz > 0) {
-        myRequestedFrequency = std::min(static_cast<float>(aSpeedHz), myMaxFrequency);
+        myRequestedFrequency = std::min(static_cast<float>(aSpeedHz),
+                                        myParams.GetMaxFrequency());
       }
       return;
     }
@@ -240,16 +361,27 @@ public:
     }
 
     // Store the user's requested frequency
-    myRequestedFrequency = std::min(static_cast<float>(aSpeedHz), myMaxFrequency);
+    myRequestedFrequency =
+        std::min(static_cast<float>(aSpeedHz), myParams.GetMaxFrequency());
     
 
   }
 
+  /**
+  @brief Like SetTargetHz(), but fractional and clamped to the minimum and
+  maximum frequency, for targets that are computed rather than chosen, eg. by
+  the Gearbox. Stored the same way while stopping.
+  */
+  void SetTargetFrequency(float aFrequencyHz) {
+    myRequestedFrequency = std::clamp(aFrequencyHz, myParams.GetMinFrequency(),
+                                      myParams.GetMaxFrequency());
+  }
+
   uint32_t GetCurrentPeriod() const {
     if (myState == StepperState::STOPPED) {
       return 0;
     } else {
-      return myConverter.ToPeriod(myCurrentFrequency);
+      return myParams.GetConverter().ToPeriod(myCurrentFrequency);
     }
   }
 
@@ -273,54 +405,238 @@ public:
     return myRequestedFrequency;
   }
   
-  StepperState GetState() { return myState; }
+  StepperState GetState() const { return myState; }
+
+  /**
+  @brief Number of steps the planner will output to get from the current
+  frequency (the minimum when stopped) to aFrequencyHz, clamped to the minimum
+  and maximum, at the acceleration or deceleration that applies. Computed in
+  closed form, see Ramp.hxx, so it is cheap enough to call every control
+  tick. Steps already queued in the implementation come on top.
+  */
+  uint32_t StepsToReach(float aFrequencyHz) const {
+    float target = ClampFrequency(aFrequencyHz);
+    return PredictRamp(myParams.GetConverter(), GetRampStart(), target,
+                       RateTowards(target))
+        .steps;
+  }
+
+  /// Time in seconds the steps counted by StepsToReach() take
+  float TimeToReach(float aFrequencyHz) const {
+    float target = ClampFrequency(aFrequencyHz);
+    return PredictRamp(myParams.GetConverter(), GetRampStart(), target,
+                       RateTowards(target))
+        .seconds;
+  }
+
+  /**
+  @brief Number of steps a stop started now still outputs, at the
+  deceleration in use (the fast stop one during FastStop()). 0 when stopped.
+  Steps already queued in the implementation come on top.
+  */
+  uint32_t StopDistance() const {
+    if (myState == StepperState::STOPPED) {
+      return 0;
+    }
+    return PredictRamp(myParams.GetConverter(), myCurrentFrequency,
+                       myParams.GetMinFrequency(), GetActiveDeceleration())
+        .steps;
+  }
+
+  /**
+  @brief Steps output since construction, wraps at 2^32. A step counts once
+  PutStep() accepted it, or once the implementation queued it without the
+  planner, see CountSteps(); steps an EmergencyStop() throws away from the
+  implementation's queue are taken off again, see DiscardSteps().
+  */
+  uint32_t GetStepCount() const { return myStepCount; }
+
+  /// User steps each PutStep() stands for, see SetStepScale()
+  uint32_t GetStepScale() const { return myStepScale; }
+
+  float GetMinFrequency() const { return myParams.GetMinFrequency(); }
+  float GetMaxFrequency() const { return myParams.GetMaxFrequency(); }
+
+  /// Sets the one observer of this stepper, nullptr to remove it
+  void SetObserver(StepperObserver *anObserver) { myObserver = anObserver; }
 
 protected:
-  Converter myConverter;
+  const Converter &GetConverter() const { return myParams.GetConverter(); }
+
+  /**
+  @brief For implementations that output coarser steps than the planner's,
+  eg. when switching microstep resolution (see Microstepping.hxx): each
+  PutStep() from then on stands for aScale steps. Frequencies stay in the
+  planner's steps/s, the implementation outputs at 1/aScale of them. The
+  step count and the ramps advance by aScale steps per PutStep(). May be
+  called from PutStep(), the step being put is then counted at aScale.
+  @param aScale 1 to MAX_STEP_SCALE
+  */
+  void SetStepScale(uint32_t aScale) {
+    myStepScale = static_cast<uint16_t>(
+        std::clamp(aScale, 1u, static_cast<uint32_t>(MAX_STEP_SCALE)));
+  }
+
+  /**
+  @brief For implementations that queue steps the planner did not put, eg.
+  precomputed step words: counts aSteps planner steps as output and tells
+  the observer, as PutStep() does.
+  */
+  void CountSteps(uint32_t aSteps) {
+    myStepCount += aSteps;
+    if (myObserver != nullptr) {
+      myObserver->OnStep(myStepCount);
+    }
+  }
+
+  /**
+  @brief For implementations that queue steps: takes aSteps planner steps
+  that were counted but never output back off the step count, eg. from
+  AbortImpl() when it clears a queue.
+  */
+  void DiscardSteps(uint32_t aSteps) { myStepCount -= aSteps; }
 
 private:
+  void Reset() {
+    myFastDeceleration = myParams.GetDeceleration();
+    myCurrentFrequency = myParams.GetMinFrequency();
+    myTargetFrequency = myParams.GetMinFrequency();
+    myRequestedFrequency = myParams.GetMinFrequency();
+    myState = StepperState::STOPPED;
+    myIsRunning = false;
+    myIsFastStopping = false;
+    myStepCount = 0;
+    myObserver = nullptr;
+    myMaxRampErrorTicks = 0;
+    myRampSegment = 1;
+    ResetSegment();
+    myStepScale = 1;
+  }
+
+  // A segment never carries over a stop, the next ramp starts afresh
+  void ResetSegment() {
+    myRemainingSegmentSteps = 0;
+    mySegmentState = StepperState::STOPPED;
+  }
+
+  float ClampFrequency(float aFrequencyHz) const {
+    return std::clamp(aFrequencyHz, myParams.GetMinFrequency(),
+                      myParams.GetMaxFrequency());
+  }
+
+  uint32_t GetActiveDeceleration() const {
+    return myIsFastStopping ? myFastDeceleration : myParams.GetDeceleration();
+  }
+
+  // Start() restarts from the minimum frequency
+  float GetRampStart() const {
+    return myState == StepperState::STOPPED ? myParams.GetMinFrequency()
+                                            : myCurrentFrequency;
+  }
+
+  uint32_t RateTowards(float aFrequencyHz) const {
+    return aFrequencyHz > GetRampStart() ? myParams.GetAcceleration()
+                                         : GetActiveDeceleration();
+  }
+
+  // The rate change of a segment of aSteps, each standing for myStepScale
+  // planner steps. Up to MAX_RAMP_SEGMENT * MAX_STEP_SCALE times the rate,
+  // so in 64 bits, and clamped to what CalculateNextFrequency() takes: any
+  // rate that large reaches the limits of the ramp in one step anyway.
+  int32_t GetSegmentRate(uint32_t aRate, uint32_t aSteps) const {
+    uint64_t rate = static_cast<uint64_t>(aRate) * aSteps * myStepScale;
+    return static_cast<int32_t>(
+        std::min<uint64_t>(rate, static_cast<uint64_t>(INT32_MAX)));
+  }
+
+  // Starts a segment of a ramp at aRate Hz/s and returns its length in steps:
+  // up to myRampSegment, and as many as the period takes to change by a tick
+  uint32_t StartSegment(StepperState aState, uint32_t aRate) {
+    uint32_t steps = 1;
+    if (myRampSegment > 1) {
+      // The period changes by tickHz * rate * scale^2 / f^3 ticks per step
+      float f = myCurrentFrequency;
+      float scale = myStepScale;
+      float stepsPerTick = f * f * f /
+                           (myParams.GetConverter().GetTickHz() * aRate *
+                            scale * scale);
+      steps = static_cast<uint32_t>(
+          std::clamp(stepsPerTick, 1.0f, static_cast<float>(myRampSegment)));
+      if (steps > 1) {
+        myMaxRampErrorTicks =
+            std::max(myMaxRampErrorTicks, (steps - 1) / stepsPerTick);
+      }
+    }
+    mySegmentState = aState;
+    myRemainingSegmentSteps = static_cast<uint8_t>(steps - 1);
+    return steps;
+  }
+
+  void OutputStep(float aFrequency) {
+    static_cast<Derived *>(this)->PutStep(aFrequency);
+    CountSteps(myStepScale);
+  }
+
   bool Step(StepperState aState) {
+    if (aState != mySegmentState) {
+      myRemainingSegmentSteps = 0;
+    }
+    if (myRemainingSegmentSteps > 0) {
+      myRemainingSegmentSteps--;
+      OutputStep(myCurrentFrequency);
+      return true;
+    }
+
     switch (aState) {
     case StepperState::STARTING: {
-      static_cast<Derived *>(this)->PutStep(myCurrentFrequency);
+      OutputStep(myCurrentFrequency);
       return true;
     } break;
 
     case StepperState::ACCELERATING: {
-      float nextFrequency = myConverter.CalculateNextFrequency(
-          myCurrentFrequency, myAcceleration);
-
-      if (nextFrequency >= myMaxFrequency) {
-        myCurrentFrequency = myMaxFrequency;
-        myTargetFrequency = myMaxFrequency;
+      uint32_t steps = StartSegment(aState, myParams.GetAcceleration());
+      float nextFrequency = myParams.GetConverter().CalculateNextFrequency(
+          myCurrentFrequency,
+          GetSegmentRate(myParams.GetAcceleration(), steps));
+
+      if (nextFrequency >= myParams.GetMaxFrequency()) {
+        myCurrentFrequency = myParams.GetMaxFrequency();
+        myTargetFrequency = myParams.GetMaxFrequency();
+        myRemainingSegmentSteps = 0;
       } else if (nextFrequency >= myTargetFrequency) {
         myCurrentFrequency = myTargetFrequency;
+        myRemainingSegmentSteps = 0;
       } else {
         myCurrentFrequency = nextFrequency;
       }
-      static_cast<Derived *>(this)->PutStep(myCurrentFrequency);
+      OutputStep(myCurrentFrequency);
       return true;
     } break;
 
     case StepperState::DECELERATING: {
-      float nextFrequency = myConverter.CalculateNextFrequency(
-          myCurrentFrequency, -myDeceleration);
+      uint32_t deceleration = GetActiveDeceleration();
+      uint32_t steps = StartSegment(aState, deceleration);
+      float nextFrequency = myParams.GetConverter().CalculateNextFrequency(
+          myCurrentFrequency,
+          -GetSegmentRate(deceleration, steps));
       myCurrentFrequency = nextFrequency;
       if (nextFrequency <= myTargetFrequency) {
         myCurrentFrequency = myTargetFrequency;
+        myRemainingSegmentSteps = 0;
       }
 
-      if (myCurrentFrequency <= myMinFrequency) {
-        myCurrentFrequency = myMinFrequency;
+      if (myCurrentFrequency <= myParams.GetMinFrequency()) {
+        myCurrentFrequency = myParams.GetMinFrequency();
+        myRemainingSegmentSteps = 0;
       }
 
-      static_cast<Derived *>(this)->PutStep(myCurrentFrequency);
+      OutputStep(myCurrentFrequency);
       return true;
     }
 
     break;
     case StepperState::COASTING: {
-      static_cast<Derived *>(this)->PutStep(myCurrentFrequency);
+      OutputStep(myCurrentFrequency);
       return true;
     } break;
     default:
@@ -330,6 +646,7 @@ private:
   }
 
   void TransitionTo(StepperState aState) {
+    StepperState previous = myState;
     switch (aState) {
     case StepperState::ACCELERATING:
       if (myState != StepperState::ACCELERATING) {
@@ -380,6 +697,10 @@ private:
       }
       break;
     }
+
+    if (myState != previous && myObserver != nullptr) {
+      myObserver->OnTransition(myState);
+    }
   }
 
   // Function pointers (typically 8 bytes on 64-bit systems)
@@ -387,21 +708,29 @@ private:
   Callback myCoastingCallback;
   Callback myAcceleratingCallback;
   Callback myDeceleratingCallback;
+  StepperObserver *myObserver;
+
+  // Empty when the parameters are fixed at compile time
+  [[no_unique_address]] Params myParams;
 
   // 4-byte aligned members
-  uint32_t myAcceleration;
-  uint32_t myDeceleration;
-  uint32_t mySysClk;
-  uint32_t myPrescaler;
-  float myMaxFrequency;
-  float myMinFrequency;
+  uint32_t myFastDeceleration;
   float myCurrentFrequency;
   float myTargetFrequency;
   float myRequestedFrequency;  // Tracks user's requested frequency separately
+  uint32_t myStepCount;
+  float myMaxRampErrorTicks;
+
+  // 2-byte members
+  uint16_t myStepScale;
 
   // 1-byte members
   StepperState myState;
   bool myIsRunning;
+  bool myIsFastStopping;
+  uint8_t myRampSegment;
+  uint8_t myRemainingSegmentSteps;
+  StepperState mySegmentState;
 };
 
 } // namespace PIOStepperSpeedController
\ No newline at end of file
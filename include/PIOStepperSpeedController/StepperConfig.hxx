@@ -0,0 +1,111 @@
+#pragma once
+
+#include "Converter.hxx"
+#include <algorithm>
+#include <cstdint>
+
+namespace PIOStepperSpeedController {
+
+/**
+Stepper parameters as a literal type, so a firmware whose parameters never
+change can pass them as a template argument and have the ramp math constant
+folded. The fields have the same meaning and limits as the Stepper
+constructor parameters, see Stepper.hxx.
+
+eg.
+  static constexpr StepperConfig FEED_CONFIG{.minSpeed = 10,
+                                             .maxSpeed = 10000,
+                                             .acceleration = 1000,
+                                             .deceleration = 2000,
+                                             .sysClk = 125000000,
+                                             .prescaler = 125};
+  class FeedStepper : public Stepper<FeedStepper, FixedParams<FEED_CONFIG>>
+*/
+struct StepperConfig {
+  float minSpeed;
+  float maxSpeed;
+  uint32_t acceleration;
+  uint32_t deceleration;
+  uint32_t sysClk = 125000000;
+  uint32_t prescaler = 1;
+
+  constexpr Converter GetConverter() const {
+    return Converter(sysClk, prescaler);
+  }
+
+  /// minSpeed, raised to the slowest speed one 32 bit period can represent
+  constexpr float GetMinFrequency() const {
+    return std::max(GetConverter().ToFrequency(UINT32_MAX - 1), minSpeed);
+  }
+
+  /// maxSpeed, capped to the fastest speed the clock and prescaler allow
+  constexpr float GetMaxFrequency() const {
+    return std::min(GetConverter().ToFrequency(1), maxSpeed);
+  }
+};
+
+/**
+Parameters held in each Stepper instance, set by the constructor. This is the
+default, and the only option when the parameters are not known at compile
+time.
+*/
+class RuntimeParams {
+public:
+  RuntimeParams(float aMinSpeed, float aMaxSpeed, uint32_t anAcceleration,
+                uint32_t aDeceleration, uint32_t aSysClk, uint32_t aPrescaler)
+      : myConverter(aSysClk, aPrescaler), myAcceleration(anAcceleration),
+        myDeceleration(aDeceleration) {
+    myMinFrequency =
+        std::max(myConverter.ToFrequency(UINT32_MAX - 1), aMinSpeed);
+    myMaxFrequency = std::min(myConverter.ToFrequency(1), aMaxSpeed);
+  }
+
+  const Converter &GetConverter() const { return myConverter; }
+  uint32_t GetAcceleration() const { return myAcceleration; }
+  uint32_t GetDeceleration() const { return myDeceleration; }
+  float GetMinFrequency() const { return myMinFrequency; }
+  float GetMaxFrequency() const { return myMaxFrequency; }
+
+private:
+  Converter myConverter;
+  uint32_t myAcceleration;
+  uint32_t myDeceleration;
+  float myMinFrequency;
+  float myMaxFrequency;
+};
+
+/**
+Parameters fixed at compile time. It holds no data, every accessor is a
+constant, and the derived limits below are computed by the compiler. An
+invalid Config (zero prescaler, non positive speeds or ramps) fails to compile.
+*/
+template <StepperConfig Config> class FixedParams {
+public:
+  static constexpr Converter CONVERTER = Config.GetConverter();
+  static constexpr float MIN_FREQUENCY = Config.GetMinFrequency();
+  static constexpr float MAX_FREQUENCY = Config.GetMaxFrequency();
+
+  /// Longest and shortest periods the planner will output, in PIO ticks
+  static constexpr uint32_t MAX_PERIOD = CONVERTER.ToPeriod(MIN_FREQUENCY);
+  static constexpr uint32_t MIN_PERIOD = CONVERTER.ToPeriod(MAX_FREQUENCY);
+
+  /// PIO ticks per second
+  static constexpr float TICK_HZ = CONVERTER.GetTickHz();
+
+  static_assert(Config.minSpeed > 0, "minSpeed must be greater than 0");
+  static_assert(Config.maxSpeed > 0, "maxSpeed must be greater than 0");
+  static_assert(Config.acceleration > 0,
+                "acceleration must be greater than 0");
+  static_assert(Config.deceleration > 0,
+                "deceleration must be greater than 0");
+  static_assert(MIN_FREQUENCY <= MAX_FREQUENCY,
+                "minSpeed must not be above maxSpeed");
+
+  static constexpr const Converter &GetConverter() { return CONVERTER; }
+  static constexpr uint32_t GetAcceleration() { return Config.acceleration; }
+  static constexpr uint32_t GetDeceleration() { return Config.deceleration; }
+  static constexpr float GetMinFrequency() { return MIN_FREQUENCY; }
+  static constexpr float GetMaxFrequency() { return MAX_FREQUENCY; }
+};
+
+} // namespace PIOStepperSpeedController
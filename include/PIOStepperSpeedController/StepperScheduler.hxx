@@ -0,0 +1,185 @@
+#pragma once
+
+#include "Stepper.hxx"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+namespace PIOStepperSpeedController {
+
+/// Slack statistics of one axis of a StepperScheduler
+struct SchedulerAxisStats {
+  /// Steps queued for this axis by the scheduler
+  uint32_t services;
+  /**
+  Estimated time the queued steps would have lasted when the axis was
+  serviced, ie. how much longer it could have waited, in microseconds. Once
+  the queue has started filling after a start, 0 before.
+  */
+  uint32_t minSlackUs;
+  uint32_t avgSlackUs;
+  /**
+  Services that found the queue empty once it had started filling after a
+  start, ie. the state machine may have run dry
+  */
+  uint32_t underruns;
+};
+
+/**
+Services several steppers from one core without any of them starving: each
+RunOnce() queues one step on the axis whose queue runs dry first, earliest
+deadline first, and skips axes whose queue is full, so it never waits on a
+FIFO.
+
+Every axis estimates how long its queue lasts from the steps it holds and
+its current output period. The axis with the least of that slack is the
+most urgent. Round robin Update() calls spend the same time on every axis,
+so a slow axis with a full queue holds up a fast one about to run dry.
+
+eg.
+  StepperScheduler<PIOStepper> scheduler;
+  scheduler.Add(x);
+  scheduler.Add(y);
+  scheduler.Add(z);
+  while (true) {
+    scheduler.RunOnce();
+    // other work, kept shorter than the smallest slack
+  }
+
+S is a Stepper whose implementation also reports its queue, as PIOStepper
+does: GetQueuedSteps() and GetQueueDepth().
+*/
+template <typename S, size_t MAX_AXES = 8> class StepperScheduler {
+public:
+  /// The slack of a queue with no step in it, the most urgent
+  static constexpr uint32_t NO_SLACK = 0;
+
+  /**
+  @brief Adds a stepper, it must outlive the scheduler.
+  @return The axis index, for GetStats()
+  */
+  size_t Add(S &aStepper) {
+    if (myAxisCount == MAX_AXES) {
+      throw std::invalid_argument("Too many axes");
+    }
+    myAxes[myAxisCount] = Axis{&aStepper};
+    return myAxisCount++;
+  }
+
+  size_t GetAxisCount() const { return myAxisCount; }
+
+  /**
+  @brief Queues one step on the moving axis with the least slack that has
+  room for it. Does not wait for room.
+  @return The index of the axis serviced, or -1 if none needed it
+  */
+  int RunOnce() {
+    int urgent = -1;
+    uint32_t urgentSlack = UINT32_MAX;
+    uint32_t urgentQueued = 0;
+    for (size_t i = 0; i < myAxisCount; i++) {
+      Axis &axis = myAxes[i];
+      if (axis.stepper->GetState() == StepperState::STOPPED) {
+        axis.isFilled = false;
+        continue;
+      }
+      uint32_t queued = axis.stepper->GetQueuedSteps();
+      if (queued >= axis.stepper->GetQueueDepth()) {
+        continue;
+      }
+      uint32_t slack = GetSlackUs(*axis.stepper, queued);
+      if (slack < urgentSlack) {
+        urgent = static_cast<int>(i);
+        urgentSlack = slack;
+        urgentQueued = queued;
+      }
+    }
+    if (urgent < 0) {
+      return -1;
+    }
+
+    Axis &axis = myAxes[urgent];
+    Record(axis, urgentQueued, urgentSlack);
+    axis.stepper->Update();
+    return urgent;
+  }
+
+  /// The slack statistics of an axis since it was added or last reset
+  SchedulerAxisStats GetStats(size_t anAxis) const {
+    const Axis &axis = myAxes[anAxis];
+    SchedulerAxisStats stats{};
+    stats.services = axis.services;
+    stats.minSlackUs = axis.judged > 0 ? axis.minSlackUs : 0;
+    stats.avgSlackUs =
+        axis.judged > 0
+            ? static_cast<uint32_t>(axis.totalSlackUs / axis.judged)
+            : 0;
+    stats.underruns = axis.underruns;
+    return stats;
+  }
+
+  void ResetStats() {
+    for (size_t i = 0; i < myAxisCount; i++) {
+      Axis &axis = myAxes[i];
+      axis.services = 0;
+      axis.judged = 0;
+      axis.minSlackUs = UINT32_MAX;
+      axis.totalSlackUs = 0;
+      axis.underruns = 0;
+    }
+  }
+
+  /**
+  @brief How long aQueued steps of aStepper last at its current speed, in
+  microseconds. The step being output is not counted, how much of it is left
+  is not known.
+  */
+  static uint32_t GetSlackUs(const S &aStepper, uint32_t aQueued) {
+    if (aQueued == 0) {
+      return NO_SLACK;
+    }
+    float outputHz = aStepper.GetCurrentFrequency() / aStepper.GetStepScale();
+    if (outputHz <= 0) {
+      return NO_SLACK;
+    }
+    float slack = aQueued * 1e6f / outputHz;
+    return slack >= static_cast<float>(UINT32_MAX - 1)
+               ? UINT32_MAX - 1
+               : static_cast<uint32_t>(slack);
+  }
+
+private:
+  struct Axis {
+    S *stepper = nullptr;
+    bool isFilled = false; // the queue has held a step since the start
+    uint32_t services = 0;
+    uint32_t judged = 0; // services counted in the slack
+    uint32_t minSlackUs = UINT32_MAX;
+    uint64_t totalSlackUs = 0;
+    uint32_t underruns = 0;
+  };
+
+  // The queue is empty by design until it has started to fill after a
+  // start, only the services after that are judged
+  void Record(Axis &anAxis, uint32_t aQueued, uint32_t aSlack) {
+    anAxis.services++;
+    if (aQueued > 0) {
+      anAxis.isFilled = true;
+    } else if (anAxis.isFilled) {
+      anAxis.underruns++;
+    }
+    if (!anAxis.isFilled) {
+      return;
+    }
+    anAxis.judged++;
+    anAxis.minSlackUs = std::min(anAxis.minSlackUs, aSlack);
+    anAxis.totalSlackUs += aSlack;
+  }
+
+  std::array<Axis, MAX_AXES> myAxes{};
+  size_t myAxisCount = 0;
+};
+
+} // namespace PIOStepperSpeedController
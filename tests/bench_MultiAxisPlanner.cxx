@@ -0,0 +1,102 @@
+// Host benchmark, not a test: compares one MultiAxisPlanner::Update() against
+// N separate Stepper::Update() calls, over the same ramps.
+//   ./stepper_bench
+#include <PIOStepperSpeedController/MultiAxisPlanner.hxx>
+#include <PIOStepperSpeedController/Stepper.hxx>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+using namespace PIOStepperSpeedController;
+
+// Keeps only a checksum of the words, so the work is not optimised away
+class BenchStepper : public Stepper<BenchStepper> {
+public:
+  using Stepper::Stepper;
+
+  bool PutStep(float aFrequency) {
+    checksum += GetConverter().ToStepWord(aFrequency);
+    return true;
+  }
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() {}
+
+  uint32_t checksum = 0;
+};
+
+static constexpr uint32_t UPDATES = 20000;
+static constexpr uint32_t ROUNDS = 20;
+
+static float TargetOf(size_t anAxis) { return 5000.0f + 1000.0f * anAxis; }
+
+template <size_t N> static double BenchPlanner(uint32_t &aChecksum) {
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t round = 0; round < ROUNDS; round++) {
+    MultiAxisPlanner<N> planner;
+    for (size_t i = 0; i < N; i++) {
+      planner.Configure(i, 1000, 100000, 50000, 50000);
+      planner.SetTargetFrequency(i, TargetOf(i));
+      planner.Start(i);
+    }
+    std::array<uint32_t, N> words;
+    for (uint32_t n = 0; n < UPDATES; n++) {
+      uint32_t stepped = planner.Update(words);
+      for (size_t i = 0; i < N; i++) {
+        if (stepped & (1u << i)) {
+          aChecksum += words[i];
+        }
+      }
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / (static_cast<double>(ROUNDS) * UPDATES * N);
+}
+
+template <size_t N> static double BenchSteppers(uint32_t &aChecksum) {
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t round = 0; round < ROUNDS; round++) {
+    std::vector<std::unique_ptr<BenchStepper>> steppers;
+    for (size_t i = 0; i < N; i++) {
+      steppers.push_back(
+          std::make_unique<BenchStepper>(1000, 100000, 50000, 50000));
+      steppers.back()->SetTargetFrequency(TargetOf(i));
+      steppers.back()->Start();
+    }
+    for (uint32_t n = 0; n < UPDATES; n++) {
+      for (auto &stepper : steppers) {
+        stepper->Update();
+      }
+    }
+    for (auto &stepper : steppers) {
+      aChecksum += stepper->checksum;
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / (static_cast<double>(ROUNDS) * UPDATES * N);
+}
+
+template <size_t N> static void Compare() {
+  uint32_t plannerChecksum = 0;
+  uint32_t steppersChecksum = 0;
+  double planner = BenchPlanner<N>(plannerChecksum);
+  double steppers = BenchSteppers<N>(steppersChecksum);
+  std::printf("%2zu axes: planner %6.2f ns, steppers %6.2f ns per axis "
+              "update, %.2fx%s\n",
+              N, planner, steppers, steppers / planner,
+              plannerChecksum == steppersChecksum ? "" : " (output differs!)");
+}
+
+int main() {
+  Compare<1>();
+  Compare<4>();
+  Compare<8>();
+  Compare<16>();
+  Compare<32>();
+  return 0;
+}
@@ -0,0 +1,480 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+/**
+@brief Cycle level model of a single RP2040 PIO state machine, used by the
+tests to run the programs produced by pioasm on the host.
+
+It executes the raw instruction words from the generated .pio.h header, one
+instruction (or delay/stall cycle) per call to Clock(), the same way the
+hardware advances one instruction per divided clock. Only what our programs
+need is modelled: no IRQ flags, no autopush/autopull and a single SM.
+*/
+class PioModel {
+public:
+  PioModel(const uint16_t *aProgram, size_t aLength, uint8_t aWrapTarget,
+           uint8_t aWrap)
+      : myProgram(aProgram, aProgram + aLength), myWrapTarget(aWrapTarget),
+        myWrap(aWrap) {}
+
+  void SetSetPins(uint32_t aBase, uint32_t aCount) {
+    mySetBase = aBase;
+    mySetCount = aCount;
+  }
+
+  void SetOutPins(uint32_t aBase, uint32_t aCount) {
+    myOutBase = aBase;
+    myOutCount = aCount;
+  }
+
+  void SetInBase(uint32_t aBase) { myInBase = aBase; }
+
+  void SetJmpPin(uint32_t aPin) { myJmpPin = aPin; }
+
+  void SetSideset(uint32_t aBase, uint32_t aCount, bool anOptional) {
+    mySidesetBase = aBase;
+    mySidesetCount = aCount;
+    mySidesetOptional = anOptional;
+  }
+
+  void SetOutShiftRight(bool aShiftRight) { myOutShiftRight = aShiftRight; }
+
+  void SetInShiftRight(bool aShiftRight) { myInShiftRight = aShiftRight; }
+
+  /// Equivalent of sm_config_set_fifo_join(PIO_FIFO_JOIN_TX)
+  void JoinTxFifo(bool aJoin) {
+    myTxCapacity = aJoin ? 8 : 4;
+    ClearFifos();
+  }
+
+  void SetEnabled(bool anEnabled) { myEnabled = anEnabled; }
+  bool IsEnabled() const { return myEnabled; }
+
+  /// Equivalent of pio_sm_clear_fifos()
+  void ClearFifos() {
+    myTx.clear();
+    myRx.clear();
+  }
+
+  /// Equivalent of pio_sm_restart(): clears shift counters, ISR and delay,
+  /// but leaves the PC, scratch registers and FIFOs alone.
+  void Restart() {
+    myIsr = 0;
+    myIsrCount = 0;
+    myOsrCount = 32;
+    myDelay = 0;
+  }
+
+  /// Equivalent of pio_sm_exec(), runs an instruction immediately, even when
+  /// the state machine is disabled.
+  void Exec(uint16_t anInstruction) { Execute(anInstruction, true); }
+
+  /// Equivalent of a non-blocking TX FIFO put, false if the FIFO is full
+  bool Push(uint32_t aWord) {
+    if (myTx.size() >= myTxCapacity) {
+      return false;
+    }
+    myTx.push_back(aWord);
+    return true;
+  }
+
+  std::optional<uint32_t> PopRx() {
+    if (myRx.empty()) {
+      return std::nullopt;
+    }
+    uint32_t word = myRx.front();
+    myRx.pop_front();
+    return word;
+  }
+
+  size_t GetTxLevel() const { return myTx.size(); }
+  size_t GetTxCapacity() const { return myTxCapacity; }
+  size_t GetRxLevel() const { return myRx.size(); }
+
+  /// Sticky, like FDEBUG.TXSTALL. Cleared with ClearTxStall()
+  bool GetTxStall() const { return myTxStall; }
+  void ClearTxStall() { myTxStall = false; }
+
+  void SetInput(uint32_t aPin, bool aValue) {
+    if (aValue) {
+      myInputs |= (1u << aPin);
+    } else {
+      myInputs &= ~(1u << aPin);
+    }
+  }
+
+  bool GetPin(uint32_t aPin) const { return (myPins >> aPin) & 1u; }
+  uint32_t GetPins() const { return myPins; }
+  uint8_t GetPc() const { return myPc; }
+  uint32_t GetX() const { return myX; }
+  uint32_t GetY() const { return myY; }
+  uint64_t GetCycles() const { return myCycles; }
+
+  /// Advances the state machine by one (divided) clock
+  void Clock() {
+    myCycles++;
+    if (!myEnabled) {
+      return;
+    }
+    if (myDelay > 0) {
+      myDelay--;
+      return;
+    }
+    Execute(myProgram[myPc], false);
+  }
+
+  void Run(uint64_t aCycles) {
+    for (uint64_t i = 0; i < aCycles; i++) {
+      Clock();
+    }
+  }
+
+private:
+  static uint32_t BitRev(uint32_t aValue) {
+    uint32_t result = 0;
+    for (int i = 0; i < 32; i++) {
+      result = (result << 1) | ((aValue >> i) & 1u);
+    }
+    return result;
+  }
+
+  static uint32_t Mask(uint32_t aCount) {
+    return aCount >= 32 ? 0xFFFFFFFFu : ((1u << aCount) - 1u);
+  }
+
+  uint32_t ReadPins(uint32_t aBase) const {
+    // Pins wrap around the 32 GPIOs starting at the base
+    uint32_t inputs = myInputs;
+    return (inputs >> aBase) | (aBase ? (inputs << (32 - aBase)) : 0);
+  }
+
+  void WritePins(uint32_t aBase, uint32_t aCount, uint32_t aValue) {
+    for (uint32_t i = 0; i < aCount; i++) {
+      uint32_t pin = (aBase + i) & 31u;
+      if ((aValue >> i) & 1u) {
+        myPins |= (1u << pin);
+      } else {
+        myPins &= ~(1u << pin);
+      }
+    }
+  }
+
+  uint32_t ShiftOut(uint32_t aCount) {
+    uint32_t mask = Mask(aCount);
+    uint32_t value;
+    if (myOutShiftRight) {
+      value = myOsr & mask;
+      myOsr = aCount >= 32 ? 0 : myOsr >> aCount;
+    } else {
+      value = aCount >= 32 ? myOsr : (myOsr >> (32 - aCount)) & mask;
+      myOsr = aCount >= 32 ? 0 : myOsr << aCount;
+    }
+    myOsrCount = std::min<uint32_t>(32, myOsrCount + aCount);
+    return value;
+  }
+
+  void ShiftIn(uint32_t aValue, uint32_t aCount) {
+    uint32_t data = aValue & Mask(aCount);
+    if (myInShiftRight) {
+      myIsr = aCount >= 32 ? data : (myIsr >> aCount) | (data << (32 - aCount));
+    } else {
+      myIsr = aCount >= 32 ? data : (myIsr << aCount) | data;
+    }
+    myIsrCount = std::min<uint32_t>(32, myIsrCount + aCount);
+  }
+
+  void Advance() { myPc = (myPc == myWrap) ? myWrapTarget : myPc + 1; }
+
+  void Execute(uint16_t anInstruction, bool anIsExec) {
+    uint32_t delaySideset = (anInstruction >> 8) & 0x1Fu;
+    uint32_t sidesetBits = mySidesetCount + (mySidesetOptional ? 1 : 0);
+    uint32_t delay = delaySideset & Mask(5 - sidesetBits);
+
+    if (mySidesetCount > 0) {
+      uint32_t sideset = delaySideset >> (5 - sidesetBits);
+      bool apply = true;
+      if (mySidesetOptional) {
+        apply = (sideset >> mySidesetCount) & 1u;
+        sideset &= Mask(mySidesetCount);
+      }
+      if (apply) {
+        WritePins(mySidesetBase, mySidesetCount, sideset);
+      }
+    }
+
+    uint32_t opcode = anInstruction >> 13;
+    uint32_t arg1 = (anInstruction >> 5) & 0x7u;
+    uint32_t arg2 = anInstruction & 0x1Fu;
+    bool jumped = false;
+    bool stalled = false;
+
+    switch (opcode) {
+    case 0: { // JMP
+      bool condition = false;
+      switch (arg1) {
+      case 0:
+        condition = true;
+        break;
+      case 1:
+        condition = myX == 0;
+        break;
+      case 2:
+        condition = myX != 0;
+        myX--;
+        break;
+      case 3:
+        condition = myY == 0;
+        break;
+      case 4:
+        condition = myY != 0;
+        myY--;
+        break;
+      case 5:
+        condition = myX != myY;
+        break;
+      case 6:
+        condition = (myInputs >> myJmpPin) & 1u;
+        break;
+      case 7:
+        condition = myOsrCount < 32;
+        break;
+      }
+      if (condition) {
+        myPc = static_cast<uint8_t>(arg2);
+        jumped = true;
+      }
+    } break;
+
+    case 1: { // WAIT
+      bool polarity = (anInstruction >> 7) & 1u;
+      uint32_t source = (anInstruction >> 5) & 0x3u;
+      bool level = false;
+      if (source == 0) {
+        level = (myInputs >> arg2) & 1u;
+      } else if (source == 1) {
+        level = (ReadPins(myInBase) >> arg2) & 1u;
+      } else {
+        level = polarity; // IRQ waits are not modelled
+      }
+      stalled = level != polarity;
+    } break;
+
+    case 2: { // IN
+      uint32_t count = arg2 == 0 ? 32 : arg2;
+      uint32_t value = 0;
+      switch (arg1) {
+      case 0:
+        value = ReadPins(myInBase);
+        break;
+      case 1:
+        value = myX;
+        break;
+      case 2:
+        value = myY;
+        break;
+      case 6:
+        value = myIsr;
+        break;
+      case 7:
+        value = myOsr;
+        break;
+      default:
+        break;
+      }
+      ShiftIn(value, count);
+    } break;
+
+    case 3: { // OUT
+      uint32_t count = arg2 == 0 ? 32 : arg2;
+      uint32_t value = ShiftOut(count);
+      switch (arg1) {
+      case 0:
+        WritePins(myOutBase, myOutCount, value);
+        break;
+      case 1:
+        myX = value;
+        break;
+      case 2:
+        myY = value;
+        break;
+      case 5:
+        myPc = static_cast<uint8_t>(value);
+        jumped = true;
+        break;
+      case 6:
+        myIsr = value;
+        myIsrCount = count;
+        break;
+      default:
+        break;
+      }
+    } break;
+
+    case 4: { // PUSH / PULL
+      bool isPull = (anInstruction >> 7) & 1u;
+      bool ifFlag = (anInstruction >> 6) & 1u;
+      bool block = (anInstruction >> 5) & 1u;
+      if (isPull) {
+        if (ifFlag && myOsrCount < 32) {
+          break;
+        }
+        if (myTx.empty()) {
+          if (block) {
+            stalled = true;
+            myTxStall = true;
+          } else {
+            myOsr = myX;
+            myOsrCount = 0;
+          }
+        } else {
+          myOsr = myTx.front();
+          myTx.pop_front();
+          myOsrCount = 0;
+        }
+      } else {
+        if (ifFlag && myIsrCount < 32) {
+          break;
+        }
+        if (myRx.size() >= 4) {
+          stalled = block;
+        } else {
+          myRx.push_back(myIsr);
+          myIsr = 0;
+          myIsrCount = 0;
+        }
+      }
+    } break;
+
+    case 5: { // MOV
+      uint32_t op = (anInstruction >> 3) & 0x3u;
+      uint32_t source = anInstruction & 0x7u;
+      uint32_t value = 0;
+      switch (source) {
+      case 0:
+        value = ReadPins(myInBase);
+        break;
+      case 1:
+        value = myX;
+        break;
+      case 2:
+        value = myY;
+        break;
+      case 5:
+        value = myTx.empty() ? 0xFFFFFFFFu : 0; // default STATUS_SEL is TX
+        break;
+      case 6:
+        value = myIsr;
+        break;
+      case 7:
+        value = myOsr;
+        break;
+      default:
+        break;
+      }
+      if (op == 1) {
+        value = ~value;
+      } else if (op == 2) {
+        value = BitRev(value);
+      }
+      switch (arg1) {
+      case 0:
+        WritePins(myOutBase, myOutCount, value);
+        break;
+      case 1:
+        myX = value;
+        break;
+      case 2:
+        myY = value;
+        break;
+      case 5:
+        myPc = static_cast<uint8_t>(value);
+        jumped = true;
+        break;
+      case 6:
+        myIsr = value;
+        myIsrCount = 0;
+        break;
+      case 7:
+        myOsr = value;
+        myOsrCount = 0;
+        break;
+      default:
+        break;
+      }
+    } break;
+
+    case 6: // IRQ, not modelled
+      break;
+
+    case 7: { // SET
+      switch (arg1) {
+      case 0:
+        WritePins(mySetBase, mySetCount, arg2);
+        break;
+      case 1:
+        myX = arg2;
+        break;
+      case 2:
+        myY = arg2;
+        break;
+      default:
+        break;
+      }
+    } break;
+    }
+
+    if (stalled) {
+      return;
+    }
+
+    myDelay = delay;
+    if (!jumped && !anIsExec) {
+      Advance();
+    }
+  }
+
+  std::vector<uint16_t> myProgram;
+  uint8_t myWrapTarget;
+  uint8_t myWrap;
+  uint8_t myPc = 0;
+
+  uint32_t myX = 0;
+  uint32_t myY = 0;
+  uint32_t myOsr = 0;
+  uint32_t myOsrCount = 32;
+  uint32_t myIsr = 0;
+  uint32_t myIsrCount = 0;
+  uint32_t myDelay = 0;
+
+  uint32_t mySetBase = 0;
+  uint32_t mySetCount = 0;
+  uint32_t myOutBase = 0;
+  uint32_t myOutCount = 0;
+  uint32_t myInBase = 0;
+  uint32_t myJmpPin = 0;
+  uint32_t mySidesetBase = 0;
+  uint32_t mySidesetCount = 0;
+  bool mySidesetOptional = false;
+  bool myOutShiftRight = true;
+  bool myInShiftRight = true;
+
+  uint32_t myPins = 0;
+  uint32_t myInputs = 0;
+
+  std::deque<uint32_t> myTx;
+  std::deque<uint32_t> myRx;
+  size_t myTxCapacity = 4;
+  bool myTxStall = false;
+  bool myEnabled = false;
+  uint64_t myCycles = 0;
+};
+
+} // namespace PIOStepperSpeedController
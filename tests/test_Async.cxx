@@ -0,0 +1,188 @@
+#include <PIOStepperSpeedController/Async.hxx>
+#include <PIOStepperSpeedController/Stepper.hxx>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <new>
+#include <string>
+#include <vector>
+
+// Counts every allocation in the test executable, to show that stepping and
+// resuming coroutines never allocates
+static std::atomic<size_t> allocations{0};
+
+void *operator new(std::size_t aSize) {
+  allocations++;
+  if (void *memory = std::malloc(aSize != 0 ? aSize : 1)) {
+    return memory;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *aMemory) noexcept { std::free(aMemory); }
+void operator delete(void *aMemory, std::size_t) noexcept {
+  std::free(aMemory);
+}
+
+namespace PIOStepperSpeedController {
+
+class AsyncTestStepper : public Stepper<AsyncTestStepper> {
+public:
+  AsyncTestStepper() : Stepper(100, 20000, 100000, 100000) {}
+
+  bool PutStep(float) { return true; }
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() {}
+};
+
+// Public so the coroutines, which are not members, can reach the fixture
+class AsyncTest : public ::testing::Test {
+public:
+  AsyncTest() : async(stepper, executor) {}
+
+  // The main loop: one step, then whatever became ready
+  void RunUntilIdle(size_t aLimit = 100000) {
+    for (size_t i = 0; i < aLimit; i++) {
+      bool stepped = stepper.Update();
+      size_t resumed = executor.RunOnce();
+      if (!stepped && resumed == 0 && executor.IsIdle()) {
+        return;
+      }
+    }
+  }
+
+  AsyncTestStepper stepper;
+  Executor executor;
+  AsyncStepper<AsyncTestStepper> async;
+  std::vector<std::string> log;
+};
+
+TEST_F(AsyncTest, ReachSpeedStepsAndStop) {
+  auto sequence = [](AsyncTest &aTest) -> Task {
+    auto &async = aTest.async;
+    auto &stepper = aTest.stepper;
+
+    co_await async.ReachSpeed(5000);
+    EXPECT_EQ(stepper.GetState(), StepperState::COASTING);
+    EXPECT_FLOAT_EQ(stepper.GetCurrentFrequency(), 5000.0f);
+    aTest.log.push_back("at speed");
+
+    uint32_t start = stepper.GetStepCount();
+    co_await async.StepsElapsed(250);
+    EXPECT_EQ(stepper.GetStepCount() - start, 250u);
+    aTest.log.push_back("steps");
+
+    stepper.Stop();
+    co_await async.Stopped();
+    EXPECT_EQ(stepper.GetState(), StepperState::STOPPED);
+    aTest.log.push_back("stopped");
+  };
+
+  Task task = sequence(*this);
+  EXPECT_TRUE(log.empty()); // nothing runs until the executor does
+  task.Start(executor);
+  RunUntilIdle();
+
+  EXPECT_TRUE(task.IsDone());
+  EXPECT_EQ(log, (std::vector<std::string>{"at speed", "steps", "stopped"}));
+}
+
+TEST_F(AsyncTest, ReadyEventsDoNotSuspend) {
+  auto sequence = [](AsyncTest &aTest) -> Task {
+    co_await aTest.async.Stopped();
+    co_await aTest.async.StepsElapsed(0);
+    aTest.log.push_back("done");
+  };
+
+  Task task = sequence(*this);
+  task.Start(executor);
+  EXPECT_EQ(executor.RunOnce(), 1u);
+  EXPECT_TRUE(task.IsDone());
+  EXPECT_EQ(log.size(), 1u);
+}
+
+TEST_F(AsyncTest, SeveralWaitersResumeInOrder) {
+  auto waitSteps = [](AsyncTest &aTest, uint32_t aSteps) -> Task {
+    co_await aTest.async.StepsElapsed(aSteps);
+    aTest.log.push_back(std::to_string(aSteps));
+  };
+  auto waitStopped = [](AsyncTest &aTest) -> Task {
+    co_await aTest.async.StepsElapsed(1);
+    co_await aTest.async.Stopped();
+    aTest.log.push_back("stopped");
+  };
+
+  Task stopped = waitStopped(*this);
+  Task late = waitSteps(*this, 300);
+  Task early = waitSteps(*this, 100);
+  stopped.Start(executor);
+  late.Start(executor);
+  early.Start(executor);
+  executor.RunOnce();
+
+  stepper.SetTargetHz(2000);
+  stepper.Start();
+  for (int i = 0; i < 400; i++) {
+    stepper.Update();
+    executor.RunOnce();
+  }
+  stepper.Stop();
+  RunUntilIdle();
+
+  EXPECT_EQ(log, (std::vector<std::string>{"100", "300", "stopped"}));
+}
+
+TEST_F(AsyncTest, DestroyedWaiterIsForgotten) {
+  auto waitSteps = [](AsyncTest &aTest) -> Task {
+    co_await aTest.async.StepsElapsed(10);
+    aTest.log.push_back("never");
+  };
+
+  {
+    Task task = waitSteps(*this);
+    task.Start(executor);
+    executor.RunOnce();
+  }
+  stepper.Start();
+  for (int i = 0; i < 100; i++) {
+    stepper.Update();
+    executor.RunOnce();
+  }
+  EXPECT_TRUE(log.empty());
+  EXPECT_TRUE(executor.IsIdle());
+}
+
+TEST_F(AsyncTest, NoAllocationWhileStepping) {
+  auto sequence = [](AsyncTest &aTest) -> Task {
+    for (int i = 0; i < 3; i++) {
+      co_await aTest.async.ReachSpeed(8000);
+      co_await aTest.async.StepsElapsed(500);
+      co_await aTest.async.ReachSpeed(1000);
+      co_await aTest.async.StepsElapsed(100);
+    }
+    aTest.stepper.Stop();
+    co_await aTest.async.Stopped();
+  };
+
+  // The frame is the only allocation, when the coroutine is created
+  size_t before = allocations;
+  Task task = sequence(*this);
+  EXPECT_EQ(allocations - before, 1u);
+
+  before = allocations;
+  task.Start(executor);
+  size_t iterations = 0;
+  while (!task.IsDone() && iterations++ < 1000000) {
+    stepper.Update();
+    executor.RunOnce();
+  }
+  size_t during = allocations - before;
+
+  ASSERT_TRUE(task.IsDone());
+  EXPECT_GT(stepper.GetStepCount(), 1800u);
+  EXPECT_EQ(during, 0u);
+}
+
+} // namespace PIOStepperSpeedController
@@ -115,6 +115,71 @@ TEST(ConverterTest, AccelerateFrom100HzTo3333Hz) {
   EXPECT_NEAR(nextFreq, 3333, 0.1f);
 }
 
+TEST(ConverterTest, ReactionLatency) {
+  Converter conv(125000000, 1);
+  // 1kHz is a 1000us period, 4 queued plus the one being output
+  EXPECT_FLOAT_EQ(conv.ToReactionLatencyUs(1000, 4), 5000.0f);
+  EXPECT_FLOAT_EQ(conv.ToReactionLatencyUs(1000, 8), 9000.0f);
+  EXPECT_FLOAT_EQ(conv.ToReactionLatencyUs(1000, 1), 2000.0f);
+
+  // Uses the period that is actually output, not the requested frequency
+  EXPECT_FLOAT_EQ(conv.ToReactionLatencyUs(3, 0),
+                  conv.ToPeriod(3) * 1000000.0f / 125000000);
+
+  conv = Converter(125000000, 125);
+  EXPECT_FLOAT_EQ(conv.ToReactionLatencyUs(10, 4), 500000.0f);
+  EXPECT_THROW(conv.ToReactionLatencyUs(0, 4), std::invalid_argument);
+}
+
+TEST(ConverterTest, ToStepWord) {
+  Converter conv(125000000, 1);
+  // 1kHz is 125000 ticks, less the program's overhead, split between the
+  // high and low counts
+  EXPECT_EQ(conv.ToStepWord(1000), (62496u << 16) | 62496u);
+  EXPECT_EQ(Converter::ToStepPeriod(conv.ToStepWord(1000)), 125000u);
+  // An odd tick goes to the low count
+  EXPECT_EQ(Converter(13000000, 1).ToStepWord(1000000), (2u << 16) | 3u);
+
+  // Clamped to what the program can output
+  EXPECT_FLOAT_EQ(conv.GetMaxStepFrequency(), 125000000.0f / 8);
+  EXPECT_EQ(conv.ToStepWord(125000000), 0u);
+  EXPECT_EQ(conv.ToStepWord(1), 0xFFFFFFFFu);
+  EXPECT_EQ(Converter::ToStepPeriod(0xFFFFFFFFu), Converter::MAX_STEP_PERIOD);
+  EXPECT_FLOAT_EQ(conv.GetMinStepFrequency(),
+                  125000000.0f / Converter::MAX_STEP_PERIOD);
+  EXPECT_EQ(conv.ToStepWord(conv.GetMinStepFrequency()), 0xFFFFFFFFu);
+  EXPECT_THROW(conv.ToStepWord(0), std::invalid_argument);
+
+  // Every reachable period comes out exactly
+  for (uint32_t period = Converter::MIN_STEP_PERIOD;
+       period <= Converter::MAX_STEP_PERIOD; period += 7) {
+    float frequency = conv.ToFrequency(period);
+    EXPECT_EQ(Converter::ToStepPeriod(conv.ToStepWord(frequency)),
+              conv.ToPeriod(frequency))
+        << period;
+  }
+}
+
+TEST(ConverterTest, FixedPulseWord) {
+  Converter conv(125000000, 1);
+  // 8ns ticks, the pulse is the count plus 2 ticks and never shorter
+  EXPECT_EQ(conv.ToPulseCount(0), 0u);
+  EXPECT_EQ(conv.ToPulseCount(16), 0u);
+  EXPECT_EQ(conv.ToPulseCount(17), 1u);
+  EXPECT_EQ(conv.ToPulseCount(2500), 311u);
+  EXPECT_EQ(Converter(125000000, 125).ToPulseCount(2500), 1u);
+
+  // 1kHz is 125000 ticks, the rest after the pulse and overhead is low
+  EXPECT_EQ(conv.ToFixedPulseWord(1000, 311), 125000u - 311 - 5);
+  EXPECT_EQ(Converter::ToFixedPulsePeriod(conv.ToFixedPulseWord(1000, 311),
+                                          311),
+            125000u);
+  // No 16 bit limit, and clamped at the top
+  EXPECT_EQ(conv.ToFixedPulseWord(1, 0), 125000000u - 5);
+  EXPECT_EQ(conv.ToFixedPulseWord(1000000, 311), 0u);
+  EXPECT_FLOAT_EQ(conv.GetMaxFixedPulseFrequency(0), 25000000.0f);
+}
+
 TEST(ConverterTest, MaximumError) {
   GTEST_SKIP();
   Converter conv = Converter(125000000, 1);
@@ -0,0 +1,292 @@
+#include <cstdint> // the generated header expects this to be included first
+#include <PIOStepperSpeedController/Gearbox.hxx>
+#include <PIOStepperSpeedController/PIOStepperSpeedController.pio.h>
+#include <PIOStepperSpeedController/Stepper.hxx>
+#include <PioModel.hxx>
+#include <cmath>
+#include <gtest/gtest.h>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+static constexpr float TICK_HZ = 125000000;
+static constexpr uint32_t INPUT_PIN = 5;
+
+// Synthetic input pulse train, eg. a spindle encoder, with a changeable rate
+class PulseGenerator {
+public:
+  explicit PulseGenerator(double aFrequency)
+      : myFrequency(aFrequency), myNextEdge(1.0 / aFrequency) {}
+
+  void SetFrequency(double aFrequency) { myFrequency = aFrequency; }
+
+  // No edges until aTime, as a spindle that stops and starts again
+  void PauseUntil(double aTime) { myNextEdge = aTime; }
+
+  // Feeds the gearbox every rising edge up to aTime, as the PulseTimer would
+  void AdvanceTo(double aTime, Gearbox &aGearbox) {
+    while (myNextEdge <= aTime) {
+      double period = (myNextEdge - myLastEdge) * TICK_HZ;
+      aGearbox.OnInputPulse(static_cast<uint32_t>(std::lround(period)));
+      myLastEdge = myNextEdge;
+      myNextEdge += 1.0 / myFrequency;
+      pulses++;
+    }
+  }
+
+  uint64_t pulses = 0;
+
+private:
+  double myFrequency;
+  double myNextEdge;
+  double myLastEdge = 0;
+};
+
+// Wires the gearbox up the same way PIOStepper::PutStep() does, with the time
+// each step takes standing in for the hardware
+class GearedStepper : public Stepper<GearedStepper> {
+public:
+  GearedStepper(PulseGenerator &anInput, float aMinSpeed = 1)
+      : Stepper(aMinSpeed, 100000, 20000, 20000), gearbox(TICK_HZ),
+        input(anInput) {}
+
+  // As PIOStepper::Update(), with a pass of the main loop taking 1ms while
+  // stopped for a stalled input
+  bool Update() {
+    if (GetState() == StepperState::STOPPED && gearbox.IsStalled()) {
+      time += 0.001;
+      input.AdvanceTo(time, gearbox);
+      gearbox.Drive(*this);
+    }
+    return Stepper::Update();
+  }
+
+  bool PutStep(float aFrequency) {
+    time += 1.0 / aFrequency;
+    steps.push_back(aFrequency);
+    input.AdvanceTo(time, gearbox);
+    gearbox.OnOutputStep(aFrequency);
+    gearbox.Drive(*this);
+    return true;
+  }
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() {}
+
+  void Engage() {
+    gearbox.Engage();
+    Start();
+  }
+
+  void Disengage() {
+    gearbox.Disengage();
+    Stop();
+  }
+
+  Gearbox gearbox;
+  PulseGenerator &input;
+  double time = 0;
+  std::vector<float> steps;
+};
+
+TEST(GearboxTest, PulseTimerMeasuresInputPeriod) {
+  for (uint32_t period : {40u, 41u, 1000u, 12345u}) {
+    PioModel sm(PulseTimer_program_instructions,
+                sizeof(PulseTimer_program_instructions) / sizeof(uint16_t),
+                PulseTimer_wrap_target, PulseTimer_wrap);
+    sm.SetJmpPin(INPUT_PIN);
+    sm.SetInBase(INPUT_PIN);
+    sm.SetEnabled(true);
+
+    std::vector<uint32_t> measured;
+    for (uint64_t t = 0; t < 12 * period; t++) {
+      sm.SetInput(INPUT_PIN, (t % period) < period / 3);
+      sm.Clock();
+      if (auto word = sm.PopRx()) {
+        measured.push_back(Gearbox::PulseTimerToTicks(*word));
+      }
+    }
+
+    ASSERT_GE(measured.size(), 10u) << "period " << period;
+    // The first is from the sync, after that every period is measured to
+    // within the 2 cycle loop, with nothing lost between them
+    uint64_t total = 0;
+    for (size_t i = 1; i < measured.size(); i++) {
+      EXPECT_NEAR(measured[i], period, 1) << "period " << period;
+      total += measured[i];
+    }
+    EXPECT_NEAR(total, period * (measured.size() - 1), 1)
+        << "period " << period;
+  }
+}
+
+TEST(GearboxTest, RatioAndLock) {
+  Gearbox gearbox(TICK_HZ, 3, 2);
+  EXPECT_EQ(gearbox.GetState(), GearboxState::DISENGAGED);
+  EXPECT_EQ(gearbox.GetCommandedFrequency(), 0.0f);
+
+  gearbox.OnInputPulse(TICK_HZ / 2000);
+  EXPECT_FLOAT_EQ(gearbox.GetInputFrequency(), 2000.0f);
+  EXPECT_FLOAT_EQ(gearbox.GetRatioFrequency(), 3000.0f);
+
+  gearbox.Engage();
+  EXPECT_EQ(gearbox.GetState(), GearboxState::ENGAGING);
+  EXPECT_FLOAT_EQ(gearbox.GetCommandedFrequency(), 3000.0f);
+
+  gearbox.OnOutputStep(2500);
+  EXPECT_EQ(gearbox.GetState(), GearboxState::ENGAGING);
+  gearbox.OnInputPulse(TICK_HZ / 2000);
+  gearbox.OnOutputStep(2999);
+  EXPECT_EQ(gearbox.GetState(), GearboxState::LOCKED);
+  EXPECT_EQ(gearbox.GetPhaseError(), 0);
+
+  // Output behind the input speeds up, ahead slows down
+  gearbox.OnInputPulse(TICK_HZ / 2000);
+  EXPECT_EQ(gearbox.GetPhaseError(), 3);
+  EXPECT_GT(gearbox.GetCommandedFrequency(), 3000.0f);
+  gearbox.OnOutputStep(3000);
+  gearbox.OnOutputStep(3000);
+  gearbox.OnOutputStep(3000);
+  EXPECT_EQ(gearbox.GetPhaseError(), -3);
+  EXPECT_LT(gearbox.GetCommandedFrequency(), 3000.0f);
+
+  // Large errors are limited
+  for (int i = 0; i < 100; i++) {
+    gearbox.OnInputPulse(TICK_HZ / 2000);
+  }
+  EXPECT_FLOAT_EQ(gearbox.GetCommandedFrequency(),
+                  3000.0f * (1 + Gearbox::MAX_CORRECTION));
+
+  gearbox.Disengage();
+  EXPECT_EQ(gearbox.GetState(), GearboxState::DISENGAGED);
+  EXPECT_EQ(gearbox.GetPhaseError(), 0);
+}
+
+TEST(GearboxTest, InputStoppingDecaysFrequency) {
+  Gearbox gearbox(TICK_HZ);
+  gearbox.OnInputPulse(TICK_HZ / 1000);
+  gearbox.Engage();
+
+  // Less than a period without input is normal
+  gearbox.OnOutputStep(2000);
+  EXPECT_FLOAT_EQ(gearbox.GetInputFrequency(), 1000.0f);
+
+  // After that, the rate can't be higher than one pulse in the time waited
+  for (int i = 0; i < 9; i++) {
+    gearbox.OnOutputStep(2000);
+  }
+  EXPECT_NEAR(gearbox.GetInputFrequency(), 200.0f, 0.1f);
+}
+
+TEST(GearboxTest, EngageTrackAndDisengage) {
+  const float acceleration = 20000; // GearedStepper uses it for both
+  PulseGenerator input(2000);
+  GearedStepper stepper(input);
+  stepper.gearbox.SetRatio(3, 2);
+
+  // Let the gearbox see the input before engaging
+  input.AdvanceTo(0.01, stepper.gearbox);
+  stepper.time = 0.01;
+  stepper.Engage();
+
+  // Accelerates at the stepper's acceleration and locks at 3000Hz
+  size_t iterations = 0;
+  while (stepper.gearbox.GetState() != GearboxState::LOCKED &&
+         iterations++ < 100000) {
+    stepper.Update();
+  }
+  ASSERT_EQ(stepper.gearbox.GetState(), GearboxState::LOCKED);
+  for (size_t i = 1; i < stepper.steps.size(); i++) {
+    float step = stepper.steps[i] - stepper.steps[i - 1];
+    EXPECT_LE(step, acceleration / stepper.steps[i - 1] + 1.0f) << i;
+  }
+  EXPECT_NEAR(stepper.GetCurrentFrequency(), 3000.0f, 30.0f);
+
+  // Follows pulse for pulse, including through a change in input rate
+  uint64_t pulsesAtLock = input.pulses;
+  size_t stepsAtLock = stepper.steps.size();
+  float worstError = 0;
+  for (int i = 0; i < 60000; i++) {
+    if (i == 20000) {
+      input.SetFrequency(2100);
+    }
+    stepper.Update();
+    worstError =
+        std::max(worstError, std::abs(stepper.gearbox.GetPhaseErrorSteps()));
+  }
+  EXPECT_LT(worstError, 4.0f);
+  EXPECT_NEAR(stepper.GetCurrentFrequency(), 3150.0f, 10.0f);
+
+  int64_t outputSteps = stepper.steps.size() - stepsAtLock;
+  int64_t expectedSteps = (input.pulses - pulsesAtLock) * 3 / 2;
+  EXPECT_NEAR(outputSteps, expectedSteps, 4);
+
+  // Disengaging decelerates to a stop at the stepper's deceleration
+  stepper.Disengage();
+  size_t stepsAtDisengage = stepper.steps.size();
+  iterations = 0;
+  while (stepper.Update() && iterations++ < 100000) {
+  }
+  EXPECT_EQ(stepper.GetState(), StepperState::STOPPED);
+  for (size_t i = stepsAtDisengage + 1; i < stepper.steps.size(); i++) {
+    float step = stepper.steps[i - 1] - stepper.steps[i];
+    EXPECT_LE(step, acceleration / stepper.steps[i - 1] + 1.0f) << i;
+  }
+}
+
+TEST(GearboxTest, InputStallStopsThenReengages) {
+  PulseGenerator input(2000);
+  GearedStepper stepper(input, 500);
+  stepper.gearbox.SetRatio(3, 2);
+  input.AdvanceTo(0.01, stepper.gearbox);
+  stepper.time = 0.01;
+  stepper.Engage();
+  size_t iterations = 0;
+  while (stepper.gearbox.GetState() != GearboxState::LOCKED &&
+         iterations++ < 100000) {
+    stepper.Update();
+  }
+  ASSERT_EQ(stepper.gearbox.GetState(), GearboxState::LOCKED);
+
+  // The spindle stops for a second. The output comes down to a stop rather
+  // than carrying on at its minimum speed.
+  double resume = stepper.time + 1.0;
+  input.PauseUntil(resume);
+  iterations = 0;
+  while (stepper.GetState() != StepperState::STOPPED &&
+         iterations++ < 100000) {
+    stepper.Update();
+  }
+  EXPECT_EQ(stepper.GetState(), StepperState::STOPPED);
+  EXPECT_TRUE(stepper.gearbox.IsStalled());
+  EXPECT_EQ(stepper.gearbox.GetState(), GearboxState::ENGAGING);
+  EXPECT_EQ(stepper.gearbox.GetPhaseError(), 0);
+  size_t stepsWhileStalled = stepper.steps.size();
+  while (stepper.time < resume - 0.01) {
+    stepper.Update();
+  }
+  EXPECT_EQ(stepper.steps.size(), stepsWhileStalled);
+
+  // Once it is back, the output engages again and follows at full speed,
+  // with nothing to give back for the steps taken while stopping
+  iterations = 0;
+  while (stepper.gearbox.GetState() != GearboxState::LOCKED &&
+         iterations++ < 100000) {
+    stepper.Update();
+  }
+  ASSERT_EQ(stepper.gearbox.GetState(), GearboxState::LOCKED);
+  EXPECT_FALSE(stepper.gearbox.IsStalled());
+  uint64_t pulsesAtLock = input.pulses;
+  size_t stepsAtLock = stepper.steps.size();
+  float slowest = 1e9f;
+  for (int i = 0; i < 6000; i++) {
+    stepper.Update();
+    slowest = std::min(slowest, stepper.GetCurrentFrequency());
+  }
+  EXPECT_GT(slowest, 3000.0f * 0.9f); // not held back by MAX_CORRECTION
+  int64_t outputSteps = stepper.steps.size() - stepsAtLock;
+  int64_t expectedSteps = (input.pulses - pulsesAtLock) * 3 / 2;
+  EXPECT_NEAR(outputSteps, expectedSteps, 4);
+}
+
+} // namespace PIOStepperSpeedController
@@ -0,0 +1,113 @@
+#include <cstdint> // the generated header expects this to be included first
+#include <PIOStepperSpeedController/HealthMonitor.hxx>
+#include <PIOStepperSpeedController/PIOStepperSpeedController.pio.h>
+#include <PIOStepperSpeedController/Converter.hxx>
+#include <PioModel.hxx>
+#include <gtest/gtest.h>
+
+namespace PIOStepperSpeedController {
+
+TEST(HealthMonitorTest, UpdateCycles) {
+  HealthMonitor health;
+  HealthSnapshot snapshot = health.GetSnapshot();
+  EXPECT_EQ(snapshot.updates, 0u);
+  EXPECT_EQ(snapshot.minUpdateCycles, 0u);
+  EXPECT_EQ(snapshot.avgUpdateCycles, 0u);
+  EXPECT_EQ(snapshot.maxUpdateCycles, 0u);
+
+  health.OnUpdate(100);
+  health.OnUpdate(300);
+  health.OnUpdate(200);
+  snapshot = health.GetSnapshot();
+  EXPECT_EQ(snapshot.updates, 3u);
+  EXPECT_EQ(snapshot.minUpdateCycles, 100u);
+  EXPECT_EQ(snapshot.avgUpdateCycles, 200u);
+  EXPECT_EQ(snapshot.maxUpdateCycles, 300u);
+
+  health.Reset();
+  EXPECT_EQ(health.GetSnapshot().updates, 0u);
+  EXPECT_EQ(health.GetSnapshot().maxUpdateCycles, 0u);
+}
+
+TEST(HealthMonitorTest, PushesAfterStart) {
+  HealthMonitor health;
+  EXPECT_EQ(health.GetSnapshot().minFifoHeadroom, UINT32_MAX);
+
+  // The first push finds an idle, stalled state machine and is not judged
+  health.OnStart();
+  health.OnPush(1000, 0, true);
+  HealthSnapshot snapshot = health.GetSnapshot();
+  EXPECT_EQ(snapshot.txStalls, 0u);
+  EXPECT_EQ(snapshot.longestPushGapUs, 0u);
+  EXPECT_EQ(snapshot.minFifoHeadroom, UINT32_MAX);
+
+  health.OnPush(1010, 3, false);
+  health.OnPush(1050, 2, false);
+  health.OnPush(1060, 0, true);
+  snapshot = health.GetSnapshot();
+  EXPECT_EQ(snapshot.txStalls, 1u);
+  EXPECT_EQ(snapshot.longestPushGapUs, 40u);
+  EXPECT_EQ(snapshot.minFifoHeadroom, 0u);
+
+  // Across a stop and start is not a gap, and the time wraps
+  health.Reset();
+  health.OnStart();
+  health.OnPush(UINT32_MAX - 5, 0, true);
+  health.OnPush(4, 1, false);
+  snapshot = health.GetSnapshot();
+  EXPECT_EQ(snapshot.txStalls, 0u);
+  EXPECT_EQ(snapshot.longestPushGapUs, 10u);
+  EXPECT_EQ(snapshot.minFifoHeadroom, 1u);
+}
+
+// Feeds the state machine a step every aFeedCycles, as a main loop that takes
+// that long per Update() would, and reports what the monitor saw
+static HealthSnapshot FeedStateMachine(uint32_t aStepWord,
+                                       uint64_t aFeedCycles) {
+  PioModel sm(StepperSpeedController_program_instructions,
+              sizeof(StepperSpeedController_program_instructions) /
+                  sizeof(uint16_t),
+              StepperSpeedController_wrap_target,
+              StepperSpeedController_wrap);
+  sm.SetSetPins(0, 1);
+  sm.SetEnabled(true);
+  sm.Run(100); // stalls waiting for the first step
+
+  HealthMonitor health;
+  health.OnStart();
+  uint64_t nextFeed = 0;
+  for (int steps = 0; steps < 200;) {
+    if (sm.GetCycles() >= nextFeed && sm.GetTxLevel() < sm.GetTxCapacity()) {
+      bool stalled = sm.GetTxStall();
+      sm.ClearTxStall();
+      uint32_t queued = sm.GetTxLevel();
+      sm.Push(aStepWord);
+      health.OnPush(static_cast<uint32_t>(sm.GetCycles() / 125), queued,
+                    stalled);
+      nextFeed = sm.GetCycles() + aFeedCycles;
+      steps++;
+    }
+    sm.Clock();
+  }
+  return health.GetSnapshot();
+}
+
+TEST(HealthMonitorTest, DetectsLateSteps) {
+  // 50kHz at 125MHz is 2500 cycles per step
+  uint32_t word = Converter(125000000, 1).ToStepWord(50000);
+
+  // A loop faster than the steps keeps the FIFO topped up, the headroom is
+  // lowest while it fills
+  HealthSnapshot snapshot = FeedStateMachine(word, 1000);
+  EXPECT_EQ(snapshot.txStalls, 0u);
+  EXPECT_EQ(snapshot.minFifoHeadroom, 1u);
+  EXPECT_LE(snapshot.longestPushGapUs, 21u);
+
+  // A loop slower than the steps runs it dry
+  snapshot = FeedStateMachine(word, 4000);
+  EXPECT_GT(snapshot.txStalls, 100u);
+  EXPECT_EQ(snapshot.minFifoHeadroom, 0u);
+  EXPECT_GE(snapshot.longestPushGapUs, 32u);
+}
+
+} // namespace PIOStepperSpeedController
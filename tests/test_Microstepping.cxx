@@ -0,0 +1,215 @@
+#include <PIOStepperSpeedController/Microstepping.hxx>
+#include <PIOStepperSpeedController/Stepper.hxx>
+#include <cmath>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+// A 1/16 driver that goes down to 1/4, 1/2 and full steps at speed. The MS
+// pin codes are the A4988's.
+static MicrostepSelector MakeSelector() {
+  return MicrostepSelector(16, {{1, 0b111, 20000},
+                                {4, 0b010, 60000},
+                                {8, 0b001, 120000},
+                                {16, 0b000, 0}});
+}
+
+// Stands in for PIOStepper: selects the level for each step before putting
+// it, and records what would be output
+class MicrostepTestStepper : public Stepper<MicrostepTestStepper> {
+public:
+  struct Output {
+    float frequency; // user steps/s
+    uint32_t scale;
+    uint32_t pins;
+    uint32_t position; // user steps before this one
+  };
+
+  // Faster than the 50kHz the PIO could be asked for at 1/16
+  MicrostepTestStepper(uint32_t anAcceleration = 200000)
+      : Stepper(100, 400000, anAcceleration, anAcceleration),
+        selector(MakeSelector()) {}
+
+  bool PutStep(float aFrequency) {
+    if (selector.Select(aFrequency, GetStepCount())) {
+      SetStepScale(selector.GetScale());
+    }
+    outputs.push_back(Output{aFrequency, GetStepScale(),
+                             selector.GetLevel().pins, GetStepCount()});
+    return true;
+  }
+  void EnableImpl() {
+    selector.Reset();
+    SetStepScale(selector.GetScale());
+  }
+  void DisableImpl() {}
+  void AbortImpl() {}
+
+  // Steps until the stepper coasts or stops
+  void Run() {
+    for (int i = 0; i < 1000000; i++) {
+      Update();
+      StepperState state = GetState();
+      if (state == StepperState::COASTING || state == StepperState::STOPPED) {
+        return;
+      }
+    }
+  }
+
+  MicrostepSelector selector;
+  std::vector<Output> outputs;
+};
+
+TEST(MicrostepSelectorTest, SwitchesAtFullSteps) {
+  MicrostepSelector selector = MakeSelector();
+  EXPECT_EQ(selector.GetScale(), 1u);
+  EXPECT_EQ(selector.GetMaxScale(), 16u);
+
+  // Not between full steps
+  EXPECT_FALSE(selector.Select(30000, 17));
+  EXPECT_EQ(selector.GetScale(), 1u);
+  EXPECT_TRUE(selector.Select(30000, 32));
+  EXPECT_EQ(selector.GetScale(), 4u);
+  EXPECT_EQ(selector.GetLevel().pins, 0b010u);
+
+  // Several levels at once
+  EXPECT_TRUE(selector.Select(200000, 48));
+  EXPECT_EQ(selector.GetScale(), 16u);
+
+  // Back down only below the threshold less the hysteresis
+  EXPECT_FALSE(selector.Select(115000, 64));
+  EXPECT_EQ(selector.GetScale(), 16u);
+  EXPECT_TRUE(selector.Select(100000, 64));
+  EXPECT_EQ(selector.GetScale(), 8u);
+  EXPECT_TRUE(selector.Select(1000, 80));
+  EXPECT_EQ(selector.GetScale(), 1u);
+
+  selector.Select(200000, 0);
+  selector.Reset();
+  EXPECT_EQ(selector.GetLevelIndex(), 0u);
+}
+
+TEST(MicrostepSelectorTest, RejectsBadLevels) {
+  EXPECT_THROW(MicrostepSelector(16, {}), std::invalid_argument);
+  EXPECT_THROW(MicrostepSelector(16, {{2, 0, 1000}}), std::invalid_argument);
+  EXPECT_THROW(MicrostepSelector(16, {{1, 0, 1000}, {3, 0, 0}}),
+               std::invalid_argument);
+  EXPECT_THROW(MicrostepSelector(8, {{1, 0, 1000}, {16, 0, 0}}),
+               std::invalid_argument);
+  EXPECT_THROW(MicrostepSelector(16, {{1, 0, 1000}, {4, 0, 500}, {8, 0, 0}}),
+               std::invalid_argument);
+  EXPECT_NO_THROW(MicrostepSelector(16, {{1, 0, 1000}, {2, 0, 0}}));
+  EXPECT_THROW(MicrostepSelector(512, {{1, 0, 1000}, {512, 0, 0}}),
+               std::invalid_argument);
+}
+
+TEST(MicrostepTest, RampUpAndDown) {
+  MicrostepTestStepper stepper;
+  stepper.SetTargetHz(300000);
+  stepper.Start();
+  stepper.Run();
+
+  // The stepper reports and coasts in user steps, the driver gets 1/16 of
+  // them at full steps
+  EXPECT_NEAR(stepper.GetCurrentFrequency(), 300000.0f, 1.0f);
+  EXPECT_EQ(stepper.GetStepScale(), 16u);
+  float coastOutput = stepper.outputs.back().frequency /
+                      stepper.outputs.back().scale;
+  EXPECT_NEAR(coastOutput, 300000.0f / 16, 1.0f);
+
+  stepper.Stop();
+  stepper.Run();
+  ASSERT_EQ(stepper.GetState(), StepperState::STOPPED);
+  EXPECT_EQ(stepper.outputs.back().scale, 1u);
+
+  const auto &outputs = stepper.outputs;
+  std::vector<uint32_t> scales{1};
+  uint32_t position = 0;
+  for (size_t i = 0; i < outputs.size(); i++) {
+    const auto &output = outputs[i];
+    // Each output moves by its scale, none is lost or added
+    EXPECT_EQ(output.position, position);
+    position += output.scale;
+
+    if (i > 0 && output.scale != outputs[i - 1].scale) {
+      scales.push_back(output.scale);
+      // Only on full steps, and where the thresholds say
+      EXPECT_EQ(output.position % 16, 0u);
+      bool up = output.scale > outputs[i - 1].scale;
+      if (up) {
+        EXPECT_GT(output.frequency, 20000.0f);
+      }
+      // The speed carries on across the switch, only the output rate is
+      // rescaled
+      float before = outputs[i - 1].frequency;
+      EXPECT_NEAR(output.frequency, before, before * 0.02f);
+    }
+    // Never asks for more than the finest rate's worth of output at 1/16
+    EXPECT_LE(output.frequency / output.scale, 60000.0f);
+  }
+  EXPECT_EQ(position, stepper.GetStepCount());
+  EXPECT_EQ(scales, (std::vector<uint32_t>{1, 4, 8, 16, 8, 4, 1}));
+}
+
+TEST(MicrostepTest, FullStepsOfA256Driver) {
+  MicrostepTestStepper stepper;
+  stepper.selector = MicrostepSelector(256, {{1, 0, 20000}, {256, 1, 0}});
+  stepper.SetTargetHz(300000);
+  stepper.Start();
+  stepper.Run();
+
+  // The ramp gets past the switch and every step counts 256
+  EXPECT_EQ(stepper.GetStepScale(), 256u);
+  EXPECT_NEAR(stepper.GetCurrentFrequency(), 300000.0f, 1.0f);
+  uint32_t position = 0;
+  for (const auto &output : stepper.outputs) {
+    position += output.scale;
+  }
+  EXPECT_EQ(position, stepper.GetStepCount());
+  EXPECT_EQ(stepper.outputs.back().scale, 256u);
+}
+
+TEST(MicrostepTest, LargeScaledRatesDoNotWrap) {
+  // 12MHz/s at a scale of 256 is past INT32_MAX Hz/s per step
+  MicrostepTestStepper stepper(12000000);
+  stepper.selector = MicrostepSelector(256, {{1, 0, 20000}, {256, 1, 0}});
+  stepper.SetTargetHz(300000);
+  stepper.Start();
+  stepper.Run();
+
+  EXPECT_EQ(stepper.GetStepScale(), 256u);
+  EXPECT_EQ(stepper.GetState(), StepperState::COASTING);
+  EXPECT_NEAR(stepper.GetCurrentFrequency(), 300000.0f, 1.0f);
+  for (size_t i = 1; i < stepper.outputs.size(); i++) {
+    EXPECT_GE(stepper.outputs[i].frequency, stepper.outputs[i - 1].frequency)
+        << i;
+  }
+}
+
+TEST(MicrostepTest, RampTimeIsUnchanged) {
+  // Coarse steps advance the ramp by their scale, so reaching a speed takes
+  // as long as stepping every microstep would
+  auto rampSeconds = [](bool aMicrostepping) {
+    MicrostepTestStepper stepper;
+    if (!aMicrostepping) {
+      stepper.selector = MicrostepSelector();
+    }
+    stepper.SetTargetHz(50000);
+    stepper.Start();
+    stepper.Run();
+    double seconds = 0;
+    for (const auto &output : stepper.outputs) {
+      seconds += output.scale / static_cast<double>(output.frequency);
+    }
+    return seconds;
+  };
+  double fine = rampSeconds(false);
+  double switched = rampSeconds(true);
+  EXPECT_NEAR(switched, fine, fine * 0.01);
+  EXPECT_NEAR(fine, 50000.0 / 200000, 0.25 * 0.05);
+}
+
+} // namespace PIOStepperSpeedController
@@ -0,0 +1,153 @@
+#include <PIOStepperSpeedController/MultiAxisPlanner.hxx>
+#include <PIOStepperSpeedController/Stepper.hxx>
+#include <array>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+// Keeps the word PIOStepper would push for each step
+class WordStepper : public Stepper<WordStepper> {
+public:
+  using Stepper::Stepper;
+
+  bool PutStep(float aFrequency) {
+    words.push_back(GetConverter().ToStepWord(aFrequency));
+    return true;
+  }
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() {}
+
+  std::vector<uint32_t> words;
+};
+
+struct AxisProfile {
+  float minSpeed;
+  float maxSpeed;
+  uint32_t acceleration;
+  uint32_t deceleration;
+};
+
+static constexpr size_t AXES = 6;
+// Slow enough for every minimum speed to fit in one step word
+static constexpr uint32_t PRESCALER = 125;
+
+static const AxisProfile PROFILES[AXES] = {
+    {10, 50000, 100000, 100000}, {8, 20000, 5000, 10000},
+    {100, 100000, 400000, 200000}, {8, 2000, 1000, 1000},
+    {50, 80000, 50000, 250000}, {20, 30000, 20000, 20000}};
+
+class MultiAxisPlannerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    for (size_t i = 0; i < AXES; i++) {
+      const AxisProfile &p = PROFILES[i];
+      planner.Configure(i, p.minSpeed, p.maxSpeed, p.acceleration,
+                        p.deceleration);
+      steppers.push_back(std::make_unique<WordStepper>(
+          p.minSpeed, p.maxSpeed, p.acceleration, p.deceleration, 125000000,
+          PRESCALER));
+    }
+  }
+
+  // Runs both for aUpdates updates, checking every word and state
+  void Run(uint32_t aUpdates) {
+    for (uint32_t n = 0; n < aUpdates; n++) {
+      std::array<uint32_t, AXES> words;
+      uint32_t stepped = planner.Update(words);
+      for (size_t i = 0; i < AXES; i++) {
+        WordStepper &stepper = *steppers[i];
+        size_t before = stepper.words.size();
+        stepper.Update();
+        bool didStep = stepper.words.size() > before;
+        ASSERT_EQ((stepped >> i) & 1u, didStep ? 1u : 0u)
+            << "axis " << i << " update " << updates;
+        if (didStep) {
+          ASSERT_EQ(words[i], stepper.words.back())
+              << "axis " << i << " update " << updates;
+        }
+        ASSERT_EQ(planner.GetState(i), stepper.GetState())
+            << "axis " << i << " update " << updates;
+        ASSERT_EQ(planner.GetCurrentFrequency(i),
+                  stepper.GetCurrentFrequency())
+            << "axis " << i << " update " << updates;
+      }
+      updates++;
+    }
+  }
+
+  MultiAxisPlanner<AXES> planner{125000000, PRESCALER};
+  std::vector<std::unique_ptr<WordStepper>> steppers;
+  uint32_t updates = 0;
+};
+
+TEST_F(MultiAxisPlannerTest, MatchesSingleAxisSteppers) {
+  const float targets[AXES] = {40000, 15000, 100000, 1500, 60000, 25000};
+  for (size_t i = 0; i < AXES; i++) {
+    planner.SetTargetFrequency(i, targets[i]);
+    steppers[i]->SetTargetFrequency(targets[i]);
+    planner.Start(i);
+    steppers[i]->Start();
+  }
+  Run(3000);
+
+  // Change speeds mid ramp, both ways
+  for (size_t i = 0; i < AXES; i++) {
+    planner.SetTargetFrequency(i, targets[i] / 3);
+    steppers[i]->SetTargetFrequency(targets[i] / 3);
+  }
+  Run(2000);
+  planner.SetTargetFrequency(1, 20000);
+  steppers[1]->SetTargetFrequency(20000);
+  Run(1000);
+
+  // Every way to stop, and a restart while stopping
+  planner.Stop(0);
+  steppers[0]->Stop();
+  planner.SetFastStopDeceleration(2, 1000000);
+  steppers[2]->SetFastStopDeceleration(1000000);
+  planner.FastStop(2);
+  steppers[2]->FastStop();
+  planner.EmergencyStop(3);
+  steppers[3]->EmergencyStop();
+  planner.Stop(4);
+  steppers[4]->Stop();
+  Run(200);
+  planner.Start(4);
+  steppers[4]->Start();
+  Run(5000);
+
+  EXPECT_EQ(planner.GetState(0), StepperState::STOPPED);
+  EXPECT_EQ(planner.GetState(2), StepperState::STOPPED);
+  EXPECT_EQ(planner.GetState(4), StepperState::COASTING);
+  for (const auto &stepper : steppers) {
+    EXPECT_GT(stepper->words.size(), 1000u);
+  }
+}
+
+TEST_F(MultiAxisPlannerTest, StoppedAxesDoNotStep) {
+  std::array<uint32_t, AXES> words;
+  EXPECT_EQ(planner.Update(words), 0u);
+
+  planner.Start(2);
+  steppers[2]->Start();
+  Run(10);
+  std::array<uint32_t, AXES> more;
+  EXPECT_EQ(planner.Update(more), 1u << 2);
+
+  EXPECT_THROW(planner.Start(AXES), std::invalid_argument);
+}
+
+TEST(MultiAxisPlannerLimitsTest, MinimumIsTheSlowestStepWord) {
+  MultiAxisPlanner<1> planner;
+  planner.Configure(0, 10, 20000, 5000, 5000);
+  planner.Start(0);
+  EXPECT_FLOAT_EQ(planner.GetCurrentFrequency(0),
+                  Converter().GetMinStepFrequency());
+}
+
+} // namespace PIOStepperSpeedController
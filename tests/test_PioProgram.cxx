@@ -0,0 +1,427 @@
+#include <cstdint> // the generated header expects this to be included first
+#include <PIOStepperSpeedController/PIOStepperSpeedController.pio.h>
+#include <PIOStepperSpeedController/Converter.hxx>
+#include <PioModel.hxx>
+#include <gtest/gtest.h>
+#include <utility>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+// pio_encode_set(pio_pins, 0) and pio_encode_jmp(0)
+static constexpr uint16_t SET_PINS_0 = 0xe000;
+static constexpr uint16_t JMP_0 = 0x0000;
+// pio_encode_pull(false, true) and pio_encode_mov(pio_y, pio_osr)
+static constexpr uint16_t PULL_BLOCK = 0x80a0;
+static constexpr uint16_t MOV_Y_OSR = 0xa047;
+
+// PIOStepper::DEFAULT_PULSE_WIDTH_NS, the class needs the pico SDK
+static constexpr uint32_t DEFAULT_PULSE_WIDTH_NS = 2500;
+
+static constexpr uint32_t STEP_PIN = 0;
+
+class PioProgramTest : public ::testing::Test {
+protected:
+  PioProgramTest() : sm(MakeModel()) {}
+
+  static PioModel MakeModel() {
+    PioModel model(StepperSpeedController_program_instructions,
+                   sizeof(StepperSpeedController_program_instructions) /
+                       sizeof(uint16_t),
+                   StepperSpeedController_wrap_target,
+                   StepperSpeedController_wrap);
+    model.SetSetPins(STEP_PIN, 1);
+    model.SetEnabled(true);
+    return model;
+  }
+
+  // The same sequence as PIOStepper::AbortImpl()
+  void Abort() {
+    sm.SetEnabled(false);
+    sm.ClearFifos();
+    sm.Restart();
+    sm.Exec(SET_PINS_0);
+    sm.Exec(JMP_0);
+  }
+
+  static uint32_t Pack(uint16_t aHalf) { return (aHalf << 16) | aHalf; }
+
+  // Cycles until the pin has been low for longer than aQuietCycles, ie. the
+  // motor has really stopped stepping
+  uint64_t CyclesUntilIdle(uint64_t aQuietCycles, uint64_t aLimit) {
+    uint64_t start = sm.GetCycles();
+    uint64_t lastHigh = start;
+    while (sm.GetCycles() - lastHigh <= aQuietCycles &&
+           sm.GetCycles() - start < aLimit) {
+      sm.Clock();
+      if (sm.GetPin(STEP_PIN)) {
+        lastHigh = sm.GetCycles();
+      }
+    }
+    return lastHigh - start;
+  }
+
+  // Cycles until the aCount'th rising edge of the step pin
+  uint64_t CyclesUntilRisingEdge(uint32_t aCount, uint64_t aLimit) {
+    uint64_t start = sm.GetCycles();
+    bool last = sm.GetPin(STEP_PIN);
+    while (aCount > 0 && sm.GetCycles() - start < aLimit) {
+      sm.Clock();
+      bool pin = sm.GetPin(STEP_PIN);
+      if (pin && !last) {
+        aCount--;
+      }
+      last = pin;
+    }
+    return sm.GetCycles() - start;
+  }
+
+  struct StepTiming {
+    uint64_t period;
+    uint64_t high;
+  };
+
+  // Plays aWord back to back with the FIFO kept full and measures the steady
+  // state period and high time of the step pin, in cycles. Every step must
+  // be the same length.
+  StepTiming MeasureStep(uint32_t aWord) {
+    sm = MakeModel();
+    std::vector<uint64_t> rises;
+    std::vector<uint64_t> falls;
+    bool last = false;
+    while (rises.size() < 6) {
+      while (sm.Push(aWord)) {
+      }
+      sm.Clock();
+      bool pin = sm.GetPin(STEP_PIN);
+      if (pin && !last) {
+        rises.push_back(sm.GetCycles());
+      } else if (!pin && last) {
+        falls.push_back(sm.GetCycles());
+      }
+      last = pin;
+    }
+    for (size_t i = 2; i < rises.size(); i++) {
+      EXPECT_EQ(rises[i] - rises[i - 1], rises[1] - rises[0]) << aWord;
+    }
+    return {rises[1] - rises[0], falls[0] - rises[0]};
+  }
+
+  PioModel sm;
+};
+
+TEST_F(PioProgramTest, CyclesPerStep) {
+  // high count, low count
+  const uint32_t counts[][2] = {{0, 0},   {0, 1},     {1, 0},
+                                {5, 9},   {500, 500}, {0xFFFF, 0},
+                                {0, 0xFFFF}, {0xFFFF, 0xFFFF}};
+  for (const auto &count : counts) {
+    uint32_t word = (count[0] << 16) | count[1];
+    StepTiming timing = MeasureStep(word);
+    EXPECT_EQ(timing.period, count[0] + count[1] + 8) << std::hex << word;
+    EXPECT_EQ(timing.period, Converter::ToStepPeriod(word)) << std::hex << word;
+    // set pins, 1 then the high loop, which runs count + 1 times
+    EXPECT_EQ(timing.high, count[0] + 2) << std::hex << word;
+  }
+}
+
+TEST_F(PioProgramTest, CompensatedStepsHitTheRequestedPeriod) {
+  const Converter conv(125000000, 1);
+  for (float frequency : {953.7f, 1000.0f, 33333.0f, 125000.0f, 1000000.0f,
+                          conv.GetMaxStepFrequency()}) {
+    StepTiming timing = MeasureStep(conv.ToStepWord(frequency));
+    EXPECT_EQ(timing.period, conv.ToPeriod(frequency)) << frequency;
+  }
+
+  // The slowest and fastest a word can go
+  EXPECT_EQ(MeasureStep(conv.ToStepWord(1)).period, Converter::MAX_STEP_PERIOD);
+  EXPECT_EQ(MeasureStep(conv.ToStepWord(125000000)).period,
+            Converter::MIN_STEP_PERIOD);
+}
+
+TEST_F(PioProgramTest, QueuedStepsPlayOutAfterControlledStop) {
+  const uint16_t half = 1000;
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(sm.Push(Pack(half)));
+  }
+  sm.Run(10);
+  ASSERT_TRUE(sm.GetPin(STEP_PIN));
+
+  // Stop() only stops feeding the FIFO, everything already queued is played
+  uint64_t latency = CyclesUntilIdle(4 * half, 100000);
+  EXPECT_GT(latency, 3u * 2 * half);
+  EXPECT_EQ(sm.GetTxLevel(), 0u);
+}
+
+TEST_F(PioProgramTest, EmergencyStopLatency) {
+  const uint16_t half = 1000;
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(sm.Push(Pack(half)));
+  }
+  sm.Run(10);
+  ASSERT_TRUE(sm.GetPin(STEP_PIN));
+  ASSERT_TRUE(sm.Push(Pack(half)));
+
+  Abort();
+
+  // Low straight away, nothing queued, and no further edges ever
+  EXPECT_FALSE(sm.GetPin(STEP_PIN));
+  EXPECT_EQ(sm.GetTxLevel(), 0u);
+  EXPECT_EQ(CyclesUntilIdle(10 * half, 100000), 0u);
+}
+
+TEST_F(PioProgramTest, EmergencyStopWorstCaseIsIndependentOfPeriod) {
+  // Abort at every point of a step, including mid pull, mid high and mid low
+  const uint16_t half = 7;
+  for (uint32_t abortAt = 0; abortAt < 2 * half + 10; abortAt++) {
+    sm = MakeModel();
+    sm.Push(Pack(half));
+    sm.Push(Pack(0xFFFF));
+    sm.Run(abortAt);
+
+    Abort();
+    EXPECT_FALSE(sm.GetPin(STEP_PIN)) << "Abort at cycle " << abortAt;
+    EXPECT_EQ(CyclesUntilIdle(100, 1000), 0u) << "Abort at cycle " << abortAt;
+  }
+}
+
+TEST_F(PioProgramTest, RestartAfterEmergencyStop) {
+  sm.Push(Pack(0xFFFF));
+  sm.Run(100);
+  ASSERT_TRUE(sm.GetPin(STEP_PIN));
+  Abort();
+
+  // EnableImpl() resumes from the pull with the first new word
+  sm.SetEnabled(true);
+  sm.Run(10);
+  EXPECT_FALSE(sm.GetPin(STEP_PIN));
+  EXPECT_EQ(sm.GetPc(), 0u);
+
+  sm.Push(Pack(10));
+  sm.Run(4);
+  EXPECT_TRUE(sm.GetPin(STEP_PIN));
+}
+
+TEST_F(PioProgramTest, JoinedFifoHoldsEightSteps) {
+  sm.SetEnabled(false);
+  sm.JoinTxFifo(true);
+  for (int i = 0; i < 8; i++) {
+    EXPECT_TRUE(sm.Push(Pack(100)));
+  }
+  EXPECT_FALSE(sm.Push(Pack(100)));
+
+  sm.JoinTxFifo(false);
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(sm.Push(Pack(100)));
+  }
+  EXPECT_FALSE(sm.Push(Pack(100)));
+}
+
+TEST_F(PioProgramTest, ReactionLatencyMatchesQueueDepth) {
+  // 125kHz is 1000 ticks at 125MHz, 500 per half
+  const Converter conv(125000000, 1);
+  const float frequency = 125000;
+  const uint16_t half = conv.ToPeriod(frequency) >> 1;
+  // The fixed instructions around the two delay loops, per step
+  const uint64_t overhead = Converter::STEP_OVERHEAD_TICKS;
+
+  for (uint32_t depth : {1u, 4u, 8u}) {
+    sm = MakeModel();
+    sm.SetEnabled(false);
+    sm.JoinTxFifo(depth > 4);
+    sm.SetEnabled(true);
+
+    // Steady state: one step being output and a full queue behind it
+    sm.Push(Pack(half));
+    sm.Run(4);
+    for (uint32_t i = 0; i < depth - 1; i++) {
+      ASSERT_TRUE(sm.Push(Pack(half)));
+    }
+    ASSERT_TRUE(sm.Push(Pack(10))); // the new frequency
+
+    uint64_t cycles = CyclesUntilRisingEdge(depth, 100000);
+    float predictedCycles = conv.ToReactionLatencyUs(frequency, depth) * 125;
+
+    EXPECT_LE(cycles, predictedCycles + overhead * (depth + 1))
+        << "depth " << depth;
+    EXPECT_GE(cycles, predictedCycles - 2 * half - overhead)
+        << "depth " << depth;
+  }
+}
+
+// PIOStepper's microstep switch: a queue of steps at the old resolution,
+// then the first step at the new one, held until the switch is ready and
+// pushed on the same cycle, as a main loop polling GetQueuedSteps() would
+struct SwitchPoint {
+  uint32_t edgesBeforeSwitch; // rising edges when the pins change
+  uint64_t switchCycle;
+  uint64_t lastOldEdge;
+  uint64_t newEdge;
+};
+
+static SwitchPoint RunMicrostepSwitch(PioModel &aModel,
+                                      const std::vector<uint32_t> &anOld,
+                                      uint32_t aNew, uint32_t aRisenPc) {
+  for (uint32_t word : anOld) {
+    EXPECT_TRUE(aModel.Push(word));
+  }
+  SwitchPoint point{0, 0, 0, 0};
+  bool isSwitched = false;
+  uint32_t edges = 0;
+  bool last = aModel.GetPin(STEP_PIN);
+  for (uint64_t i = 0; i < 10000000 && edges <= anOld.size(); i++) {
+    aModel.Clock();
+    bool pin = aModel.GetPin(STEP_PIN);
+    if (pin && !last) {
+      edges++;
+      if (edges == anOld.size()) {
+        point.lastOldEdge = aModel.GetCycles();
+      } else if (edges > anOld.size()) {
+        point.newEdge = aModel.GetCycles();
+      }
+    }
+    last = pin;
+    if (!isSwitched && aModel.GetTxLevel() == 0 &&
+        Converter::IsLastStepRisen(aModel.GetPc(), aRisenPc)) {
+      isSwitched = true;
+      point.edgesBeforeSwitch = edges;
+      point.switchCycle = aModel.GetCycles();
+      EXPECT_TRUE(aModel.Push(aNew));
+    }
+  }
+  return point;
+}
+
+TEST_F(PioProgramTest, MicrostepSwitchFollowsTheLastRisingEdge) {
+  const Converter conv(125000000, 1);
+  // Down to the shortest step, which leaves the least time to switch
+  for (uint32_t last : {conv.ToStepWord(1000), Pack(10), Pack(0)}) {
+    sm = MakeModel();
+    SwitchPoint point = RunMicrostepSwitch(
+        sm, {Pack(20), Pack(5), last}, conv.ToStepWord(5000),
+        StepperSpeedController_offset_delay_high);
+
+    // The driver has latched every old step before the pins change, and
+    // the new step follows the old ones without a gap
+    EXPECT_EQ(point.edgesBeforeSwitch, 3u) << last;
+    EXPECT_GT(point.newEdge, point.switchCycle) << last;
+    EXPECT_EQ(point.newEdge - point.lastOldEdge,
+              Converter::ToStepPeriod(last))
+        << last;
+  }
+}
+
+// The same set up as PIOStepper::InitStateMachine() for FIXED_PULSE
+static PioModel MakeFixedPulseModel(uint32_t aPulseCount) {
+  PioModel model(StepperFixedPulse_program_instructions,
+                 sizeof(StepperFixedPulse_program_instructions) /
+                     sizeof(uint16_t),
+                 StepperFixedPulse_wrap_target, StepperFixedPulse_wrap);
+  model.SetSetPins(STEP_PIN, 1);
+  model.SetSideset(STEP_PIN, 1, false);
+  model.Push(aPulseCount);
+  model.Exec(PULL_BLOCK);
+  model.Exec(MOV_Y_OSR);
+  model.SetEnabled(true);
+  return model;
+}
+
+// Period and high time of the step pin in steady state, in cycles
+static std::pair<uint64_t, uint64_t> MeasureFixedPulse(PioModel &aModel,
+                                                       uint32_t aWord) {
+  std::vector<uint64_t> rises;
+  uint64_t fall = 0;
+  bool last = false;
+  while (rises.size() < 4) {
+    while (aModel.Push(aWord)) {
+    }
+    aModel.Clock();
+    bool pin = aModel.GetPin(STEP_PIN);
+    if (pin && !last) {
+      rises.push_back(aModel.GetCycles());
+    } else if (!pin && last && rises.size() == 2) {
+      fall = aModel.GetCycles();
+    }
+    last = pin;
+  }
+  EXPECT_EQ(rises[3] - rises[2], rises[2] - rises[1]);
+  return {rises[2] - rises[1], fall - rises[1]};
+}
+
+TEST(PioFixedPulseTest, CyclesPerStep) {
+  for (uint32_t pulse : {0u, 1u, 311u}) {
+    for (uint32_t low : {0u, 1u, 1000u, 0x10000u, 0x123456u}) {
+      PioModel sm = MakeFixedPulseModel(pulse);
+      auto [period, high] = MeasureFixedPulse(sm, low);
+      EXPECT_EQ(period, pulse + low + 5) << pulse << " " << low;
+      EXPECT_EQ(period, Converter::ToFixedPulsePeriod(low, pulse))
+          << pulse << " " << low;
+      // mov x, y starts the pulse and the loop runs count + 1 times
+      EXPECT_EQ(high, pulse + 2) << pulse << " " << low;
+    }
+  }
+}
+
+TEST(PioFixedPulseTest, FasterThanSymmetric) {
+  const Converter conv(125000000, 1);
+  // The narrowest pulse reaches 25MHz, against 15.6MHz for the symmetric
+  // program
+  PioModel sm = MakeFixedPulseModel(0);
+  EXPECT_EQ(MeasureFixedPulse(sm, 0).first, 5u);
+  EXPECT_GT(conv.GetMaxFixedPulseFrequency(0), conv.GetMaxStepFrequency());
+
+  // Compensated words hit the requested period with a real pulse width
+  uint32_t pulse = conv.ToPulseCount(DEFAULT_PULSE_WIDTH_NS);
+  for (float frequency : {500.0f, 1000.0f, 100000.0f, 300000.0f,
+                          conv.GetMaxFixedPulseFrequency(pulse)}) {
+    sm = MakeFixedPulseModel(pulse);
+    auto [period, high] =
+        MeasureFixedPulse(sm, conv.ToFixedPulseWord(frequency, pulse));
+    EXPECT_EQ(period, conv.ToPeriod(frequency)) << frequency;
+    EXPECT_GE(high * 1000000000ull / 125000000,
+              DEFAULT_PULSE_WIDTH_NS);
+  }
+}
+
+TEST(PioFixedPulseTest, EmergencyStopKeepsPulseWidth) {
+  const uint32_t pulse = 50;
+  PioModel sm = MakeFixedPulseModel(pulse);
+  sm.Push(100000);
+  sm.Push(100000);
+  sm.Run(20);
+  ASSERT_TRUE(sm.GetPin(STEP_PIN));
+
+  // The same sequence as PIOStepper::AbortImpl()
+  sm.SetEnabled(false);
+  sm.ClearFifos();
+  sm.Restart();
+  sm.Exec(SET_PINS_0);
+  sm.Exec(JMP_0);
+  EXPECT_FALSE(sm.GetPin(STEP_PIN));
+  sm.SetEnabled(true);
+  sm.Run(1000);
+  EXPECT_FALSE(sm.GetPin(STEP_PIN));
+
+  // y survived the restart, the next step has the same pulse
+  auto [period, high] = MeasureFixedPulse(sm, 10);
+  EXPECT_EQ(high, pulse + 2);
+  EXPECT_EQ(period, pulse + 10 + 5);
+}
+
+TEST(PioFixedPulseTest, MicrostepSwitchFollowsTheLastRisingEdge) {
+  for (uint32_t pulse : {0u, 311u}) {
+    for (uint32_t last : {0u, 1000u}) {
+      PioModel sm = MakeFixedPulseModel(pulse);
+      SwitchPoint point = RunMicrostepSwitch(
+          sm, {500, 20, last}, 2000, StepperFixedPulse_offset_pulse);
+
+      EXPECT_EQ(point.edgesBeforeSwitch, 3u) << pulse << " " << last;
+      EXPECT_GT(point.newEdge, point.switchCycle) << pulse << " " << last;
+      EXPECT_EQ(point.newEdge - point.lastOldEdge,
+                Converter::ToFixedPulsePeriod(last, pulse))
+          << pulse << " " << last;
+    }
+  }
+}
+
+} // namespace PIOStepperSpeedController
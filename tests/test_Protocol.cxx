@@ -0,0 +1,522 @@
+#include <PIOStepperSpeedController/Protocol.hxx>
+#include <PIOStepperSpeedController/Stepper.hxx>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+// Records what would go to the state machine, with a simulated FIFO that
+// drains in simulated time as the state machine would
+class StreamAxis : public Stepper<StreamAxis> {
+public:
+  static constexpr uint32_t DEPTH = 4;
+
+  StreamAxis() : Stepper(100, 20000, 100000, 100000) {}
+
+  bool PutStep(float aFrequency) {
+    EXPECT_LT(queue.size(), DEPTH) << "Update() would have blocked";
+    maxPlannedHz = std::max(maxPlannedHz, aFrequency);
+    queue.push_back(1e6 * GetStepScale() / aFrequency);
+    return true;
+  }
+  // A word's two delays taken as microseconds
+  bool PutStepWord(uint32_t aWord) {
+    EXPECT_EQ(GetState(), StepperState::STOPPED);
+    if (queue.size() >= DEPTH) {
+      return false;
+    }
+    words.push_back(aWord);
+    queue.push_back((aWord >> 16) + (aWord & 0xFFFF));
+    CountSteps(1); // as PIOStepper counts them
+    return true;
+  }
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() { queue.clear(); }
+
+  uint32_t GetQueuedSteps() const { return queue.size(); }
+  uint32_t GetQueueDepth() const { return DEPTH; }
+
+  void Advance(double aMicroseconds) {
+    while (aMicroseconds > 0 && (remaining > 0 || !queue.empty())) {
+      if (remaining <= 0) {
+        remaining = queue.front();
+        queue.pop_front();
+      }
+      double step = std::min(aMicroseconds, remaining);
+      remaining -= step;
+      aMicroseconds -= step;
+    }
+  }
+
+  float maxPlannedHz = 0;
+  std::deque<double> queue;
+  double remaining = 0; // of the step being output
+  std::vector<uint32_t> words;
+};
+
+// The host and the device joined by two pipes, standing in for the USB CDC
+// link. Both ends are non-blocking, as tud_cdc_read()/tud_cdc_write() are.
+template <size_t AXES = 1, size_t DEPTH = 64> class PipeLink {
+public:
+  PipeLink() {
+    EXPECT_EQ(pipe2(myToDevice, O_NONBLOCK), 0);
+    EXPECT_EQ(pipe2(myToHost, O_NONBLOCK), 0);
+  }
+  ~PipeLink() {
+    for (int fd : {myToDevice[0], myToDevice[1], myToHost[0], myToHost[1]}) {
+      close(fd);
+    }
+  }
+
+  void Send(FrameType aType, uint8_t aSequence,
+            void (*aFill)(FrameWriter &) = nullptr) {
+    std::array<uint8_t, PROTOCOL_MAX_FRAME> frame;
+    FrameWriter writer(frame.data(), frame.size(), aType, aSequence);
+    if (aFill) {
+      aFill(writer);
+    }
+    Write(frame.data(), writer.Finish());
+  }
+
+  void Write(const uint8_t *aBytes, size_t aSize) {
+    ASSERT_GT(aSize, 0u);
+    ASSERT_EQ(write(myToDevice[1], aBytes, aSize),
+              static_cast<ssize_t>(aSize));
+  }
+
+  // What the device loop does with the transport each pass
+  void PumpDevice() {
+    size_t room;
+    uint8_t *space = device.GetReceiveSpace(room);
+    ssize_t received = read(myToDevice[0], space, room);
+    device.OnReceived(received > 0 ? received : 0);
+    size_t pending;
+    const uint8_t *data = device.GetTransmitData(pending);
+    if (pending > 0) {
+      ssize_t sent = write(myToHost[1], data, pending);
+      device.OnTransmitted(sent > 0 ? sent : 0);
+    }
+  }
+
+  // The next frame from the device, false if none has arrived
+  bool Receive(FrameView &aFrame) {
+    size_t room;
+    uint8_t *space = myHostReceiver.GetWriteSpace(room);
+    ssize_t received = read(myToHost[0], space, room);
+    myHostReceiver.Commit(received > 0 ? received : 0);
+    return myHostReceiver.Next(aFrame);
+  }
+
+  void Add(StreamAxis &anAxis) {
+    device.Add(anAxis);
+    myAxes.push_back(&anAxis);
+  }
+
+  // One pass of the device loop, then the time it took on the state
+  // machines. By default a slow loop, in which even a step at the lowest
+  // speed has been output.
+  uint32_t RunOnce(double aMicroseconds = 10000) {
+    uint32_t stepped = device.RunOnce();
+    Advance(aMicroseconds);
+    return stepped;
+  }
+
+  void Advance(double aMicroseconds) {
+    for (StreamAxis *axis : myAxes) {
+      axis->Advance(aMicroseconds);
+    }
+  }
+
+  ProtocolReply Exchange() {
+    PumpDevice();
+    FrameView frame;
+    ProtocolReply reply{};
+    EXPECT_TRUE(Receive(frame));
+    EXPECT_TRUE(ReadReply(frame, reply));
+    return reply;
+  }
+
+  ProtocolDevice<StreamAxis, AXES, DEPTH> device;
+
+private:
+  int myToDevice[2];
+  int myToHost[2];
+  FrameReceiver<> myHostReceiver;
+  std::vector<StreamAxis *> myAxes;
+};
+
+TEST(Protocol, Crc16MatchesTheCheckValue) {
+  const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+  EXPECT_EQ(Crc16(check, sizeof(check)), 0x29B1);
+}
+
+TEST(Protocol, ReceiverFindsFramesSplitAcrossReadsAndSkipsBadOnes) {
+  std::vector<uint8_t> stream = {0x00, 0x13, 0x37}; // line noise
+  std::array<uint8_t, PROTOCOL_MAX_FRAME> frame;
+  auto append = [&](uint8_t aSequence, bool isCorrupt) {
+    FrameWriter writer(frame.data(), frame.size(), FrameType::SEGMENTS,
+                       aSequence);
+    PutSegment(writer, 0, 1234.5f, 100 + aSequence);
+    size_t size = writer.Finish();
+    if (isCorrupt) {
+      frame[size / 2] ^= 0x40;
+    }
+    stream.insert(stream.end(), frame.begin(), frame.begin() + size);
+  };
+  append(1, false);
+  append(2, true);
+  append(3, false);
+
+  // One byte per read, the worst a transport can do
+  FrameReceiver<> receiver;
+  std::vector<FrameView> frames;
+  std::vector<uint32_t> steps;
+  for (uint8_t byte : stream) {
+    size_t room;
+    *receiver.GetWriteSpace(room) = byte;
+    receiver.Commit(1);
+    FrameView view;
+    while (receiver.Next(view)) {
+      frames.push_back(view);
+      ASSERT_EQ(view.length, SEGMENT_RECORD_BYTES);
+      EXPECT_EQ(ReadU32(&view.payload[4]), 1234500u);
+      steps.push_back(ReadU32(&view.payload[8]));
+    }
+  }
+
+  ASSERT_EQ(frames.size(), 2u);
+  EXPECT_EQ(frames[0].sequence, 1);
+  EXPECT_EQ(frames[1].sequence, 3);
+  EXPECT_EQ(steps, (std::vector<uint32_t>{101, 103}));
+  EXPECT_EQ(receiver.GetBadFrames(), 1u);
+  EXPECT_GT(receiver.GetDroppedBytes(), 0u);
+  EXPECT_EQ(receiver.GetPending(), 0u);
+}
+
+TEST(Protocol, WriterRefusesPayloadsThatDoNotFit) {
+  std::array<uint8_t, PROTOCOL_MAX_FRAME + 16> frame;
+  FrameWriter writer(frame.data(), frame.size(), FrameType::PERIODS, 0);
+  PutPeriodsHeader(writer, 0);
+  for (size_t i = 0; i < PROTOCOL_MAX_PAYLOAD / 4; i++) {
+    writer.Put32(i);
+  }
+  EXPECT_EQ(writer.GetPayloadSize(), PROTOCOL_MAX_PAYLOAD);
+  EXPECT_FALSE(writer.Put8(0));
+  EXPECT_EQ(writer.Finish(), 0u);
+}
+
+TEST(Protocol, SegmentsRunTheAxisOverThePipe) {
+  PipeLink<> link;
+  StreamAxis axis;
+  link.Add(axis);
+
+  link.Send(FrameType::SEGMENTS, 7, [](FrameWriter &aWriter) {
+    PutSegment(aWriter, 0, 5000, 2000);
+    PutSegment(aWriter, 0, 0, 0);
+  });
+  ProtocolReply reply = link.Exchange();
+  EXPECT_TRUE(reply.isAck);
+  EXPECT_EQ(reply.sequence, 7);
+  ASSERT_EQ(reply.axisCount, 1);
+  EXPECT_EQ(reply.freeSlots[0], 62);
+  EXPECT_EQ(link.device.GetQueuedSteps(0), 2000u);
+
+  uint32_t stepsAtSegmentEnd = 0;
+  int calls = 0;
+  do {
+    link.RunOnce();
+    if (stepsAtSegmentEnd == 0 && link.device.GetQueuedSteps(0) == 0) {
+      stepsAtSegmentEnd = axis.GetStepCount();
+    }
+  } while (axis.GetState() != StepperState::STOPPED && ++calls < 100000);
+
+  EXPECT_EQ(axis.GetState(), StepperState::STOPPED);
+  EXPECT_EQ(stepsAtSegmentEnd, 2000u);
+  EXPECT_NEAR(axis.maxPlannedHz, 5000, 1);
+  EXPECT_GT(axis.GetStepCount(), 2000u); // the stop ramp
+  EXPECT_EQ(link.device.GetFreeSlots(0), 64u);
+  EXPECT_EQ(link.device.GetUnderruns(0), 0u);
+}
+
+TEST(Protocol, TargetsSetSeveralAxesInOneFrame) {
+  PipeLink<3> link;
+  std::array<StreamAxis, 3> axes;
+  for (StreamAxis &axis : axes) {
+    link.Add(axis);
+  }
+
+  link.Send(FrameType::TARGETS, 1, [](FrameWriter &aWriter) {
+    PutTarget(aWriter, 0, 1000);
+    PutTarget(aWriter, 2, 3000.5f);
+  });
+  EXPECT_TRUE(link.Exchange().isAck);
+  link.RunOnce();
+
+  EXPECT_NE(axes[0].GetState(), StepperState::STOPPED);
+  EXPECT_EQ(axes[1].GetState(), StepperState::STOPPED);
+  EXPECT_NE(axes[2].GetState(), StepperState::STOPPED);
+  EXPECT_FLOAT_EQ(axes[0].GetTargetFrequency(), 1000);
+  EXPECT_FLOAT_EQ(axes[2].GetTargetFrequency(), 3000.5f);
+  EXPECT_EQ(link.device.GetFreeSlots(0), 64u);
+}
+
+TEST(Protocol, FramesThatDoNotFitAreRefusedWhole) {
+  PipeLink<2, 4> link;
+  StreamAxis x, y;
+  link.Add(x);
+  link.Add(y);
+
+  link.Send(FrameType::TARGETS, 1, [](FrameWriter &aWriter) {
+    PutTarget(aWriter, 1, 100);
+    for (int i = 0; i < 5; i++) {
+      PutTarget(aWriter, 0, 200);
+    }
+  });
+  ProtocolReply reply = link.Exchange();
+  EXPECT_FALSE(reply.isAck);
+  EXPECT_EQ(reply.reason, NakReason::FULL);
+  EXPECT_EQ(reply.freeSlots[0], 4);
+  EXPECT_EQ(reply.freeSlots[1], 4);
+
+  // Within the credits it was given
+  link.Send(FrameType::SEGMENTS, 2, [](FrameWriter &aWriter) {
+    for (int i = 0; i < 4; i++) {
+      PutSegment(aWriter, 0, 200, 10);
+    }
+  });
+  reply = link.Exchange();
+  EXPECT_TRUE(reply.isAck);
+  EXPECT_EQ(reply.freeSlots[0], 0);
+  EXPECT_EQ(reply.freeSlots[1], 4);
+  EXPECT_EQ(link.device.GetQueuedSteps(0), 40u);
+  EXPECT_EQ(link.device.GetRejectedFrames(), 1u);
+}
+
+TEST(Protocol, MalformedFramesAreNaked) {
+  PipeLink<> link;
+  StreamAxis axis;
+  link.Add(axis);
+
+  link.Send(FrameType::SEGMENTS, 1, [](FrameWriter &aWriter) {
+    PutSegment(aWriter, 1, 200, 10); // no axis 1
+  });
+  EXPECT_EQ(link.Exchange().reason, NakReason::INVALID);
+
+  link.Send(FrameType::TARGETS, 2, [](FrameWriter &aWriter) {
+    PutTarget(aWriter, 0, 200);
+    aWriter.Put8(0); // not a whole record
+  });
+  EXPECT_EQ(link.Exchange().reason, NakReason::INVALID);
+
+  link.Send(FrameType::ACK, 3);
+  EXPECT_EQ(link.Exchange().reason, NakReason::TYPE);
+  EXPECT_EQ(link.device.GetFreeSlots(0), 64u);
+}
+
+TEST(Protocol, PeriodBlocksStopTheAxisThenPlayAsSent) {
+  PipeLink<> link;
+  StreamAxis axis;
+  link.Add(axis);
+
+  link.Send(FrameType::SEGMENTS, 1, [](FrameWriter &aWriter) {
+    PutSegment(aWriter, 0, 2000, 300);
+  });
+  link.Send(FrameType::PERIODS, 2, [](FrameWriter &aWriter) {
+    PutPeriodsHeader(aWriter, 0);
+    for (uint32_t i = 1; i <= 6; i++) {
+      aWriter.Put32(i << 20 | i << 4);
+    }
+  });
+  link.PumpDevice();
+  EXPECT_EQ(link.device.GetQueuedSteps(0), 306u);
+
+  // The segment runs, then the axis ramps down before the first word
+  int calls = 0;
+  do {
+    link.RunOnce();
+  } while (axis.GetState() != StepperState::STOPPED && ++calls < 100000);
+  uint32_t stepsBeforeWords = axis.GetStepCount();
+  EXPECT_GT(stepsBeforeWords, 300u);
+  EXPECT_TRUE(axis.words.empty());
+  EXPECT_EQ(link.device.GetQueuedSteps(0), 6u);
+
+  // With no time passing the state machine's queue fills, and the words
+  // that do not fit wait rather than block the device
+  link.Advance(100000);
+  for (int i = 0; i < 10; i++) {
+    link.device.RunOnce();
+  }
+  EXPECT_EQ(axis.words.size(), StreamAxis::DEPTH);
+  EXPECT_EQ(link.device.GetQueuedSteps(0), 2u);
+
+  for (int i = 0; i < 5; i++) {
+    link.RunOnce();
+  }
+  std::vector<uint32_t> sent;
+  for (uint32_t i = 1; i <= 6; i++) {
+    sent.push_back(i << 20 | i << 4);
+  }
+  EXPECT_EQ(axis.words, sent);
+  EXPECT_EQ(axis.GetStepCount(), stepsBeforeWords + 6);
+  EXPECT_EQ(axis.GetState(), StepperState::STOPPED);
+  EXPECT_EQ(link.device.GetQueuedSteps(0), 0u);
+  EXPECT_EQ(link.device.GetUnderruns(0), 1u); // nothing came after them
+}
+
+TEST(Protocol, AFullQueueIsSkippedNotWaitedOn) {
+  PipeLink<2> link;
+  StreamAxis slow, fast;
+  link.Add(slow);
+  link.Add(fast);
+
+  link.Send(FrameType::SEGMENTS, 1, [](FrameWriter &aWriter) {
+    PutSegment(aWriter, 0, 100, 1000);
+    PutSegment(aWriter, 1, 5000, 1000);
+  });
+  EXPECT_TRUE(link.Exchange().isAck);
+
+  // A pass every 0.1ms. The slow axis takes 10ms a step, so its queue is
+  // full after the first passes; waiting on it would hold the fast axis to
+  // its pace. StreamAxis fails the test if a step is put in a full queue.
+  uint32_t skipped = 0;
+  for (int i = 0; i < 2000; i++) {
+    skipped += (link.RunOnce(100) & 1) == 0;
+  }
+  EXPECT_LE(slow.GetStepCount(), StreamAxis::DEPTH + 20);
+  EXPECT_GT(skipped, 1900u);
+  EXPECT_GT(fast.GetStepCount(), 500u);
+  EXPECT_EQ(link.device.GetUnderruns(1), 0u);
+}
+
+TEST(Protocol, RunningDryWhileStreamingIsAnUnderrun) {
+  PipeLink<> link;
+  StreamAxis axis;
+  link.Add(axis);
+
+  link.Send(FrameType::SEGMENTS, 1, [](FrameWriter &aWriter) {
+    PutSegment(aWriter, 0, 3000, 50);
+  });
+  link.PumpDevice();
+  for (int i = 0; i < 200; i++) {
+    link.RunOnce();
+  }
+
+  // It carries on at the last target rather than stopping
+  EXPECT_EQ(link.device.GetUnderruns(0), 1u);
+  EXPECT_NE(axis.GetState(), StepperState::STOPPED);
+  EXPECT_EQ(axis.GetStepCount(), 200u);
+}
+
+TEST(Protocol, ControlStopsEmptyTheQueueAndTelemetryReportsIt) {
+  PipeLink<2> link;
+  StreamAxis x, y;
+  link.Add(x);
+  link.Add(y);
+
+  link.Send(FrameType::SEGMENTS, 1, [](FrameWriter &aWriter) {
+    PutSegment(aWriter, 0, 4000, 100000);
+    PutSegment(aWriter, 1, 4000, 100000);
+  });
+  link.Exchange();
+  for (int i = 0; i < 300; i++) {
+    link.RunOnce();
+  }
+
+  link.Send(FrameType::CONTROL, 2, [](FrameWriter &aWriter) {
+    PutControl(aWriter, ControlOp::STOP, 1);
+  });
+  ProtocolReply reply = link.Exchange();
+  EXPECT_TRUE(reply.isAck);
+  EXPECT_EQ(reply.freeSlots[0], 63);
+  EXPECT_EQ(reply.freeSlots[1], 64);
+  EXPECT_EQ(y.GetState(), StepperState::STOPPING);
+
+  link.Send(FrameType::CONTROL, 3, [](FrameWriter &aWriter) {
+    PutControl(aWriter, ControlOp::TELEMETRY, PROTOCOL_ALL_AXES);
+  });
+  link.PumpDevice();
+  FrameView frame;
+  ASSERT_TRUE(link.Receive(frame));
+  EXPECT_EQ(frame.type, FrameType::TELEMETRY);
+  EXPECT_EQ(frame.sequence, 3);
+  EXPECT_EQ(ReadTelemetryBadFrames(frame), 0u);
+
+  AxisTelemetry telemetry;
+  ASSERT_TRUE(ReadTelemetry(frame, 0, telemetry));
+  EXPECT_EQ(telemetry.state, x.GetState());
+  EXPECT_EQ(telemetry.freeSlots, 63);
+  EXPECT_NEAR(telemetry.currentHz, x.GetCurrentFrequency(), 0.001f);
+  EXPECT_EQ(telemetry.stepCount, 300u);
+  EXPECT_EQ(telemetry.queuedSteps, 100000u - 300u);
+  EXPECT_EQ(telemetry.underruns, 0u);
+  ASSERT_TRUE(ReadTelemetry(frame, 1, telemetry));
+  EXPECT_EQ(telemetry.state, StepperState::STOPPING);
+  EXPECT_EQ(telemetry.queuedSteps, 0u);
+  EXPECT_FALSE(ReadTelemetry(frame, 2, telemetry));
+}
+
+TEST(Protocol, FramesWaitWhileRepliesCannotBeSent) {
+  ProtocolDevice<StreamAxis, 1, 128> device;
+  StreamAxis axis;
+  device.Add(axis);
+
+  // Many frames in one read, and a transport that takes nothing back
+  size_t room;
+  uint8_t *space = device.GetReceiveSpace(room);
+  size_t written = 0;
+  int frames = 0;
+  while (room - written >= PROTOCOL_HEADER_BYTES + TARGET_RECORD_BYTES +
+                               PROTOCOL_CRC_BYTES) {
+    FrameWriter writer(space + written, room - written, FrameType::TARGETS,
+                       static_cast<uint8_t>(frames));
+    PutTarget(writer, 0, 100);
+    written += writer.Finish();
+    frames++;
+  }
+  device.OnReceived(written);
+  size_t pending;
+  device.GetTransmitData(pending);
+  EXPECT_LT(pending, frames * decltype(device)::REPLY_BYTES);
+  EXPECT_GT(device.GetReceiver().GetPending(), 0u);
+
+  // Every frame gets its reply as the transport catches up
+  FrameReceiver<> host;
+  int replies = 0;
+  while (pending > 0) {
+    const uint8_t *data = device.GetTransmitData(pending);
+    size_t hostRoom;
+    uint8_t *hostSpace = host.GetWriteSpace(hostRoom);
+    size_t taken = std::min(pending, std::min<size_t>(hostRoom, 13));
+    std::copy(data, data + taken, hostSpace);
+    host.Commit(taken);
+    device.OnTransmitted(taken);
+    device.GetTransmitData(pending);
+    FrameView frame;
+    ProtocolReply reply;
+    while (host.Next(frame)) {
+      ASSERT_TRUE(ReadReply(frame, reply));
+      EXPECT_TRUE(reply.isAck);
+      EXPECT_EQ(reply.sequence, static_cast<uint8_t>(replies));
+      replies++;
+    }
+  }
+  EXPECT_EQ(replies, frames);
+  EXPECT_EQ(device.GetReceiver().GetPending(), 0u);
+  EXPECT_EQ(device.GetFreeSlots(0), 128u - frames);
+}
+
+TEST(Protocol, AddThrowsWhenFull) {
+  ProtocolDevice<StreamAxis, 1> device;
+  StreamAxis a, b;
+  device.Add(a);
+  EXPECT_THROW(device.Add(b), std::invalid_argument);
+}
+
+} // namespace PIOStepperSpeedController
@@ -0,0 +1,271 @@
+#include <PIOStepperSpeedController/Ramp.hxx>
+#include <PIOStepperSpeedController/Stepper.hxx>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+// Keeps the frequency of every step so the ramps can be measured
+class RampTestStepper : public Stepper<RampTestStepper> {
+public:
+  using Stepper::Stepper;
+
+  bool PutStep(float aFrequency) {
+    steps.push_back(aFrequency);
+    return true;
+  }
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() {}
+
+  std::vector<float> steps;
+};
+
+struct Ramp {
+  uint32_t steps;
+  float seconds;
+};
+
+// Steps until the stepper coasts or stops, and measures the steps and their
+// lengths from aFirst on
+static Ramp RunRamp(RampTestStepper &aStepper, size_t aFirst) {
+  for (int i = 0; i < 10000000; i++) {
+    aStepper.Update();
+    StepperState state = aStepper.GetState();
+    if (state == StepperState::COASTING || state == StepperState::STOPPED) {
+      break;
+    }
+  }
+  Converter converter(125000000, 1); // the constructor's defaults
+  Ramp ramp{0, 0};
+  for (size_t i = aFirst; i < aStepper.steps.size(); i++) {
+    ramp.steps++;
+    ramp.seconds += converter.ToPeriod(aStepper.steps[i]) /
+                    static_cast<float>(converter.GetTickHz());
+  }
+  return ramp;
+}
+
+static void ExpectClose(const Ramp &aRamp, uint32_t aSteps, float aSeconds,
+                        float aTargetHz) {
+  uint32_t stepTolerance = std::max(2u, aRamp.steps / 200);
+  EXPECT_NEAR(aSteps, aRamp.steps, stepTolerance);
+  float secondsTolerance = 1.0f / aTargetHz + aRamp.seconds * 0.005f;
+  EXPECT_NEAR(aSeconds, aRamp.seconds, secondsTolerance);
+}
+
+struct RampCase {
+  uint32_t minSpeed;
+  uint32_t maxSpeed;
+  uint32_t acceleration;
+  uint32_t deceleration;
+  float target;
+};
+
+class RampTest : public ::testing::TestWithParam<RampCase> {};
+
+TEST_P(RampTest, AccelerationMatchesStepping) {
+  const RampCase &param = GetParam();
+  RampTestStepper stepper(param.minSpeed, param.maxSpeed, param.acceleration,
+                          param.deceleration);
+  uint32_t steps = stepper.StepsToReach(param.target);
+  float seconds = stepper.TimeToReach(param.target);
+
+  stepper.SetTargetHz(param.target);
+  stepper.Start();
+  Ramp ramp = RunRamp(stepper, 0);
+  ASSERT_NEAR(stepper.GetCurrentFrequency(), param.target, 0.1f);
+  ExpectClose(ramp, steps, seconds, param.target);
+}
+
+TEST_P(RampTest, StopMatchesStepping) {
+  const RampCase &param = GetParam();
+  RampTestStepper stepper(param.minSpeed, param.maxSpeed, param.acceleration,
+                          param.deceleration);
+  stepper.SetTargetHz(param.target);
+  stepper.Start();
+  RunRamp(stepper, 0);
+
+  uint32_t steps = stepper.StopDistance();
+  float seconds = stepper.TimeToReach(static_cast<float>(param.minSpeed));
+  EXPECT_EQ(steps, stepper.StepsToReach(static_cast<float>(param.minSpeed)));
+
+  size_t first = stepper.steps.size();
+  stepper.Stop();
+  Ramp ramp = RunRamp(stepper, first);
+  ASSERT_EQ(stepper.GetState(), StepperState::STOPPED);
+  ExpectClose(ramp, steps, seconds, static_cast<float>(param.minSpeed));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Profiles, RampTest,
+    ::testing::Values(RampCase{1, 100000, 1000, 2000, 5000},
+                      RampCase{100, 100000, 20000, 20000, 50000},
+                      RampCase{10, 200000, 100000, 50000, 150000},
+                      RampCase{500, 40000, 5000, 10000, 2000},
+                      RampCase{1, 20000, 500, 500, 300}));
+
+TEST(RampTest, ChangeOfSpeedWhileMoving) {
+  RampTestStepper stepper(100, 100000, 20000, 40000);
+  stepper.SetTargetHz(30000);
+  stepper.Start();
+  RunRamp(stepper, 0);
+
+  // Slowing to a lower speed uses the deceleration
+  uint32_t steps = stepper.StepsToReach(8000);
+  float seconds = stepper.TimeToReach(8000);
+  size_t first = stepper.steps.size();
+  stepper.SetTargetHz(8000);
+  Ramp ramp = RunRamp(stepper, first);
+  ASSERT_NEAR(stepper.GetCurrentFrequency(), 8000.0f, 0.1f);
+  ExpectClose(ramp, steps, seconds, 8000);
+
+  // Targets beyond the maximum stop at the maximum
+  steps = stepper.StepsToReach(1e9f);
+  seconds = stepper.TimeToReach(1e9f);
+  first = stepper.steps.size();
+  stepper.SetTargetHz(100000);
+  ramp = RunRamp(stepper, first);
+  ASSERT_NEAR(stepper.GetCurrentFrequency(), 100000.0f, 0.1f);
+  ExpectClose(ramp, steps, seconds, 100000);
+}
+
+TEST(RampTest, FastStopDistance) {
+  RampTestStepper stepper(100, 100000, 20000, 20000);
+  stepper.SetFastStopDeceleration(200000);
+  stepper.SetTargetHz(40000);
+  stepper.Start();
+  RunRamp(stepper, 0);
+
+  uint32_t normal = stepper.StopDistance();
+  stepper.FastStop();
+  uint32_t fast = stepper.StopDistance();
+  EXPECT_LT(fast, normal / 5);
+
+  size_t first = stepper.steps.size();
+  Ramp ramp = RunRamp(stepper, first);
+  EXPECT_NEAR(fast, ramp.steps, std::max(2u, ramp.steps / 200));
+  EXPECT_EQ(stepper.StopDistance(), 0u);
+}
+
+TEST(RampTest, NothingToDo) {
+  RampTestStepper stepper(100, 100000, 20000, 20000);
+  EXPECT_EQ(stepper.StopDistance(), 0u);
+  EXPECT_EQ(stepper.StepsToReach(100), 0u);
+  EXPECT_EQ(stepper.StepsToReach(0), 0u); // clamped to the minimum
+  EXPECT_FLOAT_EQ(stepper.TimeToReach(100), 0.0f);
+  EXPECT_GT(stepper.StepsToReach(1000), 0u);
+}
+
+// Steps a full ramp up to aTarget and back down to a stop
+static std::vector<float> RampUpAndDown(uint32_t aSegment, float aTarget,
+                                        float *aMaxError = nullptr) {
+  RampTestStepper stepper(10, 200000, 100000, 50000);
+  stepper.SetRampSegment(aSegment);
+  stepper.SetTargetHz(aTarget);
+  stepper.Start();
+  RunRamp(stepper, 0);
+  stepper.Stop();
+  RunRamp(stepper, 0);
+  EXPECT_EQ(stepper.GetState(), StepperState::STOPPED);
+  if (aMaxError != nullptr) {
+    *aMaxError = stepper.GetMaxRampErrorTicks();
+  }
+  return stepper.steps;
+}
+
+TEST(RampSegmentTest, StaysWithinTheReportedError) {
+  Converter converter(125000000, 1);
+  float error = 0;
+  std::vector<float> single = RampUpAndDown(1, 150000, &error);
+  EXPECT_EQ(error, 0.0f);
+  std::vector<float> segmented = RampUpAndDown(16, 150000, &error);
+  EXPECT_GT(error, 0.0f);
+  EXPECT_LE(error, 1.0f);
+
+  // Close to the same number of steps, and each fast step within the
+  // reported error of the per step planner, plus a tick for rounding. Slow
+  // steps are not held, but the slow end of the stop starts from a slightly
+  // different frequency, so periods many ticks long differ by more.
+  ASSERT_NEAR(segmented.size(), single.size(), single.size() / 1000);
+  auto periodDifference = [&](float aSingle, float aSegmented) -> uint32_t {
+    if (aSingle < 20000 || aSegmented < 20000) {
+      return 0;
+    }
+    uint32_t a = converter.ToPeriod(aSingle);
+    uint32_t b = converter.ToPeriod(aSegmented);
+    return a > b ? a - b : b - a;
+  };
+  size_t half = std::min(single.size(), segmented.size()) / 2;
+  uint32_t worst = 0;
+  for (size_t i = 0; i < half; i++) {
+    // The ramp up from the start, the stop from the end
+    worst = std::max(worst, periodDifference(single[i], segmented[i]));
+    worst = std::max(worst,
+                     periodDifference(single[single.size() - 1 - i],
+                                      segmented[segmented.size() - 1 - i]));
+  }
+  EXPECT_LE(worst, static_cast<uint32_t>(std::ceil(error)) + 1);
+}
+
+TEST(RampSegmentTest, ComputesFewerSteps) {
+  std::vector<float> segmented = RampUpAndDown(16, 150000);
+  size_t changes = 0;
+  for (size_t i = 1; i < segmented.size(); i++) {
+    if (segmented[i] != segmented[i - 1]) {
+      changes++;
+    }
+  }
+  EXPECT_LT(changes, segmented.size() / 4);
+
+  // Slow steps change the period by many ticks, they are not held
+  for (size_t i = 1; i < 50; i++) {
+    EXPECT_GT(segmented[i], segmented[i - 1]);
+  }
+}
+
+TEST(RampSegmentTest, EmergencyStopEndsTheSegment) {
+  RampTestStepper stepper(10, 200000, 100000, 50000);
+  stepper.SetRampSegment(64);
+  stepper.SetTargetHz(150000);
+  stepper.Start();
+  // Into the fast part of the ramp, where a segment holds many steps
+  while (stepper.GetCurrentFrequency() < 100000) {
+    stepper.Update();
+  }
+  stepper.EmergencyStop();
+
+  // The restart ramps from the minimum at once, nothing is held over
+  stepper.steps.clear();
+  stepper.Start();
+  for (int i = 0; i < 20; i++) {
+    stepper.Update();
+  }
+  ASSERT_EQ(stepper.steps.size(), 20u);
+  for (size_t i = 1; i < stepper.steps.size(); i++) {
+    EXPECT_GT(stepper.steps[i], stepper.steps[i - 1]) << "step " << i;
+  }
+}
+
+TEST(RampSegmentTest, Settings) {
+  RampTestStepper stepper(10, 200000, 100000, 50000);
+  EXPECT_EQ(stepper.GetRampSegment(), 1u);
+  stepper.SetRampSegment(0);
+  EXPECT_EQ(stepper.GetRampSegment(), 1u);
+  stepper.SetRampSegment(1000);
+  EXPECT_EQ(stepper.GetRampSegment(), RampTestStepper::MAX_RAMP_SEGMENT);
+
+  // The error is kept per move
+  stepper.SetTargetHz(150000);
+  stepper.Start();
+  RunRamp(stepper, 0);
+  EXPECT_GT(stepper.GetMaxRampErrorTicks(), 0.0f);
+  stepper.EmergencyStop();
+  stepper.Start();
+  EXPECT_EQ(stepper.GetMaxRampErrorTicks(), 0.0f);
+}
+
+} // namespace PIOStepperSpeedController
@@ -0,0 +1,201 @@
+#include <cstdint> // the generated header expects this to be included first
+#include <PIOStepperSpeedController/PIOStepperSpeedController.pio.h>
+#include <PIOStepperSpeedController/StepStream.hxx>
+#include <PIOStepperSpeedController/StepStreamFile.hxx>
+#include <PioModel.hxx>
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+static constexpr float MIN_SPEED = 1000;
+static constexpr float MAX_SPEED = 50000;
+static constexpr uint32_t ACCELERATION = 500000;
+static constexpr uint32_t DECELERATION = 800000;
+
+// What PIOStepper::PutStep() pushes, live
+class LiveStepper : public Stepper<LiveStepper> {
+public:
+  LiveStepper()
+      : Stepper(MIN_SPEED, MAX_SPEED, ACCELERATION, DECELERATION) {}
+
+  bool PutStep(float aFrequency) {
+    words.push_back(GetConverter().ToStepWord(aFrequency));
+    return true;
+  }
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() {}
+
+  std::vector<uint32_t> words;
+};
+
+// Start, cruise, change speed, stop
+template <typename S> static void DriveProfile(S &aStepper) {
+  aStepper.Start();
+  aStepper.SetTargetHz(40000);
+  for (int i = 0; i < 600; i++) {
+    aStepper.Update();
+  }
+  aStepper.SetTargetHz(15000);
+  for (int i = 0; i < 300; i++) {
+    aStepper.Update();
+  }
+  aStepper.Stop();
+  while (aStepper.Update()) {
+  }
+}
+
+static std::vector<uint32_t> Expand(StepStreamReader aReader) {
+  std::vector<uint32_t> words;
+  aReader.ForEachStep([&](uint32_t aWord) { words.push_back(aWord); });
+  return words;
+}
+
+TEST(StepStreamTest, RoundTrip) {
+  std::vector<uint32_t> steps = {1, 2, 3, 3, 3, 3, 4, 5, 5, 6, 6, 6};
+  std::vector<uint32_t> stream;
+  StepStreamWriter writer(stream, Converter(125000000, 2));
+  for (uint32_t step : steps) {
+    writer.Append(step);
+  }
+  writer.Finish();
+
+  StepStreamReader reader(stream.data(), stream.size());
+  StepStreamHeader header = reader.GetHeader();
+  EXPECT_EQ(header.magic, STEP_STREAM_MAGIC);
+  EXPECT_EQ(header.version, STEP_STREAM_VERSION);
+  EXPECT_EQ(header.sysClk, 125000000u);
+  EXPECT_EQ(header.prescaler, 2u);
+  EXPECT_EQ(header.stepCount, steps.size());
+
+  // literal {1, 2}, run 4 x 3, literal {4, 5, 5}, run 3 x 6
+  StepRecord record;
+  ASSERT_TRUE(reader.Next(record));
+  EXPECT_FALSE(record.isRun);
+  EXPECT_EQ(record.count, 2u);
+  ASSERT_TRUE(reader.Next(record));
+  EXPECT_TRUE(record.isRun);
+  EXPECT_EQ(record.count, 4u);
+  EXPECT_EQ(record.words[0], 3u);
+  ASSERT_TRUE(reader.Next(record));
+  EXPECT_FALSE(record.isRun);
+  EXPECT_EQ(record.count, 3u);
+  ASSERT_TRUE(reader.Next(record));
+  EXPECT_TRUE(record.isRun);
+  EXPECT_EQ(record.count, 3u);
+  EXPECT_FALSE(reader.Next(record));
+
+  EXPECT_EQ(Expand(reader), steps);
+}
+
+TEST(StepStreamTest, RejectsInvalidStreams) {
+  std::vector<uint32_t> stream = {0, STEP_STREAM_VERSION, 125000000, 1, 0};
+  EXPECT_THROW(StepStreamReader(stream.data(), stream.size()),
+               std::invalid_argument);
+  stream[0] = STEP_STREAM_MAGIC;
+  EXPECT_THROW(StepStreamReader(stream.data(), 3), std::invalid_argument);
+  stream[1] = STEP_STREAM_VERSION + 1;
+  EXPECT_THROW(StepStreamReader(stream.data(), stream.size()),
+               std::invalid_argument);
+
+  // A literal claiming more words than there are
+  stream[1] = STEP_STREAM_VERSION;
+  stream.push_back(5);
+  stream.push_back(1234);
+  StepStreamReader reader(stream.data(), stream.size());
+  StepRecord record;
+  EXPECT_THROW(reader.Next(record), std::invalid_argument);
+}
+
+TEST(StepStreamTest, RecordingMatchesLivePlanning) {
+  LiveStepper live;
+  DriveProfile(live);
+
+  std::vector<uint32_t> stream;
+  StepStreamRecorder recorder(stream, MIN_SPEED, MAX_SPEED, ACCELERATION,
+                              DECELERATION);
+  DriveProfile(recorder);
+  recorder.Finish();
+
+  StepStreamReader reader(stream.data(), stream.size());
+  EXPECT_EQ(reader.GetHeader().stepCount, live.words.size());
+  EXPECT_EQ(Expand(reader), live.words);
+
+  // Cruising collapses into runs
+  EXPECT_LT(stream.size(), live.words.size());
+}
+
+TEST(StepStreamTest, RecorderRejectsSpeedsBelowOneWord) {
+  std::vector<uint32_t> stream;
+  // 131078 ticks is the longest word, about 953 Hz at prescaler 1
+  EXPECT_THROW(StepStreamRecorder(stream, 10, MAX_SPEED, ACCELERATION,
+                                  DECELERATION),
+               std::invalid_argument);
+  EXPECT_NO_THROW(StepStreamRecorder(stream, 10, MAX_SPEED, ACCELERATION,
+                                     DECELERATION, 125000000, 125));
+}
+
+TEST(StepStreamTest, MappedFileMatchesRecording) {
+  std::vector<uint32_t> stream;
+  StepStreamRecorder recorder(stream, MIN_SPEED, MAX_SPEED, ACCELERATION,
+                              DECELERATION);
+  DriveProfile(recorder);
+  recorder.Finish();
+
+  std::string path = ::testing::TempDir() + "step_stream_test.pss";
+  WriteStepStreamFile(path, stream);
+  {
+    MappedStepStream mapped(path);
+    ASSERT_EQ(mapped.GetWordCount(), stream.size());
+    EXPECT_EQ(Expand(mapped.GetReader()),
+              Expand(StepStreamReader(stream.data(), stream.size())));
+  }
+  std::remove(path.c_str());
+
+  EXPECT_THROW(MappedStepStream{path}, std::runtime_error);
+}
+
+// Feeds the state machine the way the playback DMA does, a word whenever the
+// FIFO has room, and compares the step timing with live pushes
+TEST(StepStreamTest, PlaybackIsCycleIdenticalToLive) {
+  LiveStepper live;
+  DriveProfile(live);
+  std::vector<uint32_t> stream;
+  StepStreamRecorder recorder(stream, MIN_SPEED, MAX_SPEED, ACCELERATION,
+                              DECELERATION);
+  DriveProfile(recorder);
+  recorder.Finish();
+
+  auto risingEdges = [](const std::vector<uint32_t> &aWords) {
+    PioModel sm(StepperSpeedController_program_instructions,
+                sizeof(StepperSpeedController_program_instructions) /
+                    sizeof(uint16_t),
+                StepperSpeedController_wrap_target,
+                StepperSpeedController_wrap);
+    sm.SetSetPins(0, 1);
+    sm.SetEnabled(true);
+
+    std::vector<uint64_t> edges;
+    size_t next = 0;
+    bool last = false;
+    while (edges.size() < aWords.size()) {
+      if (next < aWords.size() && sm.Push(aWords[next])) {
+        next++;
+      }
+      sm.Clock();
+      if (sm.GetPin(0) && !last) {
+        edges.push_back(sm.GetCycles());
+      }
+      last = sm.GetPin(0);
+    }
+    return edges;
+  };
+
+  std::vector<uint32_t> played =
+      Expand(StepStreamReader(stream.data(), stream.size()));
+  EXPECT_EQ(risingEdges(played), risingEdges(live.words));
+}
+
+} // namespace PIOStepperSpeedController
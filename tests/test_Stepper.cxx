@@ -1,7 +1,9 @@
 #include <PIOStepperSpeedController/Stepper.hxx>
+#include <algorithm>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
+#include <vector>
 
 namespace PIOStepperSpeedController {
 
@@ -20,6 +22,7 @@ public:
   MOCK_METHOD(bool, PutStep, (float aFrequency), ());
   MOCK_METHOD(void, EnableImpl, (), ());
   MOCK_METHOD(void, DisableImpl, (), ());
+  MOCK_METHOD(void, AbortImpl, (), ());
 };
 
 class StepperTest : public ::testing::Test {
@@ -484,6 +487,202 @@ TEST_F(StepperTest, StartAtMinSpeedThenAccelerateToTarget) {
   EXPECT_NEAR(stepper->GetCurrentFrequency(), NEW_SPEED, 1.0f);
 }
 
+TEST_F(StepperTest, EmergencyStopWhileCoasting) {
+  EXPECT_CALL(*stepper, EnableImpl()).Times(2);
+  EXPECT_CALL(*stepper, AbortImpl()).Times(1);
+  EXPECT_CALL(*stepper, DisableImpl()).Times(0);
+
+  stepper->Start();
+  stepper->SetTargetHz(3000);
+
+  uint32_t iterations = 0;
+  while (stepper->Update() && stepper->GetState() != StepperState::COASTING &&
+         iterations++ < MAX_ITERATIONS) {
+  }
+  EXPECT_EQ(stepper->GetState(), StepperState::COASTING);
+
+  // No ramp down, no more steps
+  stepper->EmergencyStop();
+
+  EXPECT_EQ(stepper->GetState(), StepperState::STOPPED);
+  EXPECT_EQ(stepper->GetCurrentFrequency(), 0.0f);
+  EXPECT_FALSE(stepper->Update());
+  EXPECT_NEAR(stepper->GetRequestedFrequency(), 3000.0f, 0.1f);
+
+  // Resynchronized, so a new Start() ramps up from the minimum again
+  stepper->Start();
+  stepper->Update();
+  stepper->Update();
+  EXPECT_EQ(stepper->GetState(), StepperState::ACCELERATING);
+  EXPECT_LT(stepper->GetCurrentFrequency(), 2000.0f);
+}
+
+TEST_F(StepperTest, EmergencyStopWhileStoppingFiresStoppedOnce) {
+  EXPECT_CALL(*callbackProvider, stoppedCallback(CallbackEvent::STOPPED))
+      .Times(1);
+  static MockCallbackProvider *staticProvider = callbackProvider.get();
+  staticProvider = callbackProvider.get();
+  static auto stoppedCb = [](CallbackEvent e) {
+    staticProvider->stoppedCallback(e);
+  };
+
+  auto stepper = std::make_unique<MockStepper>(1, 100000000, 1000, 2000,
+                                               125000000, 1, stoppedCb);
+  ON_CALL(*stepper, PutStep(::testing::_))
+      .WillByDefault(::testing::Return(true));
+  EXPECT_CALL(*stepper, AbortImpl()).Times(2);
+
+  stepper->Start();
+  stepper->SetTargetHz(1000);
+  for (int i = 0; i < 100; i++) {
+    stepper->Update();
+  }
+  stepper->Stop();
+  stepper->Update();
+  EXPECT_EQ(stepper->GetState(), StepperState::STOPPING);
+
+  stepper->EmergencyStop();
+  EXPECT_EQ(stepper->GetState(), StepperState::STOPPED);
+
+  // Already stopped, the hardware is still aborted but no second callback
+  stepper->EmergencyStop();
+}
+
+TEST_F(StepperTest, FastStopUsesFastDeceleration) {
+  EXPECT_CALL(*stepper, EnableImpl()).Times(2);
+  EXPECT_CALL(*stepper, DisableImpl()).Times(2);
+
+  EXPECT_EQ(stepper->GetFastStopDeceleration(), 2000u);
+  stepper->SetFastStopDeceleration(20000);
+  EXPECT_EQ(stepper->GetFastStopDeceleration(), 20000u);
+
+  auto stepsToStop = [this](bool aFast) {
+    stepper->Start();
+    stepper->SetTargetHz(3000);
+    uint32_t iterations = 0;
+    while (stepper->Update() && stepper->GetState() != StepperState::COASTING &&
+           iterations++ < MAX_ITERATIONS) {
+    }
+    EXPECT_EQ(stepper->GetState(), StepperState::COASTING);
+
+    aFast ? stepper->FastStop() : stepper->Stop();
+    uint32_t steps = 0;
+    while (stepper->Update() && steps < MAX_ITERATIONS) {
+      steps++;
+    }
+    EXPECT_EQ(stepper->GetState(), StepperState::STOPPED);
+    return steps;
+  };
+
+  uint32_t normalSteps = stepsToStop(false);
+  uint32_t fastSteps = stepsToStop(true);
+
+  // Stopping distance scales with 1 / deceleration
+  EXPECT_GT(normalSteps, 0u);
+  EXPECT_LT(fastSteps * 5, normalSteps);
+}
+
+TEST_F(StepperTest, FastStopUpgradesNormalStop) {
+  EXPECT_CALL(*stepper, EnableImpl()).Times(1);
+
+  stepper->SetFastStopDeceleration(200000);
+  stepper->Start();
+  stepper->SetTargetHz(3000);
+  uint32_t iterations = 0;
+  while (stepper->Update() && stepper->GetState() != StepperState::COASTING &&
+         iterations++ < MAX_ITERATIONS) {
+  }
+
+  stepper->Stop();
+  stepper->Update();
+  float normalFrequency = stepper->GetCurrentFrequency();
+  stepper->FastStop();
+  stepper->Update();
+
+  EXPECT_EQ(stepper->GetState(), StepperState::STOPPING);
+  // 200000 Hz/s over a ~1/2999 s step is ~66 Hz
+  EXPECT_NEAR(normalFrequency - stepper->GetCurrentFrequency(), 66.7f, 1.0f);
+}
+
+class TransitionRecorder : public StepperObserver {
+public:
+  void OnTransition(StepperState aState) override {
+    transitions.push_back(aState);
+  }
+  void OnStep(uint32_t) override {}
+
+  std::vector<StepperState> transitions;
+};
+
+TEST_F(StepperTest, ObserverSeesEveryTransition) {
+  TransitionRecorder recorder;
+  stepper->SetObserver(&recorder);
+  stepper->SetTargetHz(100);
+  stepper->Start();
+  for (int i = 0; i < 3; i++) {
+    stepper->Update();
+  }
+  stepper->Stop();
+  EXPECT_EQ(recorder.transitions.back(), StepperState::STOPPING);
+  stepper->FastStop(); // already stopping, no transition
+  EXPECT_EQ(recorder.transitions.back(), StepperState::STOPPING);
+  EXPECT_EQ(std::count(recorder.transitions.begin(),
+                       recorder.transitions.end(), StepperState::STOPPING),
+            1);
+
+  stepper->Start();
+  stepper->Update();
+  stepper->FastStop();
+  EXPECT_EQ(recorder.transitions.back(), StepperState::STOPPING);
+  uint32_t iterations = 0;
+  while (stepper->GetState() != StepperState::STOPPED &&
+         iterations++ < MAX_ITERATIONS) {
+    stepper->Update();
+  }
+  EXPECT_EQ(recorder.transitions.back(), StepperState::STOPPED);
+  stepper->SetObserver(nullptr);
+}
+
+// Queues up to 8 steps like the PIO FIFO and throws them away on an abort
+class QueueStepper : public Stepper<QueueStepper> {
+public:
+  QueueStepper() : Stepper(100, 20000, 100000, 100000) {}
+
+  bool PutStep(float) {
+    if (queued == 8) {
+      return false;
+    }
+    queued++;
+    return true;
+  }
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() {
+    DiscardSteps(queued);
+    queued = 0;
+  }
+
+  uint32_t queued = 0;
+};
+
+TEST(QueueStepperTest, EmergencyStopUncountsDiscardedSteps) {
+  QueueStepper stepper;
+  stepper.Start();
+  stepper.SetTargetHz(1000);
+  for (int i = 0; i < 20; i++) {
+    stepper.Update();
+    if (i % 2 == 0 && stepper.queued > 0) {
+      stepper.queued--; // One step leaves the queue every other update
+    }
+  }
+  uint32_t output = stepper.GetStepCount() - stepper.queued;
+  ASSERT_GT(stepper.queued, 0u);
+
+  stepper.EmergencyStop();
+
+  EXPECT_EQ(stepper.GetStepCount(), output);
+}
+
 } // namespace PIOStepperSpeedController
 
 // int main(int argc, char **argv) {
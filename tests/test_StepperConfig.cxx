@@ -0,0 +1,106 @@
+#include <PIOStepperSpeedController/Stepper.hxx>
+#include <PIOStepperSpeedController/StepperConfig.hxx>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+static constexpr StepperConfig TEST_CONFIG{.minSpeed = 1,
+                                           .maxSpeed = 10000000,
+                                           .acceleration = 1000,
+                                           .deceleration = 2000,
+                                           .sysClk = 125000000,
+                                           .prescaler = 1};
+
+// Records every step instead of mocking, so both variants can be compared
+template <typename Params>
+class RecordingStepper : public Stepper<RecordingStepper<Params>, Params> {
+public:
+  using Stepper<RecordingStepper<Params>, Params>::Stepper;
+
+  bool PutStep(float aFrequency) {
+    steps.push_back(aFrequency);
+    return true;
+  }
+  void EnableImpl() {}
+  void DisableImpl() {}
+  void AbortImpl() {}
+
+  std::vector<float> steps;
+};
+
+using RuntimeStepper = RecordingStepper<RuntimeParams>;
+using FixedStepper = RecordingStepper<FixedParams<TEST_CONFIG>>;
+
+static_assert(StepperImpl<RuntimeStepper>);
+static_assert(StepperImpl<FixedStepper>);
+
+// The derived limits are computed by the compiler
+using TestParams = FixedParams<TEST_CONFIG>;
+static_assert(TestParams::TICK_HZ == 125000000.0f);
+static_assert(TestParams::MIN_FREQUENCY == 1.0f);
+static_assert(TestParams::MAX_FREQUENCY == 10000000.0f);
+static_assert(TestParams::MAX_PERIOD == 125000000);
+static_assert(TestParams::MIN_PERIOD == 12);
+static_assert(TestParams::GetConverter().CalculateNextFrequency(100, 1000) ==
+              110.0f);
+
+// maxSpeed is capped by what one tick can do
+static constexpr StepperConfig FAST_CONFIG{.minSpeed = 10,
+                                           .maxSpeed = 1e9f,
+                                           .acceleration = 1,
+                                           .deceleration = 1,
+                                           .sysClk = 125000000,
+                                           .prescaler = 125};
+static_assert(FixedParams<FAST_CONFIG>::MAX_FREQUENCY == 1000000.0f);
+static_assert(FixedParams<FAST_CONFIG>::MIN_PERIOD == 1);
+
+// Footprint budgets. The fixed stepper holds only the callbacks, the observer
+// and the motion state, none of the configuration.
+static_assert(sizeof(FixedParams<TEST_CONFIG>) == 1);
+static_assert(sizeof(Stepper<FixedStepper, FixedParams<TEST_CONFIG>>) <=
+              5 * sizeof(void *) + 6 * sizeof(uint32_t) + 8);
+static_assert(sizeof(Stepper<RuntimeStepper, RuntimeParams>) -
+                  sizeof(Stepper<FixedStepper, FixedParams<TEST_CONFIG>>) >=
+              sizeof(RuntimeParams) - 4);
+
+TEST(StepperConfigTest, FixedMatchesRuntime) {
+  RuntimeStepper runtime(TEST_CONFIG.minSpeed, TEST_CONFIG.maxSpeed,
+                         TEST_CONFIG.acceleration, TEST_CONFIG.deceleration,
+                         TEST_CONFIG.sysClk, TEST_CONFIG.prescaler);
+  FixedStepper fixed;
+
+  auto drive = [](auto &aStepper) {
+    aStepper.Start();
+    aStepper.SetTargetHz(5000);
+    for (int i = 0; i < 20000; i++) {
+      aStepper.Update();
+    }
+    aStepper.SetTargetHz(1200);
+    for (int i = 0; i < 20000; i++) {
+      aStepper.Update();
+    }
+    aStepper.Stop();
+    while (aStepper.Update()) {
+    }
+  };
+  drive(runtime);
+  drive(fixed);
+
+  EXPECT_EQ(fixed.GetState(), StepperState::STOPPED);
+  ASSERT_EQ(runtime.steps.size(), fixed.steps.size());
+  EXPECT_EQ(runtime.steps, fixed.steps);
+}
+
+TEST(StepperConfigTest, FixedStepperLimits) {
+  FixedStepper fixed;
+  EXPECT_EQ(fixed.GetRequestedFrequency(), 1.0f);
+
+  fixed.Start();
+  fixed.SetTargetHz(20000000);
+  EXPECT_EQ(fixed.GetRequestedFrequency(), TestParams::MAX_FREQUENCY);
+  EXPECT_EQ(fixed.GetFastStopDeceleration(), TEST_CONFIG.deceleration);
+}
+
+} // namespace PIOStepperSpeedController
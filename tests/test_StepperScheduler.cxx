@@ -0,0 +1,211 @@
+#include <PIOStepperSpeedController/Stepper.hxx>
+#include <PIOStepperSpeedController/StepperScheduler.hxx>
+#include <cstdint>
+#include <deque>
+#include <gtest/gtest.h>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace PIOStepperSpeedController {
+
+// A stepper with a simulated FIFO that drains in simulated time, as the state
+// machine would
+class SimAxis : public Stepper<SimAxis> {
+public:
+  static constexpr uint32_t DEPTH = 4;
+
+  SimAxis() : Stepper(100, 100000, 200000, 200000) {}
+
+  bool PutStep(float aFrequency) {
+    EXPECT_LT(queue.size(), DEPTH) << "Update() would have blocked";
+    queue.push_back(1e6 * GetStepScale() / aFrequency);
+    return true;
+  }
+  void EnableImpl() { isFilled = false; }
+  void DisableImpl() {}
+  void AbortImpl() { queue.clear(); }
+
+  uint32_t GetQueuedSteps() const { return queue.size(); }
+  uint32_t GetQueueDepth() const { return DEPTH; }
+
+  // Runs the state machine for aMicroseconds, counting the times it ran dry
+  // while the axis was moving
+  void Advance(double aMicroseconds) {
+    while (aMicroseconds > 0) {
+      if (remaining <= 0) {
+        if (queue.empty()) {
+          if (isFilled && !isDry && GetState() != StepperState::STOPPED) {
+            underruns++;
+            isDry = true;
+          }
+          return;
+        }
+        remaining = queue.front();
+        queue.pop_front();
+        isFilled = true;
+        isDry = false;
+      }
+      double step = std::min(aMicroseconds, remaining);
+      remaining -= step;
+      aMicroseconds -= step;
+    }
+  }
+
+  std::deque<double> queue;
+  double remaining = 0; // of the step being output
+  bool isFilled = false;
+  bool isDry = false;
+  uint32_t underruns = 0;
+};
+
+using TestScheduler = StepperScheduler<SimAxis>;
+
+class StepperSchedulerTest : public ::testing::Test {
+protected:
+  // Axes from fast to slow, the slowest takes 20ms to drain a full queue
+  void StartAxes() {
+    const float speeds[] = {40000, 30000, 20000, 15000, 10000, 5000, 1000, 200};
+    for (float speed : speeds) {
+      axes.push_back(std::make_unique<SimAxis>());
+      axes.back()->SetTargetFrequency(speed);
+      axes.back()->Start();
+    }
+  }
+
+  void AdvanceAll(double aMicroseconds) {
+    for (auto &axis : axes) {
+      axis->Advance(aMicroseconds);
+    }
+  }
+
+  uint32_t Underruns() const {
+    uint32_t underruns = 0;
+    for (const auto &axis : axes) {
+      underruns += axis->underruns;
+    }
+    return underruns;
+  }
+
+  // Time one Update() costs, the planner and the push
+  static constexpr double UPDATE_US = 2;
+
+  std::vector<std::unique_ptr<SimAxis>> axes;
+};
+
+TEST_F(StepperSchedulerTest, MostUrgentFirst) {
+  SimAxis fast, slow, stopped;
+  TestScheduler scheduler;
+  scheduler.Add(slow);
+  scheduler.Add(fast);
+  scheduler.Add(stopped);
+  slow.SetTargetFrequency(100);
+  fast.SetTargetFrequency(100);
+  slow.Start();
+  fast.Start();
+
+  // Both empty, the first found goes first, then the other one
+  EXPECT_EQ(scheduler.RunOnce(), 0);
+  EXPECT_EQ(scheduler.RunOnce(), 1);
+
+  // Both hold one step, the faster axis' lasts less
+  fast.SetTargetFrequency(50000);
+  for (int i = 0; i < 20; i++) {
+    fast.Update();
+    fast.queue.clear();
+  }
+  fast.Update();
+  ASSERT_GT(fast.GetCurrentFrequency(), slow.GetCurrentFrequency());
+  ASSERT_EQ(fast.GetQueuedSteps(), slow.GetQueuedSteps());
+  EXPECT_EQ(scheduler.RunOnce(), 1);
+
+  // Full queues are left alone, it does not wait for them
+  while (scheduler.RunOnce() >= 0) {
+  }
+  EXPECT_EQ(fast.GetQueuedSteps(), SimAxis::DEPTH);
+  EXPECT_EQ(slow.GetQueuedSteps(), SimAxis::DEPTH);
+  EXPECT_EQ(stopped.GetQueuedSteps(), 0u);
+  EXPECT_EQ(scheduler.GetStats(2).services, 0u);
+}
+
+TEST_F(StepperSchedulerTest, EightAxesWithoutUnderruns) {
+  StartAxes();
+  TestScheduler scheduler;
+  for (auto &axis : axes) {
+    scheduler.Add(*axis);
+  }
+
+  for (double time = 0; time < 200000;) {
+    double cost = scheduler.RunOnce() >= 0 ? UPDATE_US : UPDATE_US / 4;
+    AdvanceAll(cost);
+    time += cost;
+  }
+
+  EXPECT_EQ(Underruns(), 0u);
+  for (size_t i = 0; i < axes.size(); i++) {
+    SchedulerAxisStats stats = scheduler.GetStats(i);
+    EXPECT_EQ(stats.underruns, 0u) << "axis " << i;
+    EXPECT_GT(stats.minSlackUs, 0u) << "axis " << i;
+    EXPECT_GE(stats.avgSlackUs, stats.minSlackUs) << "axis " << i;
+    EXPECT_NEAR(axes[i]->GetCurrentFrequency(),
+                axes[i]->GetTargetFrequency(), 1.0f);
+  }
+  // The fastest axis has the least slack, about its queue depth's worth less
+  // the step being output
+  EXPECT_LT(scheduler.GetStats(0).minSlackUs, scheduler.GetStats(7).minSlackUs);
+  EXPECT_GT(scheduler.GetStats(0).services, 4000u);
+  EXPECT_EQ(scheduler.GetAxisCount(), 8u);
+}
+
+TEST_F(StepperSchedulerTest, RoundRobinStarvesFastAxes) {
+  // The same axes fed by blocking Update() calls in turn: waiting for room
+  // on a slow axis leaves the fast ones to run dry
+  StartAxes();
+  for (double time = 0; time < 200000;) {
+    for (auto &axis : axes) {
+      while (axis->GetQueuedSteps() >= SimAxis::DEPTH) {
+        AdvanceAll(UPDATE_US / 4);
+        time += UPDATE_US / 4;
+      }
+      axis->Update();
+      AdvanceAll(UPDATE_US);
+      time += UPDATE_US;
+    }
+  }
+  // Dry about once per round, every time the slowest axis is waited on
+  EXPECT_GT(axes[0]->underruns, 20u);
+}
+
+TEST_F(StepperSchedulerTest, StatsAndLimits) {
+  TestScheduler scheduler;
+  SimAxis axes[8];
+  for (auto &axis : axes) {
+    scheduler.Add(axis);
+  }
+  SimAxis extra;
+  EXPECT_THROW(scheduler.Add(extra), std::invalid_argument);
+
+  // Nothing moving, nothing to do
+  EXPECT_EQ(scheduler.RunOnce(), -1);
+  SchedulerAxisStats stats = scheduler.GetStats(0);
+  EXPECT_EQ(stats.services, 0u);
+  EXPECT_EQ(stats.minSlackUs, 0u);
+
+  // A queue found empty after it had filled is an underrun
+  axes[0].SetTargetFrequency(1000);
+  axes[0].Start();
+  scheduler.RunOnce();
+  scheduler.RunOnce();
+  axes[0].queue.clear();
+  scheduler.RunOnce();
+  stats = scheduler.GetStats(0);
+  EXPECT_EQ(stats.services, 3u);
+  EXPECT_EQ(stats.underruns, 1u);
+  EXPECT_EQ(stats.minSlackUs, 0u);
+
+  scheduler.ResetStats();
+  EXPECT_EQ(scheduler.GetStats(0).services, 0u);
+  EXPECT_EQ(scheduler.GetStats(0).underruns, 0u);
+}
+
+} // namespace PIOStepperSpeedController